@@ -0,0 +1,273 @@
+/*
+ * zram throughput benchmark
+ *
+ * Spawns a number of kernel threads which write and then read back
+ * page sized requests on an initialized zram device, so that
+ * zram_bvec_write() and zram_bvec_read() run concurrently on all CPUs,
+ * and reports the aggregated throughput in pages per second.
+ *
+ * Usage:
+ *   echo 1G > /sys/block/zram0/disksize
+ *   insmod zram_bench.ko dev=/dev/zram0 threads=8 pages=16384
+ *
+ * The module always fails to load once the benchmark is done, so that
+ * it can be run again without an explicit rmmod.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+#define KMSG_COMPONENT "zram_bench"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/semaphore.h>
+#include <linux/slab.h>
+
+static char *dev = "/dev/zram0";
+module_param(dev, charp, 0);
+MODULE_PARM_DESC(dev, "zram device to run on (default: /dev/zram0)");
+
+static int threads = 4;
+module_param(threads, int, 0);
+MODULE_PARM_DESC(threads, "Number of threads to spawn (default: 4)");
+
+static int pages = 8192;
+module_param(pages, int, 0);
+MODULE_PARM_DESC(pages, "Number of pages each thread writes and reads (default: 8192)");
+
+struct bench_thread {
+	int id;
+	struct task_struct *task;
+	struct page *page;
+	int err;
+};
+
+static struct block_device *bench_bdev;
+static struct semaphore prestart_sem;
+static struct semaphore startup_sem;
+static struct completion *done;
+static atomic_t running;
+
+static int bench_rw_page(struct page *page, sector_t sector, int rw)
+{
+	struct bio *bio;
+	int ret;
+
+	bio = bio_alloc(GFP_KERNEL, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_iter.bi_sector = sector;
+	bio->bi_bdev = bench_bdev;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	ret = submit_bio_wait(rw, bio);
+	bio_put(bio);
+	return ret;
+}
+
+/*
+ * Fill the page with data that compresses roughly 2:1, so that the
+ * benchmark neither hits the same filled page path nor stores the page
+ * uncompressed.
+ */
+static void bench_fill_page(struct page *page, int seed)
+{
+	u32 *mem = kmap(page);
+	unsigned int i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(*mem); i++)
+		mem[i] = (i & 1) ? prandom_u32() : seed + (i >> 4);
+	kunmap(page);
+}
+
+static int bench_pass(struct bench_thread *bt, int rw)
+{
+	sector_t sector = (sector_t)bt->id * pages * (PAGE_SIZE >> 9);
+	int i, err;
+
+	for (i = 0; i < pages; i++) {
+		err = bench_rw_page(bt->page, sector, rw);
+		if (err)
+			return err;
+		sector += PAGE_SIZE >> 9;
+	}
+	return 0;
+}
+
+static int bench_threadfunc(void *data)
+{
+	struct bench_thread *bt = data;
+	int rw;
+
+	for (rw = WRITE; rw >= READ; rw--) {
+		up(&prestart_sem);
+		if (down_interruptible(&startup_sem))
+			pr_err("thread[%d]: down_interruptible failed\n",
+					bt->id);
+
+		if (!bt->err)
+			bt->err = bench_pass(bt, rw);
+
+		if (atomic_dec_and_test(&running))
+			complete(done);
+	}
+
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule();
+	}
+	return 0;
+}
+
+/*
+ * Wait until all @nr threads are ready for the next pass, release them
+ * at once and measure until the last one finished.
+ */
+static u64 bench_run_pass(int nr, struct completion *pass_done)
+{
+	ktime_t start;
+	int i;
+
+	for (i = 0; i < nr; i++)
+		if (down_interruptible(&prestart_sem))
+			pr_err("down interruptible failed\n");
+
+	done = pass_done;
+	atomic_set(&running, nr);
+	start = ktime_get();
+	for (i = 0; i < nr; i++)
+		up(&startup_sem);
+	wait_for_completion(pass_done);
+
+	return ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+static void bench_report(const char *name, u64 ns)
+{
+	u64 total = (u64)threads * pages;
+
+	pr_info("%s: %llu pages in %llu us, %llu pages/s\n", name, total,
+			div_u64(ns, NSEC_PER_USEC),
+			div64_u64(total * NSEC_PER_SEC, max_t(u64, ns, 1)));
+}
+
+static int __init zram_bench_init(void)
+{
+	DECLARE_COMPLETION_ONSTACK(write_done);
+	DECLARE_COMPLETION_ONSTACK(read_done);
+	struct bench_thread *bt;
+	u64 write_ns, read_ns, capacity;
+	int i, started, err = 0;
+
+	if (threads < 1 || pages < 1)
+		return -EINVAL;
+
+	bench_bdev = blkdev_get_by_path(dev, FMODE_READ | FMODE_WRITE, NULL);
+	if (IS_ERR(bench_bdev)) {
+		pr_err("Can't open %s\n", dev);
+		return PTR_ERR(bench_bdev);
+	}
+
+	capacity = i_size_read(bench_bdev->bd_inode) >> PAGE_SHIFT;
+	if ((u64)threads * pages > capacity) {
+		pr_err("%s holds only %llu pages, need %llu\n", dev, capacity,
+				(u64)threads * pages);
+		err = -ENOSPC;
+		goto out_put;
+	}
+
+	bt = kcalloc(threads, sizeof(*bt), GFP_KERNEL);
+	if (!bt) {
+		err = -ENOMEM;
+		goto out_put;
+	}
+
+	sema_init(&prestart_sem, 0);
+	sema_init(&startup_sem, 0);
+	for (i = 0; i < threads; i++) {
+		bt[i].id = i;
+		bt[i].page = alloc_page(GFP_KERNEL);
+		if (!bt[i].page) {
+			err = -ENOMEM;
+			goto out_free;
+		}
+		bench_fill_page(bt[i].page, i);
+	}
+
+	pr_info("Running on %s with %d threads, %d pages each\n",
+			dev, threads, pages);
+
+	for (started = 0; started < threads; started++) {
+		struct task_struct *task;
+
+		task = kthread_run(bench_threadfunc, &bt[started],
+				"zram_bench/%d", started);
+		if (IS_ERR(task)) {
+			pr_err("kthread_run failed for thread %d\n", started);
+			err = PTR_ERR(task);
+			break;
+		}
+		bt[started].task = task;
+	}
+
+	if (!started)
+		goto out_free;
+
+	/* Threads that did start still run both passes, but skip the I/O */
+	if (err) {
+		for (i = 0; i < started; i++)
+			bt[i].err = err;
+	}
+
+	write_ns = bench_run_pass(started, &write_done);
+	read_ns = bench_run_pass(started, &read_done);
+
+	for (i = 0; i < started; i++) {
+		if (bt[i].err) {
+			pr_err("thread[%d] failed: %d\n", i, bt[i].err);
+			err = bt[i].err;
+		}
+	}
+	if (!err) {
+		bench_report("write", write_ns);
+		bench_report("read", read_ns);
+	}
+
+	for (i = 0; i < started; i++)
+		kthread_stop(bt[i].task);
+out_free:
+	for (i = 0; i < threads; i++)
+		if (bt[i].page)
+			__free_page(bt[i].page);
+	kfree(bt);
+out_put:
+	blkdev_put(bench_bdev, FMODE_READ | FMODE_WRITE);
+
+	/* Nothing to keep loaded */
+	return err ? err : -EAGAIN;
+}
+
+static void __exit zram_bench_exit(void)
+{
+}
+
+module_init(zram_bench_init);
+module_exit(zram_bench_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("zram multi-threaded throughput benchmark");
@@ -30,6 +30,7 @@
 #include <linux/err.h>
 #include <linux/idr.h>
 #include <linux/sysfs.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
@@ -38,6 +39,7 @@ static DEFINE_IDR(zram_index_idr);
 static DEFINE_MUTEX(zram_index_mutex);
 
 static int zram_major;
+static struct workqueue_struct *zram_read_wq;
 static const char *default_compressor = "lzo";
 
 /*
@@ -164,36 +166,526 @@ static inline void update_used_max(struct zram *zram,
 	} while (old_max != cur_max);
 }
 
-static bool page_zero_filled(void *ptr)
+static inline void zram_fill_page(char *ptr, unsigned long len,
+					unsigned long value)
+{
+	unsigned long i;
+	unsigned long *page = (unsigned long *)ptr;
+
+	WARN_ON_ONCE(!IS_ALIGNED(len, sizeof(unsigned long)));
+
+	if (likely(value == 0)) {
+		memset(ptr, 0, len);
+	} else {
+		for (i = 0; i < len / sizeof(*page); i++)
+			page[i] = value;
+	}
+}
+
+/*
+ * Check whether the page consists of one repeated machine word, zero
+ * filled pages being the most common case. On success the word is
+ * returned in @element.
+ */
+static bool page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
+	unsigned long val;
 
 	page = (unsigned long *)ptr;
+	val = page[0];
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos < PAGE_SIZE / sizeof(*page); pos++) {
+		if (val != page[pos])
 			return false;
 	}
 
+	*element = val;
+
 	return true;
 }
 
-static void handle_zero_page(struct bio_vec *bvec)
+static void handle_same_page(struct bio_vec *bvec, unsigned long element)
 {
 	struct page *page = bvec->bv_page;
 	void *user_mem;
 
 	user_mem = kmap_atomic(page);
-	if (is_partial_io(bvec))
-		memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
-	else
-		clear_page(user_mem);
+	zram_fill_page(user_mem + bvec->bv_offset, bvec->bv_len, element);
 	kunmap_atomic(user_mem);
 
 	flush_dcache_page(page);
 }
 
+/*
+ * A slot holds data when it has a zsmalloc handle, was written back to
+ * the backing device or is a same filled page. Caller must hold the slot's
+ * bit_spin_lock.
+ */
+static bool zram_allocated(struct zram_meta *meta, u32 index)
+{
+	return meta->table[index].handle ||
+			zram_test_flag(meta, index, ZRAM_SAME);
+}
+
+/*
+ * Marked slots stay idle until they are read or rewritten. Idle slots
+ * are candidates for writeback and recompression.
+ */
+static ssize_t idle_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct zram_meta *meta;
+	unsigned long nr_pages, index;
+
+	if (!sysfs_streq(buf, "all"))
+		return -EINVAL;
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram)) {
+		up_read(&zram->init_lock);
+		return -EINVAL;
+	}
+
+	meta = zram->meta;
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_pages; index++) {
+		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+		if (zram_allocated(meta, index) &&
+				!zram_test_flag(meta, index, ZRAM_UNDER_WB))
+			zram_set_flag(meta, index, ZRAM_IDLE);
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		cond_resched();
+	}
+	up_read(&zram->init_lock);
+
+	return len;
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+static void zram_free_page(struct zram *zram, size_t index);
+static int zram_decompress_page(struct zram *zram, char *mem, u32 index);
+
+static inline bool zram_wb_enabled(struct zram *zram)
+{
+	return zram->backing_dev;
+}
+
+static void reset_bdev(struct zram *zram)
+{
+	struct block_device *bdev;
+
+	if (!zram_wb_enabled(zram))
+		return;
+
+	bdev = zram->bdev;
+	if (zram->old_block_size)
+		set_blocksize(bdev, zram->old_block_size);
+	blkdev_put(bdev, FMODE_READ|FMODE_WRITE|FMODE_EXCL);
+	/* hope filp_close flush all of IO */
+	filp_close(zram->backing_dev, NULL);
+	zram->backing_dev = NULL;
+	zram->old_block_size = 0;
+	zram->bdev = NULL;
+	vfree(zram->bitmap);
+	zram->bitmap = NULL;
+	zram->nr_pages = 0;
+}
+
+static ssize_t backing_dev_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct file *file;
+	char *p;
+	ssize_t ret;
+
+	down_read(&zram->init_lock);
+	file = zram->backing_dev;
+	if (!file) {
+		up_read(&zram->init_lock);
+		return scnprintf(buf, PAGE_SIZE, "none\n");
+	}
+
+	p = file_path(file, buf, PAGE_SIZE - 1);
+	if (IS_ERR(p)) {
+		ret = PTR_ERR(p);
+		goto out;
+	}
+
+	ret = strlen(p);
+	memmove(buf, p, ret);
+	buf[ret++] = '\n';
+out:
+	up_read(&zram->init_lock);
+	return ret;
+}
+
+static ssize_t backing_dev_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	char *file_name;
+	size_t sz;
+	struct file *backing_dev = NULL;
+	struct inode *inode;
+	struct address_space *mapping;
+	unsigned int old_block_size = 0;
+	unsigned long nr_pages, *bitmap = NULL;
+	struct block_device *bdev = NULL;
+	int err;
+	struct zram *zram = dev_to_zram(dev);
+
+	file_name = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!file_name)
+		return -ENOMEM;
+
+	down_write(&zram->init_lock);
+	if (init_done(zram)) {
+		pr_info("Can't setup backing device for initialized device\n");
+		err = -EBUSY;
+		goto out;
+	}
+
+	strlcpy(file_name, buf, PATH_MAX);
+	/* ignore trailing newline */
+	sz = strlen(file_name);
+	if (sz > 0 && file_name[sz - 1] == '\n')
+		file_name[sz - 1] = 0x00;
+
+	backing_dev = filp_open(file_name, O_RDWR|O_LARGEFILE, 0);
+	if (IS_ERR(backing_dev)) {
+		err = PTR_ERR(backing_dev);
+		backing_dev = NULL;
+		goto out;
+	}
+
+	mapping = backing_dev->f_mapping;
+	inode = mapping->host;
+
+	/* Support only block device in this moment */
+	if (!S_ISBLK(inode->i_mode)) {
+		err = -ENOTBLK;
+		goto out;
+	}
+
+	bdev = bdgrab(I_BDEV(inode));
+	err = blkdev_get(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL, zram);
+	if (err < 0) {
+		bdev = NULL;
+		goto out;
+	}
+
+	nr_pages = i_size_read(inode) >> PAGE_SHIFT;
+	bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (!bitmap) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	old_block_size = block_size(bdev);
+	err = set_blocksize(bdev, PAGE_SIZE);
+	if (err)
+		goto out;
+
+	reset_bdev(zram);
+
+	zram->old_block_size = old_block_size;
+	zram->bdev = bdev;
+	zram->backing_dev = backing_dev;
+	zram->bitmap = bitmap;
+	zram->nr_pages = nr_pages;
+	up_write(&zram->init_lock);
+
+	pr_info("setup backing device %s\n", file_name);
+	kfree(file_name);
+
+	return len;
+out:
+	vfree(bitmap);
+
+	if (bdev)
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+
+	if (backing_dev)
+		filp_close(backing_dev, NULL);
+
+	up_write(&zram->init_lock);
+
+	kfree(file_name);
+
+	return err;
+}
+
+/*
+ * Returns a free block index of the backing device, or 0 if the device
+ * is full. Block 0 is never handed out so that a zero handle keeps
+ * meaning "nothing stored".
+ */
+static unsigned long alloc_block_bdev(struct zram *zram)
+{
+	unsigned long blk_idx = 1;
+retry:
+	blk_idx = find_next_zero_bit(zram->bitmap, zram->nr_pages, blk_idx);
+	if (blk_idx >= zram->nr_pages)
+		return 0;
+
+	if (test_and_set_bit(blk_idx, zram->bitmap))
+		goto retry;
+
+	atomic64_inc(&zram->stats.bd_count);
+	return blk_idx;
+}
+
+static void free_block_bdev(struct zram *zram, unsigned long blk_idx)
+{
+	int was_set;
+
+	was_set = test_and_clear_bit(blk_idx, zram->bitmap);
+	WARN_ON_ONCE(!was_set);
+	atomic64_dec(&zram->stats.bd_count);
+}
+
+/* Synchronously transfer one full page from/to the backing device */
+static int zram_bdev_rw_page(struct zram *zram, struct page *page,
+			unsigned long blk_idx, int rw)
+{
+	struct bio *bio;
+	int ret;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_iter.bi_sector = blk_idx * (PAGE_SIZE >> SECTOR_SHIFT);
+	bio->bi_bdev = zram->bdev;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	ret = submit_bio_wait(rw, bio);
+	bio_put(bio);
+
+	if (rw == READ)
+		atomic64_inc(&zram->stats.bd_reads);
+	else
+		atomic64_inc(&zram->stats.bd_writes);
+
+	return ret;
+}
+
+/*
+ * Read the page stored at @blk_idx of the backing device into @mem.
+ * May sleep, so the caller must not hold the slot lock or any kmap_atomic.
+ */
+static int read_from_bdev(struct zram *zram, char *mem, unsigned long blk_idx)
+{
+	struct page *page;
+	void *src;
+	int ret;
+
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
+
+	ret = zram_bdev_rw_page(zram, page, blk_idx, READ);
+	if (!ret) {
+		src = kmap_atomic(page);
+		memcpy(mem, src, PAGE_SIZE);
+		kunmap_atomic(src);
+	}
+	__free_page(page);
+
+	return ret;
+}
+
+static int zram_bvec_read_from_bdev(struct zram *zram, struct bio_vec *bvec,
+				unsigned long blk_idx, int offset)
+{
+	struct page *page = bvec->bv_page;
+	char *uncmem;
+	void *user_mem;
+	int ret;
+
+	if (!is_partial_io(bvec)) {
+		ret = zram_bdev_rw_page(zram, page, blk_idx, READ);
+		if (!ret)
+			flush_dcache_page(page);
+		return ret;
+	}
+
+	uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
+	if (!uncmem)
+		return -ENOMEM;
+
+	ret = read_from_bdev(zram, uncmem, blk_idx);
+	if (!ret) {
+		user_mem = kmap_atomic(page);
+		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
+				bvec->bv_len);
+		kunmap_atomic(user_mem);
+		flush_dcache_page(page);
+	}
+	kfree(uncmem);
+
+	return ret;
+}
+
+#define IDLE_WRITEBACK			1
+#define HUGE_WRITEBACK			2
+
+static ssize_t writeback_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct zram_meta *meta;
+	unsigned long nr_pages, index, blk_idx = 0;
+	struct page *page;
+	char *mem;
+	ssize_t ret = len;
+	int mode, err;
+
+	if (sysfs_streq(buf, "idle"))
+		mode = IDLE_WRITEBACK;
+	else if (sysfs_streq(buf, "huge"))
+		mode = HUGE_WRITEBACK;
+	else
+		return -EINVAL;
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram)) {
+		ret = -EINVAL;
+		goto release_init_lock;
+	}
+
+	if (!zram_wb_enabled(zram)) {
+		ret = -ENODEV;
+		goto release_init_lock;
+	}
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page) {
+		ret = -ENOMEM;
+		goto release_init_lock;
+	}
+
+	meta = zram->meta;
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_pages; index++) {
+		if (!blk_idx) {
+			blk_idx = alloc_block_bdev(zram);
+			if (!blk_idx) {
+				ret = -ENOSPC;
+				break;
+			}
+		}
+
+		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+		if (!meta->table[index].handle)
+			goto next;
+
+		if (zram_test_flag(meta, index, ZRAM_WB) ||
+				zram_test_flag(meta, index, ZRAM_SAME) ||
+				zram_test_flag(meta, index, ZRAM_UNDER_WB))
+			goto next;
+
+		if (mode == IDLE_WRITEBACK &&
+				!zram_test_flag(meta, index, ZRAM_IDLE))
+			goto next;
+		if (mode == HUGE_WRITEBACK &&
+				!zram_test_flag(meta, index, ZRAM_HUGE))
+			goto next;
+		/*
+		 * Clearing ZRAM_UNDER_WB is the duty of this function,
+		 * zram_free_page() never clears it. ZRAM_IDLE is set for
+		 * huge writeback as well so that any access or rewrite of
+		 * the slot while we are writing it out can be detected.
+		 */
+		zram_set_flag(meta, index, ZRAM_UNDER_WB);
+		zram_set_flag(meta, index, ZRAM_IDLE);
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+
+		mem = kmap(page);
+		err = zram_decompress_page(zram, mem, index);
+		kunmap(page);
+		if (!err)
+			err = zram_bdev_rw_page(zram, page, blk_idx, WRITE);
+
+		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+		if (err) {
+			zram_clear_flag(meta, index, ZRAM_UNDER_WB);
+			zram_clear_flag(meta, index, ZRAM_IDLE);
+			ret = err;
+			goto next;
+		}
+		/*
+		 * The slot lock was dropped during the writeback, so the
+		 * slot may have been accessed, freed or rewritten meanwhile.
+		 * In that case the copy on the backing device is stale and
+		 * the block is reused for the next slot.
+		 */
+		if (!zram_test_flag(meta, index, ZRAM_UNDER_WB) ||
+				!zram_test_flag(meta, index, ZRAM_IDLE)) {
+			zram_clear_flag(meta, index, ZRAM_UNDER_WB);
+			goto next;
+		}
+
+		zram_free_page(zram, index);
+		zram_clear_flag(meta, index, ZRAM_UNDER_WB);
+		zram_set_flag(meta, index, ZRAM_WB);
+		meta->table[index].handle = blk_idx;
+		blk_idx = 0;
+next:
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		cond_resched();
+	}
+
+	if (blk_idx)
+		free_block_bdev(zram, blk_idx);
+	__free_page(page);
+release_init_lock:
+	up_read(&zram->init_lock);
+
+	return ret;
+}
+
+/* Values are reported in 4K units regardless of PAGE_SIZE */
+#define FOUR_K(x) ((x) * (1 << (PAGE_SHIFT - 12)))
+static ssize_t bd_stat_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+	ssize_t ret;
+
+	down_read(&zram->init_lock);
+	ret = scnprintf(buf, PAGE_SIZE,
+			"%8llu %8llu %8llu\n",
+			FOUR_K((u64)atomic64_read(&zram->stats.bd_count)),
+			FOUR_K((u64)atomic64_read(&zram->stats.bd_reads)),
+			FOUR_K((u64)atomic64_read(&zram->stats.bd_writes)));
+	up_read(&zram->init_lock);
+
+	return ret;
+}
+#else
+static inline bool zram_wb_enabled(struct zram *zram) { return false; }
+static inline void reset_bdev(struct zram *zram) {};
+static inline void free_block_bdev(struct zram *zram,
+				unsigned long blk_idx) {};
+static inline int read_from_bdev(struct zram *zram, char *mem,
+				unsigned long blk_idx)
+{
+	return -EIO;
+}
+static inline int zram_bvec_read_from_bdev(struct zram *zram,
+		struct bio_vec *bvec, unsigned long blk_idx, int offset)
+{
+	return -EIO;
+}
+#endif
+
 static ssize_t initstate_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -274,6 +766,27 @@ static ssize_t mem_limit_store(struct device *dev,
 	return len;
 }
 
+static ssize_t async_read_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", READ_ONCE(zram->async_read));
+}
+
+static ssize_t async_read_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	bool val;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (strtobool(buf, &val))
+		return -EINVAL;
+
+	WRITE_ONCE(zram->async_read, val);
+	return len;
+}
+
 static ssize_t mem_used_max_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -311,62 +824,77 @@ static ssize_t mem_used_max_store(struct device *dev,
 	return len;
 }
 
+/*
+ * Compression streams are per-CPU now, so the number of streams always
+ * matches the number of online CPUs. The attribute is kept for
+ * compatibility with existing userspace.
+ */
 static ssize_t max_comp_streams_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
-	int val;
+	return scnprintf(buf, PAGE_SIZE, "%d\n", num_online_cpus());
+}
+
+static ssize_t max_comp_streams_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	deprecated_attr_warn("max_comp_streams");
+	return len;
+}
+
+static ssize_t comp_algorithm_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	size_t sz;
 	struct zram *zram = dev_to_zram(dev);
 
 	down_read(&zram->init_lock);
-	val = zram->max_comp_streams;
+	sz = zcomp_available_show(zram->compressor, buf);
 	up_read(&zram->init_lock);
 
-	return scnprintf(buf, PAGE_SIZE, "%d\n", val);
+	return sz;
 }
 
-static ssize_t max_comp_streams_store(struct device *dev,
+static ssize_t comp_algorithm_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t len)
 {
-	int num;
 	struct zram *zram = dev_to_zram(dev);
-	int ret;
+	size_t sz;
 
-	ret = kstrtoint(buf, 0, &num);
-	if (ret < 0)
-		return ret;
-	if (num < 1)
+	if (!zcomp_available_algorithm(buf))
 		return -EINVAL;
 
 	down_write(&zram->init_lock);
 	if (init_done(zram)) {
-		if (!zcomp_set_max_streams(zram->comp, num)) {
-			pr_info("Cannot change max compression streams\n");
-			ret = -EINVAL;
-			goto out;
-		}
+		up_write(&zram->init_lock);
+		pr_info("Can't change algorithm for initialized device\n");
+		return -EBUSY;
 	}
+	strlcpy(zram->compressor, buf, sizeof(zram->compressor));
+
+	/* ignore trailing newline */
+	sz = strlen(zram->compressor);
+	if (sz > 0 && zram->compressor[sz - 1] == '\n')
+		zram->compressor[sz - 1] = 0x00;
 
-	zram->max_comp_streams = num;
-	ret = len;
-out:
 	up_write(&zram->init_lock);
-	return ret;
+	return len;
 }
 
-static ssize_t comp_algorithm_show(struct device *dev,
+static ssize_t recomp_algorithm_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
 	size_t sz;
 	struct zram *zram = dev_to_zram(dev);
 
 	down_read(&zram->init_lock);
-	sz = zcomp_available_show(zram->compressor, buf);
+	sz = zcomp_available_show(zram->recompressor, buf);
 	up_read(&zram->init_lock);
 
 	return sz;
 }
 
-static ssize_t comp_algorithm_store(struct device *dev,
+static ssize_t recomp_algorithm_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t len)
 {
 	struct zram *zram = dev_to_zram(dev);
@@ -381,12 +909,12 @@ static ssize_t comp_algorithm_store(struct device *dev,
 		pr_info("Can't change algorithm for initialized device\n");
 		return -EBUSY;
 	}
-	strlcpy(zram->compressor, buf, sizeof(zram->compressor));
+	strlcpy(zram->recompressor, buf, sizeof(zram->recompressor));
 
 	/* ignore trailing newline */
-	sz = strlen(zram->compressor);
-	if (sz > 0 && zram->compressor[sz - 1] == '\n')
-		zram->compressor[sz - 1] = 0x00;
+	sz = strlen(zram->recompressor);
+	if (sz > 0 && zram->recompressor[sz - 1] == '\n')
+		zram->recompressor[sz - 1] = 0x00;
 
 	up_write(&zram->init_lock);
 	return len;
@@ -450,14 +978,16 @@ static ssize_t mm_stat_show(struct device *dev,
 	max_used = atomic_long_read(&zram->stats.max_used_pages);
 
 	ret = scnprintf(buf, PAGE_SIZE,
-			"%8llu %8llu %8llu %8lu %8ld %8llu %8lu\n",
+			"%8llu %8llu %8llu %8lu %8ld %8llu %8lu %8llu %8llu\n",
 			orig_size << PAGE_SHIFT,
 			(u64)atomic64_read(&zram->stats.compr_data_size),
 			mem_used << PAGE_SHIFT,
 			zram->limit_pages << PAGE_SHIFT,
 			max_used << PAGE_SHIFT,
-			(u64)atomic64_read(&zram->stats.zero_pages),
-			pool_stats.pages_compacted);
+			(u64)atomic64_read(&zram->stats.same_pages),
+			pool_stats.pages_compacted,
+			(u64)atomic64_read(&zram->stats.huge_pages),
+			(u64)atomic64_read(&zram->stats.recomp_pages));
 	up_read(&zram->init_lock);
 
 	return ret;
@@ -483,7 +1013,9 @@ static inline bool zram_meta_get(struct zram *zram)
 
 static inline void zram_meta_put(struct zram *zram)
 {
-	atomic_dec(&zram->refcount);
+	/* the last reference may be dropped by an in-flight async read */
+	if (atomic_dec_and_test(&zram->refcount))
+		wake_up(&zram->io_done);
 }
 
 static void zram_meta_free(struct zram_meta *meta, u64 disksize)
@@ -495,7 +1027,12 @@ static void zram_meta_free(struct zram_meta *meta, u64 disksize)
 	for (index = 0; index < num_pages; index++) {
 		unsigned long handle = meta->table[index].handle;
 
-		if (!handle)
+		/*
+		 * Written back slots hold a block index and same filled
+		 * slots hold the filling element, not a handle.
+		 */
+		if (!handle || zram_test_flag(meta, index, ZRAM_WB) ||
+				zram_test_flag(meta, index, ZRAM_SAME))
 			continue;
 
 		zs_free(meta->mem_pool, handle);
@@ -545,18 +1082,42 @@ static void zram_free_page(struct zram *zram, size_t index)
 	struct zram_meta *meta = zram->meta;
 	unsigned long handle = meta->table[index].handle;
 
-	if (unlikely(!handle)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(meta, index, ZRAM_ZERO)) {
-			zram_clear_flag(meta, index, ZRAM_ZERO);
+	zram_clear_flag(meta, index, ZRAM_IDLE);
+	zram_clear_flag(meta, index, ZRAM_INCOMPRESSIBLE);
+
+	if (zram_test_flag(meta, index, ZRAM_RECOMP)) {
+		zram_clear_flag(meta, index, ZRAM_RECOMP);
+		atomic64_dec(&zram->stats.recomp_pages);
+	}
+
+	if (zram_test_flag(meta, index, ZRAM_HUGE)) {
+		zram_clear_flag(meta, index, ZRAM_HUGE);
+		atomic64_dec(&zram->stats.huge_pages);
+	}
+
+	if (zram_wb_enabled(zram) && zram_test_flag(meta, index, ZRAM_WB)) {
+		zram_clear_flag(meta, index, ZRAM_WB);
+		free_block_bdev(zram, handle);
+		meta->table[index].handle = 0;
+		return;
+	}
+
+	/*
+	 * No memory is allocated for same element filled pages.
+	 * Simply clear same page flag.
+	 */
+	if (zram_test_flag(meta, index, ZRAM_SAME)) {
+		zram_clear_flag(meta, index, ZRAM_SAME);
+		if (!meta->table[index].element)
 			atomic64_dec(&zram->stats.zero_pages);
-		}
+		meta->table[index].element = 0;
+		atomic64_dec(&zram->stats.same_pages);
 		return;
 	}
 
+	if (unlikely(!handle))
+		return;
+
 	zs_free(meta->mem_pool, handle);
 
 	atomic64_sub(zram_get_obj_size(meta, index),
@@ -567,6 +1128,14 @@ static void zram_free_page(struct zram *zram, size_t index)
 	zram_set_obj_size(meta, index, 0);
 }
 
+/* The algorithm a slot was compressed with. Caller holds the slot lock. */
+static struct zcomp *zram_slot_comp(struct zram *zram, u32 index)
+{
+	if (zram_test_flag(zram->meta, index, ZRAM_RECOMP))
+		return zram->recomp;
+	return zram->comp;
+}
+
 static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
 {
 	int ret = 0;
@@ -579,9 +1148,22 @@ static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
 	handle = meta->table[index].handle;
 	size = zram_get_obj_size(meta, index);
 
-	if (!handle || zram_test_flag(meta, index, ZRAM_ZERO)) {
+	/*
+	 * Reading from the backing device sleeps. zram_bvec_read() handles
+	 * written back slots itself before it maps the destination page, so
+	 * only callers that may sleep get here with ZRAM_WB set.
+	 */
+	if (zram_wb_enabled(zram) && zram_test_flag(meta, index, ZRAM_WB)) {
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		return read_from_bdev(zram, mem, handle);
+	}
+
+	if (!handle || zram_test_flag(meta, index, ZRAM_SAME)) {
+		/* an empty slot reads back as a zero filled page */
+		unsigned long element = meta->table[index].element;
+
 		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
-		memset(mem, 0, PAGE_SIZE);
+		zram_fill_page(mem, PAGE_SIZE, element);
 		return 0;
 	}
 
@@ -589,7 +1171,8 @@ static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
 	if (size == PAGE_SIZE)
 		memcpy(mem, cmem, PAGE_SIZE);
 	else
-		ret = zcomp_decompress(zram->comp, cmem, size, mem);
+		ret = zcomp_decompress(zram_slot_comp(zram, index), cmem,
+				size, mem);
 	zs_unmap_object(meta->mem_pool, handle);
 	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 
@@ -602,6 +1185,158 @@ static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
 	return 0;
 }
 
+/*
+ * Recompress a slot with the secondary algorithm and keep the result only
+ * if it is smaller. Called with the slot lock held: the compression
+ * stream is per-CPU and the new handle is allocated without direct
+ * reclaim, so nothing in here sleeps.
+ */
+static int zram_recompress_slot(struct zram *zram, u32 index,
+				struct page *page)
+{
+	struct zram_meta *meta = zram->meta;
+	unsigned long handle, handle_new;
+	struct zcomp_strm *zstrm;
+	size_t size, clen;
+	void *src, *dst;
+	int ret = 0;
+
+	handle = meta->table[index].handle;
+	size = zram_get_obj_size(meta, index);
+
+	src = zs_map_object(meta->mem_pool, handle, ZS_MM_RO);
+	dst = kmap_atomic(page);
+	if (size == PAGE_SIZE)
+		memcpy(dst, src, PAGE_SIZE);
+	else
+		ret = zcomp_decompress(zram->comp, src, size, dst);
+	kunmap_atomic(dst);
+	zs_unmap_object(meta->mem_pool, handle);
+	if (ret)
+		return ret;
+
+	zstrm = zcomp_stream_get(zram->recomp);
+	src = kmap_atomic(page);
+	ret = zcomp_compress(zram->recomp, zstrm, src, &clen);
+	kunmap_atomic(src);
+	if (ret)
+		goto out;
+
+	/*
+	 * Don't bother if the secondary algorithm saves nothing, and
+	 * don't try this slot again until it is rewritten.
+	 */
+	if (clen >= size || clen > max_zpage_size) {
+		zram_set_flag(meta, index, ZRAM_INCOMPRESSIBLE);
+		goto out;
+	}
+
+	handle_new = zs_malloc(meta->mem_pool, clen,
+			__GFP_KSWAPD_RECLAIM | __GFP_NOWARN |
+			__GFP_HIGHMEM | __GFP_MOVABLE);
+	if (!handle_new) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	dst = zs_map_object(meta->mem_pool, handle_new, ZS_MM_WO);
+	memcpy(dst, zstrm->buffer, clen);
+	zcomp_stream_put(zram->recomp);
+	zs_unmap_object(meta->mem_pool, handle_new);
+
+	zram_free_page(zram, index);
+	meta->table[index].handle = handle_new;
+	zram_set_obj_size(meta, index, clen);
+	zram_set_flag(meta, index, ZRAM_RECOMP);
+
+	atomic64_add(clen, &zram->stats.compr_data_size);
+	atomic64_inc(&zram->stats.pages_stored);
+	atomic64_inc(&zram->stats.recomp_pages);
+	return 0;
+out:
+	zcomp_stream_put(zram->recomp);
+	return ret;
+}
+
+#define RECOMPRESS_IDLE		(1 << 0)
+#define RECOMPRESS_HUGE		(1 << 1)
+
+static ssize_t recompress_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct zram_meta *meta;
+	unsigned long nr_pages, index;
+	struct page *page;
+	ssize_t ret = len;
+	int mode, err;
+
+	if (sysfs_streq(buf, "idle"))
+		mode = RECOMPRESS_IDLE;
+	else if (sysfs_streq(buf, "huge"))
+		mode = RECOMPRESS_HUGE;
+	else if (sysfs_streq(buf, "huge_idle"))
+		mode = RECOMPRESS_IDLE | RECOMPRESS_HUGE;
+	else
+		return -EINVAL;
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram)) {
+		ret = -EINVAL;
+		goto release_init_lock;
+	}
+
+	if (!zram->recomp) {
+		ret = -ENODEV;
+		goto release_init_lock;
+	}
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page) {
+		ret = -ENOMEM;
+		goto release_init_lock;
+	}
+
+	meta = zram->meta;
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_pages; index++) {
+		err = 0;
+
+		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+		if (!meta->table[index].handle)
+			goto next;
+
+		if (zram_test_flag(meta, index, ZRAM_WB) ||
+				zram_test_flag(meta, index, ZRAM_UNDER_WB) ||
+				zram_test_flag(meta, index, ZRAM_SAME) ||
+				zram_test_flag(meta, index, ZRAM_RECOMP) ||
+				zram_test_flag(meta, index, ZRAM_INCOMPRESSIBLE))
+			goto next;
+
+		if ((mode & RECOMPRESS_IDLE) &&
+				!zram_test_flag(meta, index, ZRAM_IDLE))
+			goto next;
+		if ((mode & RECOMPRESS_HUGE) &&
+				!zram_test_flag(meta, index, ZRAM_HUGE))
+			goto next;
+
+		err = zram_recompress_slot(zram, index, page);
+next:
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		if (err) {
+			ret = err;
+			break;
+		}
+		cond_resched();
+	}
+
+	__free_page(page);
+release_init_lock:
+	up_read(&zram->init_lock);
+
+	return ret;
+}
+
 static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 			  u32 index, int offset)
 {
@@ -612,10 +1347,25 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 	page = bvec->bv_page;
 
 	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	/*
+	 * The slot is accessed, so it is not idle anymore. This also makes
+	 * a writeback racing with this read drop the slot instead of
+	 * moving it to the backing device under us.
+	 */
+	zram_clear_flag(meta, index, ZRAM_IDLE);
+	if (zram_wb_enabled(zram) && zram_test_flag(meta, index, ZRAM_WB)) {
+		unsigned long blk_idx = meta->table[index].handle;
+
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		return zram_bvec_read_from_bdev(zram, bvec, blk_idx, offset);
+	}
+
 	if (unlikely(!meta->table[index].handle) ||
-			zram_test_flag(meta, index, ZRAM_ZERO)) {
+			zram_test_flag(meta, index, ZRAM_SAME)) {
+		unsigned long element = meta->table[index].element;
+
 		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
-		handle_zero_page(bvec);
+		handle_same_page(bvec, element);
 		return 0;
 	}
 	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
@@ -656,13 +1406,14 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
 	int ret = 0;
-	size_t clen;
-	unsigned long handle;
+	size_t clen, alloc_len = 0;
+	unsigned long handle = 0;
 	struct page *page;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
 	struct zram_meta *meta = zram->meta;
 	struct zcomp_strm *zstrm = NULL;
 	unsigned long alloced_pages;
+	unsigned long element;
 	static unsigned long zram_rs_time;
 
 	page = bvec->bv_page;
@@ -681,7 +1432,6 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			goto out;
 	}
 
-	zstrm = zcomp_strm_find(zram->comp);
 	user_mem = kmap_atomic(page);
 
 	if (is_partial_io(bvec)) {
@@ -693,29 +1443,42 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		uncmem = user_mem;
 	}
 
-	if (page_zero_filled(uncmem)) {
+	if (page_same_filled(uncmem, &element)) {
 		if (user_mem)
 			kunmap_atomic(user_mem);
 		/* Free memory associated with this sector now. */
 		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
 		zram_free_page(zram, index);
-		zram_set_flag(meta, index, ZRAM_ZERO);
+		zram_set_flag(meta, index, ZRAM_SAME);
+		meta->table[index].element = element;
 		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 
-		atomic64_inc(&zram->stats.zero_pages);
+		atomic64_inc(&zram->stats.same_pages);
+		if (!element)
+			atomic64_inc(&zram->stats.zero_pages);
 		ret = 0;
 		goto out;
 	}
 
-	ret = zcomp_compress(zram->comp, zstrm, uncmem, &clen);
 	if (!is_partial_io(bvec)) {
 		kunmap_atomic(user_mem);
 		user_mem = NULL;
 		uncmem = NULL;
 	}
 
+compress_again:
+	zstrm = zcomp_stream_get(zram->comp);
+	src = uncmem;
+	if (!is_partial_io(bvec))
+		src = kmap_atomic(page);
+	ret = zcomp_compress(zram->comp, zstrm, src, &clen);
+	if (!is_partial_io(bvec))
+		kunmap_atomic(src);
+
 	if (unlikely(ret)) {
 		pr_err("Compression failed! err=%d\n", ret);
+		if (handle)
+			zs_free(meta->mem_pool, handle);
 		goto out;
 	}
 	src = zstrm->buffer;
@@ -725,9 +1488,47 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			src = uncmem;
 	}
 
-	handle = zs_malloc(meta->mem_pool, clen, GFP_NOIO | __GFP_HIGHMEM |
+	/*
+	 * The page may have been modified while the slow path below had
+	 * the stream released, so a handle allocated there is only good
+	 * if the object still has the same size.
+	 */
+	if (handle && clen != alloc_len) {
+		zs_free(meta->mem_pool, handle);
+		handle = 0;
+	}
+
+	/*
+	 * handle allocation has 2 paths:
+	 * a) fast path is executed with preemption disabled (for
+	 *  per-cpu streams) and has __GFP_DIRECT_RECLAIM bit clear,
+	 *  since we can't sleep;
+	 * b) slow path enables preemption and attempts to allocate
+	 *  the page with __GFP_DIRECT_RECLAIM bit set. we have to
+	 *  put per-cpu compression stream and, thus, to re-do
+	 *  the compression once handle is allocated.
+	 *
+	 * if we have a 'non-null' handle here then we are coming
+	 * from the slow path and handle has already been allocated.
+	 */
+	if (!handle)
+		handle = zs_malloc(meta->mem_pool, clen,
+				__GFP_KSWAPD_RECLAIM |
+				__GFP_NOWARN |
+				__GFP_HIGHMEM |
 				__GFP_MOVABLE);
 	if (!handle) {
+		zcomp_stream_put(zram->comp);
+		zstrm = NULL;
+
+		handle = zs_malloc(meta->mem_pool, clen,
+				GFP_NOIO | __GFP_HIGHMEM |
+				__GFP_MOVABLE);
+		if (handle) {
+			alloc_len = clen;
+			goto compress_again;
+		}
+
 		if (printk_timed_ratelimit(&zram_rs_time,
 					   ALLOC_ERROR_LOG_RATE_MS))
 			pr_info("Error allocating memory for compressed page: %u, size=%zu\n",
@@ -756,7 +1557,7 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		memcpy(cmem, src, clen);
 	}
 
-	zcomp_strm_release(zram->comp, zstrm);
+	zcomp_stream_put(zram->comp);
 	zstrm = NULL;
 	zs_unmap_object(meta->mem_pool, handle);
 
@@ -769,6 +1570,10 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 
 	meta->table[index].handle = handle;
 	zram_set_obj_size(meta, index, clen);
+	if (clen == PAGE_SIZE) {
+		zram_set_flag(meta, index, ZRAM_HUGE);
+		atomic64_inc(&zram->stats.huge_pages);
+	}
 	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 
 	/* Update stats */
@@ -776,7 +1581,7 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	atomic64_inc(&zram->stats.pages_stored);
 out:
 	if (zstrm)
-		zcomp_strm_release(zram->comp, zstrm);
+		zcomp_stream_put(zram->comp);
 	if (is_partial_io(bvec))
 		kfree(uncmem);
 	return ret;
@@ -903,6 +1708,51 @@ out:
 	bio_io_error(bio);
 }
 
+struct zram_read_work {
+	struct work_struct work;
+	struct zram *zram;
+	struct bio *bio;
+};
+
+static void zram_read_work_fn(struct work_struct *work)
+{
+	struct zram_read_work *zrw = container_of(work, struct zram_read_work,
+						 work);
+	struct zram *zram = zrw->zram;
+
+	__zram_make_request(zram, zrw->bio);
+	zram_meta_put(zram);
+	kfree(zrw);
+}
+
+/*
+ * Swap readahead submits a cluster of single page read bios back to back.
+ * Instead of decompressing them one after another in the faulting task,
+ * hand each bio to an unbound worker so the cluster is decompressed on
+ * whatever CPUs are idle. The bio is completed from the worker and the
+ * worker inherits the caller's zram_meta reference.
+ *
+ * Returns false if the bio has to be handled synchronously.
+ */
+static bool zram_queue_read(struct zram *zram, struct bio *bio)
+{
+	struct zram_read_work *zrw;
+
+	if (!READ_ONCE(zram->async_read) || bio_data_dir(bio) != READ ||
+			(bio->bi_rw & REQ_DISCARD))
+		return false;
+
+	zrw = kmalloc(sizeof(*zrw), GFP_NOIO | __GFP_NOWARN);
+	if (!zrw)
+		return false;
+
+	INIT_WORK(&zrw->work, zram_read_work_fn);
+	zrw->zram = zram;
+	zrw->bio = bio;
+	queue_work(zram_read_wq, &zrw->work);
+	return true;
+}
+
 /*
  * Handler function for all zram I/O requests.
  */
@@ -921,6 +1771,9 @@ static blk_qc_t zram_make_request(struct request_queue *queue, struct bio *bio)
 		goto put_zram;
 	}
 
+	if (zram_queue_read(zram, bio))
+		return BLK_QC_T_NONE;
+
 	__zram_make_request(zram, bio);
 	zram_meta_put(zram);
 	return BLK_QC_T_NONE;
@@ -955,6 +1808,13 @@ static int zram_rw_page(struct block_device *bdev, sector_t sector,
 	struct bio_vec bv;
 
 	zram = bdev->bd_disk->private_data;
+	/*
+	 * Let async reads take the bio path, which is what swap_readpage()
+	 * falls back to on error.
+	 */
+	if (rw == READ && READ_ONCE(zram->async_read))
+		return -EOPNOTSUPP;
+
 	if (unlikely(!zram_meta_get(zram)))
 		goto out;
 
@@ -991,7 +1851,7 @@ out:
 static void zram_reset_device(struct zram *zram)
 {
 	struct zram_meta *meta;
-	struct zcomp *comp;
+	struct zcomp *comp, *recomp;
 	u64 disksize;
 
 	down_write(&zram->init_lock);
@@ -999,12 +1859,14 @@ static void zram_reset_device(struct zram *zram)
 	zram->limit_pages = 0;
 
 	if (!init_done(zram)) {
+		reset_bdev(zram);
 		up_write(&zram->init_lock);
 		return;
 	}
 
 	meta = zram->meta;
 	comp = zram->comp;
+	recomp = zram->recomp;
 	disksize = zram->disksize;
 	/*
 	 * Refcount will go down to 0 eventually and r/w handler
@@ -1018,10 +1880,16 @@ static void zram_reset_device(struct zram *zram)
 	 */
 	wait_event(zram->io_done, atomic_read(&zram->refcount) == 0);
 
+	/*
+	 * Written back slots are only referenced by the table, which is
+	 * freed below, so the backing device can go away now.
+	 */
+	reset_bdev(zram);
+
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
 	zram->disksize = 0;
-	zram->max_comp_streams = 1;
+	zram->recomp = NULL;
 
 	set_capacity(zram->disk, 0);
 	part_stat_set_all(&zram->disk->part0, 0);
@@ -1030,13 +1898,15 @@ static void zram_reset_device(struct zram *zram)
 	/* I/O operation under all of CPU are done so let's free */
 	zram_meta_free(meta, disksize);
 	zcomp_destroy(comp);
+	if (recomp)
+		zcomp_destroy(recomp);
 }
 
 static ssize_t disksize_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t len)
 {
 	u64 disksize;
-	struct zcomp *comp;
+	struct zcomp *comp, *recomp = NULL;
 	struct zram_meta *meta;
 	struct zram *zram = dev_to_zram(dev);
 	int err;
@@ -1050,7 +1920,7 @@ static ssize_t disksize_store(struct device *dev,
 	if (!meta)
 		return -ENOMEM;
 
-	comp = zcomp_create(zram->compressor, zram->max_comp_streams);
+	comp = zcomp_create(zram->compressor);
 	if (IS_ERR(comp)) {
 		pr_err("Cannot initialise %s compressing backend\n",
 				zram->compressor);
@@ -1058,10 +1928,22 @@ static ssize_t disksize_store(struct device *dev,
 		goto out_free_meta;
 	}
 
+	if (zram->recompressor[0]) {
+		recomp = zcomp_create(zram->recompressor);
+		if (IS_ERR(recomp)) {
+			pr_err("Cannot initialise %s recompressing backend\n",
+					zram->recompressor);
+			err = PTR_ERR(recomp);
+			recomp = NULL;
+			goto out_destroy_comp;
+		}
+	}
+
 	down_write(&zram->init_lock);
 	if (init_done(zram)) {
 		pr_info("Cannot change disksize for initialized device\n");
 		err = -EBUSY;
+		up_write(&zram->init_lock);
 		goto out_destroy_comp;
 	}
 
@@ -1069,6 +1951,7 @@ static ssize_t disksize_store(struct device *dev,
 	atomic_set(&zram->refcount, 1);
 	zram->meta = meta;
 	zram->comp = comp;
+	zram->recomp = recomp;
 	zram->disksize = disksize;
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 	up_write(&zram->init_lock);
@@ -1083,7 +1966,8 @@ static ssize_t disksize_store(struct device *dev,
 	return len;
 
 out_destroy_comp:
-	up_write(&zram->init_lock);
+	if (recomp)
+		zcomp_destroy(recomp);
 	zcomp_destroy(comp);
 out_free_meta:
 	zram_meta_free(meta, disksize);
@@ -1165,8 +2049,17 @@ static DEVICE_ATTR_RO(orig_data_size);
 static DEVICE_ATTR_RO(mem_used_total);
 static DEVICE_ATTR_RW(mem_limit);
 static DEVICE_ATTR_RW(mem_used_max);
+static DEVICE_ATTR_RW(async_read);
 static DEVICE_ATTR_RW(max_comp_streams);
 static DEVICE_ATTR_RW(comp_algorithm);
+static DEVICE_ATTR_WO(idle);
+static DEVICE_ATTR_RW(recomp_algorithm);
+static DEVICE_ATTR_WO(recompress);
+#ifdef CONFIG_ZRAM_WRITEBACK
+static DEVICE_ATTR_RW(backing_dev);
+static DEVICE_ATTR_WO(writeback);
+static DEVICE_ATTR_RO(bd_stat);
+#endif
 
 static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_disksize.attr,
@@ -1185,8 +2078,17 @@ static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_mem_used_total.attr,
 	&dev_attr_mem_limit.attr,
 	&dev_attr_mem_used_max.attr,
+	&dev_attr_async_read.attr,
 	&dev_attr_max_comp_streams.attr,
 	&dev_attr_comp_algorithm.attr,
+	&dev_attr_idle.attr,
+	&dev_attr_recomp_algorithm.attr,
+	&dev_attr_recompress.attr,
+#ifdef CONFIG_ZRAM_WRITEBACK
+	&dev_attr_backing_dev.attr,
+	&dev_attr_writeback.attr,
+	&dev_attr_bd_stat.attr,
+#endif
 	&dev_attr_io_stat.attr,
 	&dev_attr_mm_stat.attr,
 	NULL,
@@ -1288,7 +2190,6 @@ static int zram_add(void)
 	}
 	strlcpy(zram->compressor, default_compressor, sizeof(zram->compressor));
 	zram->meta = NULL;
-	zram->max_comp_streams = 1;
 
 	pr_info("Added device: %s\n", zram->disk->disk_name);
 	return device_id;
@@ -1423,15 +2324,22 @@ static void destroy_devices(void)
 	idr_for_each(&zram_index_idr, &zram_remove_cb, NULL);
 	idr_destroy(&zram_index_idr);
 	unregister_blkdev(zram_major, "zram");
+	destroy_workqueue(zram_read_wq);
 }
 
 static int __init zram_init(void)
 {
 	int ret;
 
+	zram_read_wq = alloc_workqueue("zram_read",
+			WQ_UNBOUND | WQ_HIGHPRI | WQ_MEM_RECLAIM, 0);
+	if (!zram_read_wq)
+		return -ENOMEM;
+
 	ret = class_register(&zram_control_class);
 	if (ret) {
 		pr_err("Unable to register zram-control class\n");
+		destroy_workqueue(zram_read_wq);
 		return ret;
 	}
 
@@ -1439,6 +2347,7 @@ static int __init zram_init(void)
 	if (zram_major <= 0) {
 		pr_err("Unable to get major number\n");
 		class_unregister(&zram_control_class);
+		destroy_workqueue(zram_read_wq);
 		return -EBUSY;
 	}
 
@@ -59,9 +59,15 @@ static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /* Flags for zram pages (table[page_no].value) */
 enum zram_pageflags {
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO = ZRAM_FLAG_SHIFT,
+	/* Page consists of the same element, e.g. entirely of zeros */
+	ZRAM_SAME = ZRAM_FLAG_SHIFT,
 	ZRAM_ACCESS,	/* page is now accessed */
+	ZRAM_WB,	/* page is stored on backing_device */
+	ZRAM_UNDER_WB,	/* page is under writeback */
+	ZRAM_HUGE,	/* incompressible page */
+	ZRAM_IDLE,	/* not accessed page since last idle marking */
+	ZRAM_RECOMP,	/* page is compressed with the secondary algorithm */
+	ZRAM_INCOMPRESSIBLE, /* secondary algorithm saved nothing */
 
 	__NR_ZRAM_PAGEFLAGS,
 };
@@ -70,7 +76,12 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct zram_table_entry {
-	unsigned long handle;
+	union {
+		/* zsmalloc handle, or backing device block index (ZRAM_WB) */
+		unsigned long handle;
+		/* repeated word of a same filled page (ZRAM_SAME) */
+		unsigned long element;
+	};
 	unsigned long value;
 };
 
@@ -83,8 +94,16 @@ struct zram_stats {
 	atomic64_t invalid_io;	/* non-page-aligned I/O requests */
 	atomic64_t notify_free;	/* no. of swap slot free notifications */
 	atomic64_t zero_pages;		/* no. of zero filled pages */
+	atomic64_t same_pages;		/* no. of same element filled pages */
 	atomic64_t pages_stored;	/* no. of pages currently stored */
 	atomic_long_t max_used_pages;	/* no. of maximum pages stored */
+	atomic64_t huge_pages;		/* no. of huge pages */
+	atomic64_t recomp_pages;	/* no. of pages stored recompressed */
+#ifdef CONFIG_ZRAM_WRITEBACK
+	atomic64_t bd_count;		/* no. of pages in backing device */
+	atomic64_t bd_reads;		/* no. of reads from backing device */
+	atomic64_t bd_writes;		/* no. of writes to backing device */
+#endif
 };
 
 struct zram_meta {
@@ -95,6 +114,8 @@ struct zram_meta {
 struct zram {
 	struct zram_meta *meta;
 	struct zcomp *comp;
+	/* optional secondary algorithm used to recompress cold pages */
+	struct zcomp *recomp;
 	struct gendisk *disk;
 	/* Prevent concurrent execution of device init */
 	struct rw_semaphore init_lock;
@@ -102,7 +123,6 @@ struct zram {
 	 * the number of pages zram can consume for storing compressed data
 	 */
 	unsigned long limit_pages;
-	int max_comp_streams;
 
 	struct zram_stats stats;
 	atomic_t refcount; /* refcount for zram_meta */
@@ -114,9 +134,20 @@ struct zram {
 	 */
 	u64 disksize;	/* bytes */
 	char compressor[10];
+	char recompressor[10];
 	/*
 	 * zram is claimed so open request will be failed
 	 */
 	bool claim; /* Protected by bdev->bd_mutex */
+	/* decompress read bios asynchronously on zram_read_wq */
+	bool async_read;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	struct file *backing_dev;
+	struct block_device *bdev;
+	unsigned int old_block_size;
+	/* allocation bitmap of backing device blocks, bit 0 is reserved */
+	unsigned long *bitmap;
+	unsigned long nr_pages;
+#endif
 };
 #endif
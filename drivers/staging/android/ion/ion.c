@@ -26,10 +26,12 @@
 #include <linux/list_sort.h>
 #include <linux/memblock.h>
 #include <linux/miscdevice.h>
+#include <linux/moduleparam.h>
 #include <linux/export.h>
 #include <linux/mm.h>
 #include <linux/mm_types.h>
 #include <linux/rbtree.h>
+#include <linux/rcupdate.h>
 #include <linux/slab.h>
 #include <linux/seq_file.h>
 #include <linux/uaccess.h>
@@ -46,6 +48,10 @@
 #include "ion_priv.h"
 #include "compat_ion.h"
 
+/* Free buffers of all heaps from a kernel thread instead of the caller */
+static bool ion_defer_free = true;
+module_param_named(defer_free, ion_defer_free, bool, S_IRUGO);
+
 /**
  * struct ion_device - the metadata of the ion device node
  * @dev:		the actual misc device
@@ -75,7 +81,8 @@ struct ion_device {
  * @dev:		backpointer to ion device
  * @handles:		an rb tree of all the handles in this client
  * @idr:		an idr space for allocating handle ids
- * @lock:		lock protecting the tree of handles
+ * @lock:		lock protecting the tree of handles and inserts into or
+ *			removals from the idr
  * @name:		used for debugging
  * @display_name:	used for debugging (unique version of @name)
  * @display_serial:	used for debugging (to make display_name unique)
@@ -84,6 +91,9 @@ struct ion_device {
  * A client represents a list of buffers this client may access.
  * The mutex stored here is used to protect both handles tree
  * as well as the handles themselves, and should be held while modifying either.
+ * Looking a handle up by id only needs rcu_read_lock(): handles are freed
+ * after a grace period and the last reference is only ever dropped with
+ * the mutex held, so kref_get_unless_zero() on an idr entry is safe.
  */
 struct ion_client {
 	struct rb_node node;
@@ -107,6 +117,7 @@ struct ion_client {
  * @node:		node in the client's handle rbtree
  * @kmap_cnt:		count of times this client has mapped to kernel
  * @id:			client-unique id allocated by client->idr
+ * @rcu:		for freeing the handle after lockless idr lookups
  *
  * Modifications to node, map_cnt or mapping should be protected by the
  * lock in the client.  Other fields are never changed after initialization.
@@ -118,6 +129,7 @@ struct ion_handle {
 	struct rb_node node;
 	unsigned int kmap_cnt;
 	int id;
+	struct rcu_head rcu;
 };
 
 static struct ion_device *ion_dev;
@@ -388,7 +400,16 @@ static void ion_handle_destroy(struct kref *kref)
 	ion_buffer_remove_from_handle(buffer);
 	ion_buffer_put(buffer);
 
-	kfree(handle);
+	kfree_rcu(handle, rcu);
+}
+
+static void ion_handle_release(struct kref *kref)
+{
+	struct ion_handle *handle = container_of(kref, struct ion_handle, ref);
+	struct ion_client *client = handle->client;
+
+	ion_handle_destroy(kref);
+	mutex_unlock(&client->lock);
 }
 
 struct ion_buffer *ion_handle_buffer(struct ion_handle *handle)
@@ -413,13 +434,9 @@ static int ion_handle_put_nolock(struct ion_handle *handle)
 int ion_handle_put(struct ion_handle *handle)
 {
 	struct ion_client *client = handle->client;
-	int ret;
-
-	mutex_lock(&client->lock);
-	ret = ion_handle_put_nolock(handle);
-	mutex_unlock(&client->lock);
 
-	return ret;
+	/* only the final put needs the lock, to remove the handle */
+	return kref_put_mutex(&handle->ref, ion_handle_release, &client->lock);
 }
 
 static struct ion_handle *ion_handle_lookup(struct ion_client *client,
@@ -457,18 +474,25 @@ struct ion_handle *ion_handle_get_by_id(struct ion_client *client,
 {
 	struct ion_handle *handle;
 
-	mutex_lock(&client->lock);
-	handle = ion_handle_get_by_id_nolock(client, id);
-	mutex_unlock(&client->lock);
+	rcu_read_lock();
+	handle = idr_find(&client->idr, id);
+	if (handle && !kref_get_unless_zero(&handle->ref))
+		handle = NULL;
+	rcu_read_unlock();
 
-	return handle;
+	return handle ? handle : ERR_PTR(-EINVAL);
 }
 
 static bool ion_handle_validate(struct ion_client *client,
 				struct ion_handle *handle)
 {
-	WARN_ON(!mutex_is_locked(&client->lock));
-	return idr_find(&client->idr, handle->id) == handle;
+	bool valid;
+
+	rcu_read_lock();
+	valid = idr_find(&client->idr, handle->id) == handle;
+	rcu_read_unlock();
+
+	return valid;
 }
 
 static int ion_handle_add(struct ion_client *client, struct ion_handle *handle)
@@ -1334,16 +1358,14 @@ struct dma_buf *ion_share_dma_buf(struct ion_client *client,
 	struct dma_buf *dmabuf;
 	bool valid_handle;
 
-	mutex_lock(&client->lock);
+	/* the caller's reference on @handle keeps the buffer alive */
 	valid_handle = ion_handle_validate(client, handle);
 	if (!valid_handle) {
 		WARN(1, "%s: invalid handle passed to share.\n", __func__);
-		mutex_unlock(&client->lock);
 		return ERR_PTR(-EINVAL);
 	}
 	buffer = handle->buffer;
 	ion_buffer_get(buffer);
-	mutex_unlock(&client->lock);
 
 	exp_info.ops = &dma_buf_ops;
 	exp_info.size = buffer->size;
@@ -1783,9 +1805,26 @@ static int ion_debug_heap_show(struct seq_file *s, void *unused)
 	seq_printf(s, "%16s %16zu\n", "total orphaned",
 		   total_orphaned_size);
 	seq_printf(s, "%16s %16zu\n", "total ", total_size);
-	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE)
+	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE) {
+		size_t free_list_size, free_list_count;
+		u64 freed_deferred, freed_drained;
+
+		spin_lock(&heap->free_lock);
+		free_list_size = heap->free_list_size;
+		free_list_count = heap->free_list_count;
+		freed_deferred = heap->freed_deferred;
+		freed_drained = heap->freed_drained;
+		spin_unlock(&heap->free_lock);
+
 		seq_printf(s, "%16s %16zu\n", "deferred free",
-				heap->free_list_size);
+				free_list_size);
+		seq_printf(s, "%16s %16zu\n", "deferred buffers",
+				free_list_count);
+		seq_printf(s, "%16s %16llu\n", "freed by thread",
+				freed_deferred);
+		seq_printf(s, "%16s %16llu\n", "freed drained",
+				freed_drained);
+	}
 	seq_puts(s, "----------------------------------------------------\n");
 
 	if (heap->debug_show)
@@ -1879,9 +1918,17 @@ void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap)
 
 	spin_lock_init(&heap->free_lock);
 	heap->free_list_size = 0;
+	heap->free_list_count = 0;
+	heap->freed_deferred = 0;
+	heap->freed_drained = 0;
 
-	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE)
-		ion_heap_init_deferred_free(heap);
+	if (ion_defer_free)
+		heap->flags |= ION_HEAP_FLAG_DEFER_FREE;
+
+	/* Without a thread to drain it, a free list would only grow */
+	if ((heap->flags & ION_HEAP_FLAG_DEFER_FREE) &&
+	    ion_heap_init_deferred_free(heap))
+		heap->flags &= ~ION_HEAP_FLAG_DEFER_FREE;
 
 	if ((heap->flags & ION_HEAP_FLAG_DEFER_FREE) || heap->ops->shrink)
 		ion_heap_init_shrinker(heap);
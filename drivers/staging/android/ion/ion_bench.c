@@ -0,0 +1,209 @@
+/*
+ * drivers/staging/android/ion/ion_bench.c
+ *
+ * ion system heap allocation benchmark
+ *
+ * For every combination of buffer size and thread count, spawns that
+ * many kernel threads which allocate and free buffers of that size
+ * from the system heap in a loop, so that ion_system_heap_allocate()
+ * and the page pools run concurrently on all CPUs, and reports the
+ * aggregated throughput.
+ *
+ * Usage:
+ *   insmod ion_bench.ko sizes=4096,65536,1048576 threads=1,4,8 loops=256
+ *   rmmod ion_bench
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#define pr_fmt(fmt) "ion_bench: " fmt
+
+#include <linux/err.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/msm_ion.h>
+#include <linux/sched.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
+#include "ion.h"
+
+#define ION_BENCH_MAX_RUNS	8
+
+static unsigned int sizes[ION_BENCH_MAX_RUNS] = { SZ_4K, SZ_64K, SZ_1M, SZ_8M };
+static int nr_sizes = 4;
+module_param_array(sizes, uint, &nr_sizes, 0);
+MODULE_PARM_DESC(sizes, "Buffer sizes to allocate (default: 4K,64K,1M,8M)");
+
+static unsigned int threads[ION_BENCH_MAX_RUNS] = { 1, 2, 4, 8 };
+static int nr_counts = 4;
+module_param_array(threads, uint, &nr_counts, 0);
+MODULE_PARM_DESC(threads, "Thread counts to run with (default: 1,2,4,8)");
+
+static unsigned int loops = 256;
+module_param(loops, uint, 0);
+MODULE_PARM_DESC(loops, "Buffers each thread allocates and frees per run (default: 256)");
+
+static bool cached;
+module_param(cached, bool, 0);
+MODULE_PARM_DESC(cached, "Allocate cached buffers (default: N)");
+
+struct bench_thread {
+	struct task_struct *task;
+	int err;
+};
+
+static struct ion_client *bench_client;
+static size_t bench_size;
+
+static int bench_loop(void)
+{
+	unsigned int flags = cached ? ION_FLAG_CACHED : 0;
+	struct ion_handle *handle;
+	unsigned int i;
+
+	for (i = 0; i < loops; i++) {
+		handle = ion_alloc(bench_client, bench_size, 0,
+				   ION_HEAP(ION_SYSTEM_HEAP_ID), flags);
+		if (IS_ERR_OR_NULL(handle))
+			return handle ? PTR_ERR(handle) : -ENOMEM;
+		ion_free(bench_client, handle);
+	}
+	return 0;
+}
+
+static int bench_threadfunc(void *data)
+{
+	struct bench_thread *bt = data;
+
+	bt->err = bench_loop();
+
+	/* Stay around until bench_run() joins us */
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+/*
+ * Create @nr threads, start them at once and join them all.  Returns the
+ * run time in ns, or a negative error if a thread could not be created.
+ */
+static s64 bench_run(struct bench_thread *bt, int nr)
+{
+	ktime_t start;
+	s64 ns;
+	int i, err = 0;
+
+	for (i = 0; i < nr; i++) {
+		bt[i].err = 0;
+		bt[i].task = kthread_create(bench_threadfunc, &bt[i],
+					    "ion_bench/%d", i);
+		if (IS_ERR(bt[i].task)) {
+			pr_err("kthread_create failed for thread %d\n", i);
+			err = PTR_ERR(bt[i].task);
+			break;
+		}
+	}
+	if (err) {
+		while (i--)
+			kthread_stop(bt[i].task);
+		return err;
+	}
+
+	start = ktime_get();
+	for (i = 0; i < nr; i++)
+		wake_up_process(bt[i].task);
+	for (i = 0; i < nr; i++)
+		kthread_stop(bt[i].task);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	for (i = 0; i < nr; i++) {
+		if (bt[i].err) {
+			pr_err("thread[%d] failed: %d\n", i, bt[i].err);
+			err = bt[i].err;
+		}
+	}
+	return err ? err : ns;
+}
+
+static void bench_report(int nr, u64 ns)
+{
+	u64 total = (u64)nr * loops;
+	u64 us = max_t(u64, div_u64(ns, NSEC_PER_USEC), 1);
+
+	pr_info("size %zu threads %d: %llu allocs in %llu us, %llu allocs/s, %llu MB/s\n",
+			bench_size, nr, total, us,
+			div64_u64(total * USEC_PER_SEC, us),
+			div64_u64(total * bench_size, us));
+}
+
+static int __init ion_bench_init(void)
+{
+	struct bench_thread *bt;
+	int max_threads = 0;
+	int s, t, err = 0;
+
+	if (!nr_sizes || !nr_counts || !loops)
+		return -EINVAL;
+	for (t = 0; t < nr_counts; t++) {
+		if (!threads[t] || threads[t] > num_possible_cpus() * 4)
+			return -EINVAL;
+		max_threads = max_t(int, max_threads, threads[t]);
+	}
+
+	bench_client = msm_ion_client_create("ion_bench");
+	if (IS_ERR_OR_NULL(bench_client)) {
+		pr_err("Can't create ion client\n");
+		return bench_client ? PTR_ERR(bench_client) : -ENODEV;
+	}
+
+	bt = kcalloc(max_threads, sizeof(*bt), GFP_KERNEL);
+	if (!bt) {
+		err = -ENOMEM;
+		goto out_client;
+	}
+
+	pr_info("Running %u loops per thread, %s buffers\n", loops,
+			cached ? "cached" : "uncached");
+
+	for (s = 0; s < nr_sizes && !err; s++) {
+		bench_size = PAGE_ALIGN(sizes[s]);
+		for (t = 0; t < nr_counts && !err; t++) {
+			s64 ns = bench_run(bt, threads[t]);
+
+			if (ns < 0)
+				err = ns;
+			else
+				bench_report(threads[t], ns);
+		}
+	}
+
+	kfree(bt);
+out_client:
+	ion_client_destroy(bench_client);
+	return err;
+}
+
+static void __exit ion_bench_exit(void)
+{
+}
+
+module_init(ion_bench_init);
+module_exit(ion_bench_exit);
+
+MODULE_LICENSE("GPL v2");
+MODULE_DESCRIPTION("ion system heap allocation benchmark");
@@ -22,6 +22,7 @@
 #include <linux/rtmutex.h>
 #include <linux/sched.h>
 #include <linux/scatterlist.h>
+#include <linux/sizes.h>
 #include <linux/vmalloc.h>
 #include <linux/slab.h>
 #include <linux/highmem.h>
@@ -169,6 +170,7 @@ void ion_heap_freelist_add(struct ion_heap *heap, struct ion_buffer *buffer)
 	spin_lock(&heap->free_lock);
 	list_add(&buffer->list, &heap->free_list);
 	heap->free_list_size += buffer->size;
+	heap->free_list_count++;
 	spin_unlock(&heap->free_lock);
 	wake_up(&heap->waitqueue);
 }
@@ -204,6 +206,8 @@ static size_t _ion_heap_freelist_drain(struct ion_heap *heap, size_t size,
 					  list);
 		list_del(&buffer->list);
 		heap->free_list_size -= buffer->size;
+		heap->free_list_count--;
+		heap->freed_drained += buffer->size;
 		if (skip_pools)
 			buffer->private_flags |= ION_PRIV_FLAG_SHRINKER_FREE;
 		total_drained += buffer->size;
@@ -226,27 +230,42 @@ size_t ion_heap_freelist_shrink(struct ion_heap *heap, size_t size)
 	return _ion_heap_freelist_drain(heap, size, true);
 }
 
+/*
+ * Buffers are taken off the free list in batches of up to this many
+ * bytes, oldest first.  Whatever the thread has taken is no longer
+ * visible to the shrinker, so don't take too much at once.
+ */
+#define ION_HEAP_FREE_BATCH	SZ_8M
+
 static int ion_heap_deferred_free(void *data)
 {
 	struct ion_heap *heap = data;
 
 	while (true) {
-		struct ion_buffer *buffer;
+		struct ion_buffer *buffer, *tmp;
+		size_t batch_size = 0;
+		LIST_HEAD(batch);
 
 		wait_event_freezable(heap->waitqueue,
 				     ion_heap_freelist_size(heap) > 0);
 
 		spin_lock(&heap->free_lock);
-		if (list_empty(&heap->free_list)) {
-			spin_unlock(&heap->free_lock);
-			continue;
+		while (!list_empty(&heap->free_list) &&
+		       batch_size < ION_HEAP_FREE_BATCH) {
+			buffer = list_last_entry(&heap->free_list,
+						 struct ion_buffer, list);
+			list_move_tail(&buffer->list, &batch);
+			heap->free_list_size -= buffer->size;
+			heap->free_list_count--;
+			heap->freed_deferred += buffer->size;
+			batch_size += buffer->size;
 		}
-		buffer = list_first_entry(&heap->free_list, struct ion_buffer,
-					  list);
-		list_del(&buffer->list);
-		heap->free_list_size -= buffer->size;
 		spin_unlock(&heap->free_lock);
-		ion_buffer_destroy(buffer);
+
+		list_for_each_entry_safe(buffer, tmp, &batch, list) {
+			list_del(&buffer->list);
+			ion_buffer_destroy(buffer);
+		}
 	}
 
 	return 0;
@@ -20,6 +20,7 @@
 #include <linux/fs.h>
 #include <linux/list.h>
 #include <linux/init.h>
+#include <linux/percpu.h>
 #include <linux/slab.h>
 #include <linux/swap.h>
 #include <linux/vmalloc.h>
@@ -54,9 +55,9 @@ static void ion_page_pool_free_pages(struct ion_page_pool *pool,
 	__free_pages(page, pool->order);
 }
 
-static int ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
+static void ion_page_pool_add_locked(struct ion_page_pool *pool,
+				     struct page *page)
 {
-	mutex_lock(&pool->mutex);
 	if (PageHighMem(page)) {
 		list_add_tail(&page->lru, &pool->high_items);
 		pool->high_count++;
@@ -64,8 +65,22 @@ static int ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
 		list_add_tail(&page->lru, &pool->low_items);
 		pool->low_count++;
 	}
+}
+
+static void ion_page_pool_add_list(struct ion_page_pool *pool,
+				   struct list_head *pages)
+{
+	struct page *page, *tmp;
+
+	if (list_empty(pages))
+		return;
+
+	mutex_lock(&pool->mutex);
+	list_for_each_entry_safe(page, tmp, pages, lru) {
+		list_del(&page->lru);
+		ion_page_pool_add_locked(pool, page);
+	}
 	mutex_unlock(&pool->mutex);
-	return 0;
 }
 
 static struct page *ion_page_pool_remove(struct ion_page_pool *pool, bool high)
@@ -86,21 +101,110 @@ static struct page *ion_page_pool_remove(struct ion_page_pool *pool, bool high)
 	return page;
 }
 
-void *ion_page_pool_alloc(struct ion_page_pool *pool, bool *from_pool)
+/*
+ * Pages are allocated from and freed to a per-cpu cache first, so the
+ * pool mutex is only taken once per batch.  The cache lock is only
+ * contended when the pool gets drained, e.g. by the shrinker.
+ */
+static struct page *ion_page_pool_cache_get(struct ion_page_pool *pool)
 {
+	struct ion_page_pool_cache *cache = raw_cpu_ptr(pool->cache);
 	struct page *page = NULL;
 
+	spin_lock(&cache->lock);
+	if (cache->count) {
+		page = cache->pages[--cache->count];
+		if (PageHighMem(page))
+			cache->high_count--;
+	}
+	spin_unlock(&cache->lock);
+
+	return page;
+}
+
+static void ion_page_pool_cache_put(struct ion_page_pool *pool,
+				    struct page *page)
+{
+	struct ion_page_pool_cache *cache = raw_cpu_ptr(pool->cache);
+	LIST_HEAD(batch);
+	int i;
+
+	spin_lock(&cache->lock);
+	if (cache->count == pool->cache_size) {
+		/* Make room by moving the least recently freed pages out */
+		for (i = 0; i < pool->batch; i++) {
+			if (PageHighMem(cache->pages[i]))
+				cache->high_count--;
+			list_add_tail(&cache->pages[i]->lru, &batch);
+		}
+		cache->count -= pool->batch;
+		memmove(cache->pages, cache->pages + pool->batch,
+			cache->count * sizeof(cache->pages[0]));
+	}
+	cache->pages[cache->count++] = page;
+	if (PageHighMem(page))
+		cache->high_count++;
+	spin_unlock(&cache->lock);
+
+	ion_page_pool_add_list(pool, &batch);
+}
+
+/*
+ * Takes a batch of pages from the pool lists, caches all but one of
+ * them on this cpu and returns that one.  Like before there were
+ * caches, a contended pool is treated as an empty one.
+ */
+static struct page *ion_page_pool_refill(struct ion_page_pool *pool)
+{
+	struct ion_page_pool_cache *cache;
+	struct page *page, *tmp, *next;
+	LIST_HEAD(batch);
+	int nr = 0;
+
+	if (!mutex_trylock(&pool->mutex))
+		return NULL;
+	while (nr < pool->batch && (pool->high_count || pool->low_count)) {
+		page = ion_page_pool_remove(pool, pool->high_count > 0);
+		list_add_tail(&page->lru, &batch);
+		nr++;
+	}
+	mutex_unlock(&pool->mutex);
+
+	if (!nr)
+		return NULL;
+
+	page = list_first_entry(&batch, struct page, lru);
+	list_del(&page->lru);
+
+	cache = raw_cpu_ptr(pool->cache);
+	spin_lock(&cache->lock);
+	list_for_each_entry_safe(tmp, next, &batch, lru) {
+		if (cache->count == pool->cache_size)
+			break;
+		list_del(&tmp->lru);
+		cache->pages[cache->count++] = tmp;
+		if (PageHighMem(tmp))
+			cache->high_count++;
+	}
+	spin_unlock(&cache->lock);
+
+	/* Whatever didn't fit because of concurrent frees goes back */
+	ion_page_pool_add_list(pool, &batch);
+
+	return page;
+}
+
+void *ion_page_pool_alloc(struct ion_page_pool *pool, bool *from_pool)
+{
+	struct page *page;
+
 	BUG_ON(!pool);
 
 	*from_pool = true;
 
-	if (mutex_trylock(&pool->mutex)) {
-		if (pool->high_count)
-			page = ion_page_pool_remove(pool, true);
-		else if (pool->low_count)
-			page = ion_page_pool_remove(pool, false);
-		mutex_unlock(&pool->mutex);
-	}
+	page = ion_page_pool_cache_get(pool);
+	if (!page)
+		page = ion_page_pool_refill(pool);
 	if (!page) {
 		page = ion_page_pool_alloc_pages(pool);
 		*from_pool = false;
@@ -113,28 +217,20 @@ void *ion_page_pool_alloc(struct ion_page_pool *pool, bool *from_pool)
  */
 void *ion_page_pool_alloc_pool_only(struct ion_page_pool *pool)
 {
-	struct page *page = NULL;
+	struct page *page;
 
 	BUG_ON(!pool);
 
-	if (mutex_trylock(&pool->mutex)) {
-		if (pool->high_count)
-			page = ion_page_pool_remove(pool, true);
-		else if (pool->low_count)
-			page = ion_page_pool_remove(pool, false);
-		mutex_unlock(&pool->mutex);
-	}
+	page = ion_page_pool_cache_get(pool);
+	if (!page)
+		page = ion_page_pool_refill(pool);
 
 	return page;
 }
 
 void ion_page_pool_free(struct ion_page_pool *pool, struct page *page)
 {
-	int ret;
-
-	ret = ion_page_pool_add(pool, page);
-	if (ret)
-		ion_page_pool_free_pages(pool, page);
+	ion_page_pool_cache_put(pool, page);
 }
 
 void ion_page_pool_free_immediate(struct ion_page_pool *pool, struct page *page)
@@ -142,14 +238,90 @@ void ion_page_pool_free_immediate(struct ion_page_pool *pool, struct page *page)
 	ion_page_pool_free_pages(pool, page);
 }
 
+/*
+ * Adds a newly allocated, zeroed page to the pool lists.  Never enters
+ * reclaim, so filling a pool can't push out anything else.  Returns
+ * false if no page could be added.
+ */
+bool ion_page_pool_fill(struct ion_page_pool *pool)
+{
+	gfp_t gfp_mask = (pool->gfp_mask | __GFP_NORETRY | __GFP_NOWARN) &
+		~(__GFP_RECLAIM | __GFP_ZERO);
+	struct page *page;
+
+	page = alloc_pages(gfp_mask, pool->order);
+	if (!page)
+		return false;
+
+	if (msm_ion_heap_high_order_page_zero(pool->dev, page, pool->order)) {
+		__free_pages(page, pool->order);
+		return false;
+	}
+	ion_page_pool_alloc_set_cache_policy(pool, page);
+
+	mutex_lock(&pool->mutex);
+	ion_page_pool_add_locked(pool, page);
+	mutex_unlock(&pool->mutex);
+	return true;
+}
+
+/*
+ * Moves the pages of all per-cpu caches back to the pool lists.  Since
+ * no lock is held across cpus, pages freed concurrently may stay cached.
+ */
+void ion_page_pool_drain(struct ion_page_pool *pool)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct ion_page_pool_cache *cache;
+		LIST_HEAD(pages);
+
+		cache = per_cpu_ptr(pool->cache, cpu);
+		spin_lock(&cache->lock);
+		while (cache->count)
+			list_add_tail(&cache->pages[--cache->count]->lru,
+				      &pages);
+		cache->high_count = 0;
+		spin_unlock(&cache->lock);
+
+		ion_page_pool_add_list(pool, &pages);
+	}
+}
+
+/* Since no lock is held, the result is approximate */
+int ion_page_pool_cached(struct ion_page_pool *pool)
+{
+	int cpu, count = 0;
+
+	for_each_possible_cpu(cpu)
+		count += per_cpu_ptr(pool->cache, cpu)->count;
+
+	return count;
+}
+
+static int ion_page_pool_cached_high(struct ion_page_pool *pool)
+{
+	int cpu, count = 0;
+
+	for_each_possible_cpu(cpu)
+		count += per_cpu_ptr(pool->cache, cpu)->high_count;
+
+	return count;
+}
+
 int ion_page_pool_total(struct ion_page_pool *pool, bool high)
 {
-	int count = pool->low_count;
+	int count = pool->low_count + ion_page_pool_cached(pool);
 
+	/* Cached highmem pages can only be reclaimed like the pool's */
 	if (high)
 		count += pool->high_count;
+	else
+		count -= ion_page_pool_cached_high(pool);
 
-	return count << pool->order;
+	/* The caches are read unlocked, don't let that go negative */
+	return max(count, 0) << pool->order;
 }
 
 int ion_page_pool_shrink(struct ion_page_pool *pool, gfp_t gfp_mask,
@@ -166,6 +338,8 @@ int ion_page_pool_shrink(struct ion_page_pool *pool, gfp_t gfp_mask,
 	if (nr_to_scan == 0)
 		return ion_page_pool_total(pool, high);
 
+	ion_page_pool_drain(pool);
+
 	while (freed < nr_to_scan) {
 		struct page *page;
 
@@ -191,8 +365,25 @@ struct ion_page_pool *ion_page_pool_create(struct device *dev, gfp_t gfp_mask,
 {
 	struct ion_page_pool *pool = kmalloc(sizeof(struct ion_page_pool),
 					     GFP_KERNEL);
+	int cpu;
+
 	if (!pool)
 		return NULL;
+	pool->cache = alloc_percpu(struct ion_page_pool_cache);
+	if (!pool->cache) {
+		kfree(pool);
+		return NULL;
+	}
+	for_each_possible_cpu(cpu) {
+		struct ion_page_pool_cache *cache = per_cpu_ptr(pool->cache,
+								cpu);
+
+		spin_lock_init(&cache->lock);
+		cache->count = 0;
+		cache->high_count = 0;
+	}
+	pool->cache_size = max(ION_PAGE_POOL_CACHE_PAGES >> order, 1);
+	pool->batch = max(pool->cache_size / 2, 1);
 	pool->dev = dev;
 	pool->high_count = 0;
 	pool->low_count = 0;
@@ -208,6 +399,17 @@ struct ion_page_pool *ion_page_pool_create(struct device *dev, gfp_t gfp_mask,
 
 void ion_page_pool_destroy(struct ion_page_pool *pool)
 {
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct ion_page_pool_cache *cache = per_cpu_ptr(pool->cache,
+								cpu);
+
+		while (cache->count)
+			ion_page_pool_free_pages(pool,
+						 cache->pages[--cache->count]);
+	}
+	free_percpu(pool->cache);
 	kfree(pool);
 }
 
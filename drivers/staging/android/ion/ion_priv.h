@@ -25,6 +25,7 @@
 #include <linux/mutex.h>
 #include <linux/rbtree.h>
 #include <linux/seq_file.h>
+#include <linux/spinlock.h>
 
 #include "msm_ion_priv.h"
 #include <linux/sched.h>
@@ -143,6 +144,9 @@ struct ion_heap_ops {
 
 /**
  * heap flags - flags between the heaps and core ion code
+ *
+ * ION_HEAP_FLAG_DEFER_FREE is set on every heap unless ion.defer_free=0
+ * is passed, heaps that set it themselves always defer.
  */
 #define ION_HEAP_FLAG_DEFER_FREE (1 << 0)
 
@@ -172,7 +176,11 @@ struct ion_heap_ops {
  * @priv:		private heap data
  * @free_list:		free list head if deferred free is used
  * @free_list_size	size of the deferred free list in bytes
- * @lock:		protects the free list
+ * @free_list_count:	number of buffers on the deferred free list
+ * @freed_deferred:	bytes freed by the deferred free thread
+ * @freed_drained:	bytes freed from the free list by allocations that
+ *			failed and by the shrinker
+ * @lock:		protects the free list and its counters
  * @waitqueue:		queue to wait on from deferred free thread
  * @task:		task struct of deferred free thread
  * @debug_show:		called when heap debug file is read to add any
@@ -195,6 +203,9 @@ struct ion_heap {
 	void *priv;
 	struct list_head free_list;
 	size_t free_list_size;
+	size_t free_list_count;
+	u64 freed_deferred;
+	u64 freed_drained;
 	spinlock_t free_lock;
 	wait_queue_head_t waitqueue;
 	struct task_struct *task;
@@ -411,6 +422,24 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  * many systems
  */
 
+/* Capacity of a per-cpu pool cache, in order-0 pages */
+#define ION_PAGE_POOL_CACHE_PAGES	64
+
+/**
+ * struct ion_page_pool_cache - per-cpu cache in front of a page pool
+ * @lock:		protects the cache, only contended when the pool is
+ *			drained from another cpu
+ * @count:		number of pages in the cache
+ * @high_count:		number of highmem pages among them
+ * @pages:		the cached pages, most recently freed last
+ */
+struct ion_page_pool_cache {
+	spinlock_t lock;
+	int count;
+	int high_count;
+	struct page *pages[ION_PAGE_POOL_CACHE_PAGES];
+};
+
 /**
  * struct ion_page_pool - pagepool struct
  * @high_count:		number of highmem items in the pool
@@ -422,6 +451,11 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  * @gfp_mask:		gfp_mask to use from alloc
  * @order:		order of pages in the pool
  * @list:		plist node for list of pools
+ * @cache:		per-cpu caches that pages are allocated from and freed
+ *			to first
+ * @cache_size:		number of items each cache can hold
+ * @batch:		number of items moved between a cache and the lists
+ *			at once
  *
  * Allows you to keep a pool of pre allocated pages to use from your heap.
  * Keeping a pool of pages that is ready for dma, ie any cached mapping have
@@ -438,6 +472,9 @@ struct ion_page_pool {
 	gfp_t gfp_mask;
 	unsigned int order;
 	struct plist_node list;
+	struct ion_page_pool_cache __percpu *cache;
+	int cache_size;
+	int batch;
 };
 
 struct ion_page_pool *ion_page_pool_create(struct device *dev, gfp_t gfp_mask,
@@ -447,7 +484,10 @@ void *ion_page_pool_alloc(struct ion_page_pool *, bool *from_pool);
 void *ion_page_pool_alloc_pool_only(struct ion_page_pool *);
 void ion_page_pool_free(struct ion_page_pool *, struct page *);
 void ion_page_pool_free_immediate(struct ion_page_pool *, struct page *);
+bool ion_page_pool_fill(struct ion_page_pool *pool);
 int ion_page_pool_total(struct ion_page_pool *pool, bool high);
+int ion_page_pool_cached(struct ion_page_pool *pool);
+void ion_page_pool_drain(struct ion_page_pool *pool);
 size_t ion_system_heap_secure_page_pool_total(struct ion_heap *heap, int vmid);
 
 #ifdef CONFIG_ION_POOL_CACHE_POLICY
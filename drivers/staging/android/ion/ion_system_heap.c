@@ -18,13 +18,18 @@
 #include <asm/page.h>
 #include <linux/dma-mapping.h>
 #include <linux/err.h>
+#include <linux/freezer.h>
 #include <linux/highmem.h>
+#include <linux/kthread.h>
 #include <linux/mm.h>
+#include <linux/moduleparam.h>
 #include <linux/msm_ion.h>
 #include <linux/scatterlist.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/swap.h>
 #include <linux/vmalloc.h>
+#include <linux/vmstat.h>
 #include "ion.h"
 #include "ion_priv.h"
 #include <linux/dma-mapping.h>
@@ -43,6 +48,16 @@ static const unsigned int orders[] = {0};
 #endif
 
 static const int num_orders = ARRAY_SIZE(orders);
+
+/*
+ * Size the uncached pools are kept filled to with zeroed pages in the
+ * background, split evenly between the orders.  0 disables refilling.
+ */
+static unsigned int refill_kb = SZ_32M / SZ_1K;
+module_param(refill_kb, uint, S_IRUGO | S_IWUSR);
+
+/* No refilling for this long after the shrinker took pages */
+#define ION_REFILL_SHRINK_BACKOFF	(10 * HZ)
 static int order_to_index(unsigned int order)
 {
 	int i;
@@ -65,6 +80,10 @@ struct ion_system_heap {
 	struct ion_page_pool **secure_pools[VMID_LAST];
 	/* Prevents unnecessary page splitting */
 	struct mutex split_page_mutex;
+	struct task_struct *refill_task;
+	wait_queue_head_t refill_wait;
+	bool refill_requested;
+	unsigned long last_shrink;
 };
 
 struct page_info {
@@ -327,6 +346,35 @@ static unsigned int process_info(struct page_info *info,
 	return i;
 }
 
+/* Pages each uncached pool is refilled to */
+static int ion_system_heap_refill_target(void)
+{
+	return (refill_kb >> (PAGE_SHIFT - 10)) / num_orders;
+}
+
+/* Pools are refilled once one drops below half of its target */
+static bool ion_system_heap_refill_low(struct ion_system_heap *sys_heap)
+{
+	int low = ion_system_heap_refill_target() / 2;
+	int i;
+
+	for (i = 0; i < num_orders; i++) {
+		if (ion_page_pool_total(sys_heap->uncached_pools[i], true) < low)
+			return true;
+	}
+	return false;
+}
+
+static void ion_system_heap_refill_wake(struct ion_system_heap *sys_heap)
+{
+	if (READ_ONCE(sys_heap->refill_requested) ||
+	    !ion_system_heap_refill_low(sys_heap))
+		return;
+
+	WRITE_ONCE(sys_heap->refill_requested, true);
+	wake_up(&sys_heap->refill_wait);
+}
+
 static int ion_system_heap_allocate(struct ion_heap *heap,
 				     struct ion_buffer *buffer,
 				     unsigned long size, unsigned long align,
@@ -462,6 +510,8 @@ static int ion_system_heap_allocate(struct ion_heap *heap,
 	if (nents_sync)
 		sg_free_table(&table_sync);
 	msm_ion_heap_free_pages_mem(&data);
+	if (vmid <= 0 && !ion_buffer_cached(buffer))
+		ion_system_heap_refill_wake(sys_heap);
 	return 0;
 
 err_free_sg2:
@@ -549,6 +599,8 @@ static int ion_secure_page_pool_shrink(
 	if (nr_to_scan == 0)
 		return ion_page_pool_total(pool, true);
 
+	ion_page_pool_drain(pool);
+
 	while (freed < nr_to_scan) {
 		page = ion_page_pool_alloc_pool_only(pool);
 		if (!page)
@@ -610,6 +662,8 @@ static int ion_system_heap_shrink(struct ion_heap *heap, gfp_t gfp_mask,
 
 	if (!nr_to_scan)
 		only_scan = 1;
+	else
+		sys_heap->last_shrink = jiffies;
 
 	for (i = 0; i < num_orders; i++) {
 		nr_freed = 0;
@@ -661,10 +715,11 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 	unsigned long cached_total = 0;
 	unsigned long secure_total = 0;
 	struct ion_page_pool *pool;
-	int i, j;
+	int i, j, cached;
 
 	for (i = 0; i < num_orders; i++) {
 		pool = sys_heap->uncached_pools[i];
+		cached = ion_page_pool_cached(pool);
 		if (use_seq) {
 			seq_printf(s,
 				"%d order %u highmem pages in uncached pool = %lu total\n",
@@ -676,16 +731,22 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 				pool->low_count, pool->order,
 				(1 << pool->order) * PAGE_SIZE *
 					pool->low_count);
+			seq_printf(s,
+				"%d order %u pages in uncached pool cpu caches = %lu total\n",
+				cached, pool->order,
+				(1 << pool->order) * PAGE_SIZE * cached);
 		}
 
 		uncached_total += (1 << pool->order) * PAGE_SIZE *
 			pool->high_count;
 		uncached_total += (1 << pool->order) * PAGE_SIZE *
 			pool->low_count;
+		uncached_total += (1 << pool->order) * PAGE_SIZE * cached;
 	}
 
 	for (i = 0; i < num_orders; i++) {
 		pool = sys_heap->cached_pools[i];
+		cached = ion_page_pool_cached(pool);
 		if (use_seq) {
 			seq_printf(s,
 				"%d order %u highmem pages in cached pool = %lu total\n",
@@ -696,12 +757,17 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 				pool->low_count, pool->order,
 				(1 << pool->order) * PAGE_SIZE *
 					pool->low_count);
+			seq_printf(s,
+				"%d order %u pages in cached pool cpu caches = %lu total\n",
+				cached, pool->order,
+				(1 << pool->order) * PAGE_SIZE * cached);
 		}
 
 		cached_total += (1 << pool->order) * PAGE_SIZE *
 			pool->high_count;
 		cached_total += (1 << pool->order) * PAGE_SIZE *
 			pool->low_count;
+		cached_total += (1 << pool->order) * PAGE_SIZE * cached;
 	}
 
 	for (i = 0; i < num_orders; i++) {
@@ -709,6 +775,7 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 			if (!is_secure_vmid_valid(j))
 				continue;
 			pool = sys_heap->secure_pools[j][i];
+			cached = ion_page_pool_cached(pool);
 
 			if (use_seq) {
 				seq_printf(s,
@@ -721,12 +788,19 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 					   j, pool->low_count, pool->order,
 					   (1 << pool->order) * PAGE_SIZE *
 						pool->low_count);
+				seq_printf(s,
+					   "VMID  %d: %d order %u pages in secure pool cpu caches = %lu total\n",
+					   j, cached, pool->order,
+					   (1 << pool->order) * PAGE_SIZE *
+						cached);
 			}
 
 			secure_total += (1 << pool->order) * PAGE_SIZE *
 					 pool->high_count;
 			secure_total += (1 << pool->order) * PAGE_SIZE *
 					 pool->low_count;
+			secure_total += (1 << pool->order) * PAGE_SIZE *
+					 cached;
 		}
 	}
 
@@ -749,6 +823,70 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 	return 0;
 }
 
+/*
+ * Refilling only uses memory nobody else wants: it backs off for a
+ * while after every shrink and stops well before the free pages get
+ * anywhere near the reserves.
+ */
+static bool ion_system_heap_refill_allowed(struct ion_system_heap *sys_heap)
+{
+	if (time_before(jiffies,
+			sys_heap->last_shrink + ION_REFILL_SHRINK_BACKOFF))
+		return false;
+
+	return global_page_state(NR_FREE_PAGES) >
+		totalreserve_pages + (totalram_pages >> 4);
+}
+
+/*
+ * Keeps the uncached pools filled with zeroed pages, so allocations
+ * don't have to get and zero pages from the buddy allocator on the
+ * caller's time.  Runs as SCHED_IDLE, i.e. only when the cpu has
+ * nothing else to do.
+ */
+static int ion_system_heap_refill(void *data)
+{
+	struct ion_system_heap *sys_heap = data;
+	long backoff;
+
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		int i;
+
+		wait_event_freezable(sys_heap->refill_wait,
+				kthread_should_stop() ||
+				READ_ONCE(sys_heap->refill_requested));
+
+		/* The request stays pending across the shrink back-off */
+		backoff = (long)(sys_heap->last_shrink +
+				 ION_REFILL_SHRINK_BACKOFF - jiffies);
+		if (backoff > 0) {
+			freezable_schedule_timeout_interruptible(backoff);
+			continue;
+		}
+
+		/*
+		 * If free memory runs short, stop here; the next allocation
+		 * finding a pool low asks again.
+		 */
+		WRITE_ONCE(sys_heap->refill_requested, false);
+		for (i = 0; i < num_orders; i++) {
+			struct ion_page_pool *pool = sys_heap->uncached_pools[i];
+
+			while (!kthread_should_stop() &&
+			       ion_page_pool_total(pool, true) <
+			       ion_system_heap_refill_target() &&
+			       ion_system_heap_refill_allowed(sys_heap)) {
+				if (!ion_page_pool_fill(pool))
+					break;
+				cond_resched();
+			}
+		}
+	}
+
+	return 0;
+}
 
 static void ion_system_heap_destroy_pools(struct ion_page_pool **pools)
 {
@@ -827,6 +965,21 @@ struct ion_heap *ion_system_heap_create(struct ion_platform_heap *data)
 
 	mutex_init(&heap->split_page_mutex);
 
+	init_waitqueue_head(&heap->refill_wait);
+	heap->refill_requested = true;
+	heap->last_shrink = jiffies;
+	heap->refill_task = kthread_run(ion_system_heap_refill, heap,
+					"ion_refill");
+	if (IS_ERR(heap->refill_task)) {
+		pr_err("%s: creating thread for pool refill failed\n",
+		       __func__);
+		heap->refill_task = NULL;
+	} else {
+		struct sched_param param = { .sched_priority = 0 };
+
+		sched_setscheduler(heap->refill_task, SCHED_IDLE, &param);
+	}
+
 	heap->heap.debug_show = ion_system_heap_debug_show;
 	return &heap->heap;
 
@@ -855,6 +1008,9 @@ void ion_system_heap_destroy(struct ion_heap *heap)
 							heap);
 	int i, j;
 
+	if (sys_heap->refill_task)
+		kthread_stop(sys_heap->refill_task);
+
 	for (i = 0; i < VMID_LAST; i++) {
 		if (!is_secure_vmid_valid(i))
 			continue;
@@ -47,7 +47,10 @@
 #include <linux/swap.h>
 #include <linux/fs.h>
 #include <linux/cpuset.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
 #include <linux/vmpressure.h>
+#include <linux/psi.h>
 #include <linux/zcache.h>
 
 #define CREATE_TRACE_POINTS
@@ -145,11 +148,24 @@ int adjust_minadj(short *min_score_adj)
 	return ret;
 }
 
-static int lmk_vmpressure_notifier(struct notifier_block *nb,
-				   unsigned long action, void *data)
+/*
+ * Use the memory stall time reported by PSI instead of vmpressure to
+ * drive adaptive lmk. The stall percentages at or above which this is
+ * treated like vmpressure 95 (critical) and 90 are given by
+ * psi_critical and psi_high.
+ */
+static int use_psi;
+module_param_named(use_psi, use_psi, int, S_IRUGO | S_IWUSR);
+
+static int psi_critical = 60;
+module_param_named(psi_critical, psi_critical, int, S_IRUGO | S_IWUSR);
+
+static int psi_high = 30;
+module_param_named(psi_high, psi_high, int, S_IRUGO | S_IWUSR);
+
+static int lmk_pressure_changed(unsigned long pressure)
 {
 	int other_free, other_file;
-	unsigned long pressure = action;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 
 	if (!enable_adaptive_lmk)
@@ -199,10 +215,40 @@ static int lmk_vmpressure_notifier(struct notifier_block *nb,
 	return 0;
 }
 
+static int lmk_vmpressure_notifier(struct notifier_block *nb,
+				   unsigned long action, void *data)
+{
+	if (use_psi)
+		return 0;
+
+	return lmk_pressure_changed(action);
+}
+
+static int lmk_psi_notifier(struct notifier_block *nb,
+			    unsigned long action, void *data)
+{
+	unsigned long pressure = 0;
+
+	if (!use_psi)
+		return 0;
+
+	/* Map the stall percentage onto the vmpressure levels used above */
+	if (action >= psi_critical)
+		pressure = 95;
+	else if (action >= psi_high)
+		pressure = 90;
+
+	return lmk_pressure_changed(pressure);
+}
+
 static struct notifier_block lmk_vmpr_nb = {
 	.notifier_call = lmk_vmpressure_notifier,
 };
 
+static struct notifier_block lmk_psi_nb = {
+	.notifier_call = lmk_psi_notifier,
+};
+
 static int test_task_flag(struct task_struct *p, int flag)
 {
 	struct task_struct *t;
@@ -237,6 +283,251 @@ static int test_task_state(struct task_struct *p, int state)
 
 static DEFINE_MUTEX(scan_mutex);
 
+/*
+ * Thread group leaders hashed by oom_score_adj, so that lowmem_scan() only
+ * looks at the tasks it may actually kill instead of walking the whole task
+ * list. Bucket 0 holds OOM_SCORE_ADJ_MAX, so walking the used buckets in
+ * ascending order visits the most killable tasks first.
+ *
+ * lmk_adj_lock nests inside tasklist_lock, which fork and exit hold with
+ * IRQs disabled, and inside siglock, so it is always taken irqsave. The
+ * scan holds it only to take references on a batch of candidates and
+ * looks at them after dropping it, so that fork and exit never wait for
+ * the RSS of other tasks to be evaluated.
+ */
+#define LMK_ADJ_BUCKETS		(OOM_SCORE_ADJ_MAX - OOM_SCORE_ADJ_MIN + 1)
+#define lmk_adj_to_bucket(adj)	(OOM_SCORE_ADJ_MAX - (adj))
+#define lmk_bucket_to_adj(b)	(OOM_SCORE_ADJ_MAX - (b))
+#define LMK_SCAN_BATCH		32
+
+static struct hlist_head lmk_adj_index[LMK_ADJ_BUCKETS];
+static DECLARE_BITMAP(lmk_adj_used, LMK_ADJ_BUCKETS);
+static DEFINE_SPINLOCK(lmk_adj_lock);
+
+static void __lowmem_adj_index_add(struct task_struct *p, short adj)
+{
+	int b = lmk_adj_to_bucket(adj);
+
+	p->lmk_adj = adj;
+	hlist_add_head(&p->lmk_adj_node, &lmk_adj_index[b]);
+	__set_bit(b, lmk_adj_used);
+}
+
+static void __lowmem_adj_index_del(struct task_struct *p)
+{
+	int b = lmk_adj_to_bucket(p->lmk_adj);
+
+	hlist_del_init(&p->lmk_adj_node);
+	if (hlist_empty(&lmk_adj_index[b]))
+		__clear_bit(b, lmk_adj_used);
+}
+
+/* Called from copy_process() for every new thread group leader */
+void lowmem_adj_index_add(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lmk_adj_lock, flags);
+	__lowmem_adj_index_add(p, p->signal->oom_score_adj);
+	spin_unlock_irqrestore(&lmk_adj_lock, flags);
+}
+
+/* Called from __unhash_process() when the thread group is gone */
+void lowmem_adj_index_del(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lmk_adj_lock, flags);
+	if (!hlist_unhashed(&p->lmk_adj_node))
+		__lowmem_adj_index_del(p);
+	spin_unlock_irqrestore(&lmk_adj_lock, flags);
+}
+
+/* Called with @p's siglock held after its oom_score_adj changed */
+void lowmem_adj_index_update(struct task_struct *p)
+{
+	struct task_struct *leader = p->group_leader;
+	short adj = p->signal->oom_score_adj;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lmk_adj_lock, flags);
+	if (!hlist_unhashed(&leader->lmk_adj_node) && leader->lmk_adj != adj) {
+		__lowmem_adj_index_del(leader);
+		__lowmem_adj_index_add(leader, adj);
+	}
+	spin_unlock_irqrestore(&lmk_adj_lock, flags);
+}
+
+/* Called from de_thread() when @tsk becomes the new group leader */
+void lowmem_adj_index_replace(struct task_struct *leader,
+			      struct task_struct *tsk)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lmk_adj_lock, flags);
+	INIT_HLIST_NODE(&tsk->lmk_adj_node);
+	if (!hlist_unhashed(&leader->lmk_adj_node)) {
+		short adj = leader->lmk_adj;
+
+		__lowmem_adj_index_del(leader);
+		__lowmem_adj_index_add(tsk, adj);
+	}
+	spin_unlock_irqrestore(&lmk_adj_lock, flags);
+}
+
+/*
+ * Take references on up to LMK_SCAN_BATCH leaders of bucket @b, resuming
+ * after @last if that is still hashed there. Returns how many were taken.
+ */
+static int lowmem_collect_bucket(int b, struct task_struct *last,
+				 struct task_struct **batch)
+{
+	struct task_struct *tsk;
+	unsigned long flags;
+	int nr = 0;
+
+	spin_lock_irqsave(&lmk_adj_lock, flags);
+	if (last) {
+		if (hlist_unhashed(&last->lmk_adj_node) ||
+		    lmk_adj_to_bucket(last->lmk_adj) != b)
+			goto out;
+		tsk = hlist_entry_safe(last->lmk_adj_node.next,
+				       struct task_struct, lmk_adj_node);
+	} else {
+		tsk = hlist_entry_safe(lmk_adj_index[b].first,
+				       struct task_struct, lmk_adj_node);
+	}
+
+	hlist_for_each_entry_from(tsk, lmk_adj_node) {
+		if (nr == LMK_SCAN_BATCH)
+			break;
+		if (tsk->flags & PF_KTHREAD)
+			continue;
+		get_task_struct(tsk);
+		batch[nr++] = tsk;
+	}
+out:
+	spin_unlock_irqrestore(&lmk_adj_lock, flags);
+	return nr;
+}
+
+/*
+ * Returns the RSS of @tsk and its thread holding the mm in @victim with a
+ * reference taken, 0 if it has no memory left to free, or -EBUSY if it is
+ * an earlier victim that is still dying.
+ */
+static int lowmem_task_size(struct task_struct *tsk, bool deathpending,
+			    struct task_struct **victim)
+{
+	struct task_struct *p;
+	int tasksize = 0;
+
+	rcu_read_lock();
+	/* if task no longer has any memory ignore it */
+	if (test_task_flag(tsk, TIF_MM_RELEASED))
+		goto out;
+
+	if (deathpending && test_task_flag(tsk, TIF_MEMDIE)) {
+		tasksize = -EBUSY;
+		goto out;
+	}
+
+	p = find_lock_task_mm(tsk);
+	if (!p)
+		goto out;
+
+	tasksize = get_mm_rss(p->mm);
+	if (tasksize > 0) {
+		get_task_struct(p);
+		*victim = p;
+	}
+	task_unlock(p);
+out:
+	rcu_read_unlock();
+	return tasksize;
+}
+
+/*
+ * Pick the task with the highest oom_score_adj not below @min_score_adj
+ * and, among those, the largest RSS. The walk stops at the first bucket
+ * that holds a candidate. Returns the task with a reference held, NULL if
+ * there is nothing to kill, or ERR_PTR(-EBUSY) if an earlier victim is
+ * still dying.
+ */
+static struct task_struct *lowmem_select_task(short min_score_adj,
+					      int *selected_tasksize,
+					      short *selected_oom_score_adj,
+					      int *nr_scanned)
+{
+	struct task_struct *batch[LMK_SCAN_BATCH];
+	struct task_struct *selected = NULL;
+	bool deathpending = time_before_eq(jiffies,
+					   lowmem_deathpending_timeout);
+	bool busy = false;
+	int nbits = lmk_adj_to_bucket(min_score_adj) + 1;
+	int b;
+
+	*selected_tasksize = 0;
+	*selected_oom_score_adj = min_score_adj;
+	*nr_scanned = 0;
+
+	for (b = find_first_bit(lmk_adj_used, nbits);
+	     b < nbits && !selected && !busy;
+	     b = find_next_bit(lmk_adj_used, nbits, b + 1)) {
+		short oom_score_adj = lmk_bucket_to_adj(b);
+		struct task_struct *last = NULL;
+		int nr, i;
+
+		while ((nr = lowmem_collect_bucket(b, last, batch))) {
+			if (last)
+				put_task_struct(last);
+			last = batch[nr - 1];
+			get_task_struct(last);
+
+			for (i = 0; i < nr; i++) {
+				struct task_struct *p = NULL;
+				int tasksize;
+
+				(*nr_scanned)++;
+				tasksize = busy ? 0 :
+					lowmem_task_size(batch[i],
+							 deathpending, &p);
+				put_task_struct(batch[i]);
+				if (tasksize == -EBUSY) {
+					busy = true;
+					continue;
+				}
+				if (!p)
+					continue;
+				if (tasksize <= *selected_tasksize) {
+					put_task_struct(p);
+					continue;
+				}
+
+				if (selected)
+					put_task_struct(selected);
+				selected = p;
+				*selected_tasksize = tasksize;
+				*selected_oom_score_adj = oom_score_adj;
+				lowmem_print(3, "select '%s' (%d), adj %hd, size %d, to kill\n",
+					     p->comm, p->pid, oom_score_adj,
+					     tasksize);
+			}
+			if (busy || nr < LMK_SCAN_BATCH)
+				break;
+		}
+		if (last)
+			put_task_struct(last);
+	}
+
+	if (busy) {
+		if (selected)
+			put_task_struct(selected);
+		return ERR_PTR(-EBUSY);
+	}
+	return selected;
+}
+
 int can_use_cma_pages(gfp_t gfp_mask)
 {
 	int can_use = 0;
@@ -408,10 +699,8 @@ void tune_lmk_param(int *other_free, int *other_file, struct shrink_control *sc)
 
 static unsigned long lowmem_scan(struct shrinker *s, struct shrink_control *sc)
 {
-	struct task_struct *tsk;
-	struct task_struct *selected = NULL;
+	struct task_struct *selected;
 	unsigned long rem = 0;
-	int tasksize;
 	int i;
 	int ret = 0;
 	short min_score_adj = OOM_SCORE_ADJ_MAX + 1;
@@ -421,6 +710,8 @@ static unsigned long lowmem_scan(struct shrinker *s, struct shrink_control *sc)
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free;
 	int other_file;
+	int nr_scanned;
+	ktime_t start;
 
 	if (!mutex_trylock(&scan_mutex))
 		return 0;
@@ -464,63 +755,30 @@ static unsigned long lowmem_scan(struct shrinker *s, struct shrink_control *sc)
 		return 0;
 	}
 
-	selected_oom_score_adj = min_score_adj;
-
-	rcu_read_lock();
-	for_each_process(tsk) {
-		struct task_struct *p;
-		short oom_score_adj;
-
-		if (tsk->flags & PF_KTHREAD)
-			continue;
-
-		/* if task no longer has any memory ignore it */
-		if (test_task_flag(tsk, TIF_MM_RELEASED))
-			continue;
-
-		if (time_before_eq(jiffies, lowmem_deathpending_timeout)) {
-			if (test_task_flag(tsk, TIF_MEMDIE)) {
-				rcu_read_unlock();
-				mutex_unlock(&scan_mutex);
-				return 0;
-			}
-		}
-
-		p = find_lock_task_mm(tsk);
-		if (!p)
-			continue;
-
-		oom_score_adj = p->signal->oom_score_adj;
-		if (oom_score_adj < min_score_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(p->mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_score_adj < selected_oom_score_adj)
-				continue;
-			if (oom_score_adj == selected_oom_score_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_score_adj = oom_score_adj;
-		lowmem_print(3, "select '%s' (%d), adj %hd, size %d, to kill\n",
-			     p->comm, p->pid, oom_score_adj, tasksize);
+	start = ktime_get();
+	selected = lowmem_select_task(min_score_adj, &selected_tasksize,
+				      &selected_oom_score_adj, &nr_scanned);
+	trace_lowmemory_select(IS_ERR_OR_NULL(selected) ? NULL : selected,
+			       min_score_adj, nr_scanned,
+			       ktime_to_ns(ktime_sub(ktime_get(), start)));
+	if (IS_ERR(selected)) {
+		mutex_unlock(&scan_mutex);
+		return 0;
 	}
+
 	if (selected) {
 		long cache_size, cache_limit, free;
+		bool killed;
 
-		if (test_task_flag(selected, TIF_MEMDIE) &&
-		    (test_task_state(selected, TASK_UNINTERRUPTIBLE))) {
+		rcu_read_lock();
+		killed = test_task_flag(selected, TIF_MEMDIE) &&
+			 test_task_state(selected, TASK_UNINTERRUPTIBLE);
+		rcu_read_unlock();
+		if (killed) {
 			lowmem_print(2, "'%s' (%d) is already killed\n",
 				     selected->comm,
 				     selected->pid);
-			rcu_read_unlock();
+			put_task_struct(selected);
 			mutex_unlock(&scan_mutex);
 			return 0;
 		}
@@ -573,7 +831,7 @@ static unsigned long lowmem_scan(struct shrinker *s, struct shrink_control *sc)
 
 		lowmem_deathpending_timeout = jiffies + HZ;
 		rem += selected_tasksize;
-		rcu_read_unlock();
+		put_task_struct(selected);
 		lmk_counter++;
 		/* give the system time to free up the memory */
 		msleep_interruptible(20);
@@ -582,7 +840,6 @@ static unsigned long lowmem_scan(struct shrinker *s, struct shrink_control *sc)
 				  selected_oom_score_adj);
 	} else {
 		trace_almk_shrink(1, ret, other_free, other_file, 0);
-		rcu_read_unlock();
 	}
 
 	lowmem_print(4, "lowmem_scan %lu, %x, return %lu\n",
@@ -602,6 +859,7 @@ static int __init lowmem_init(void)
 {
 	register_shrinker(&lowmem_shrinker);
 	vmpressure_notifier_register(&lmk_vmpr_nb);
+	psi_mem_notifier_register(&lmk_psi_nb);
 	return 0;
 }
 device_initcall(lowmem_init);
@@ -242,9 +242,19 @@ void sync_fence_install(struct sync_fence *fence, int fd)
 }
 EXPORT_SYMBOL(sync_fence_install);
 
+/*
+ * With a NULL @fence only count the points that would be added, so that
+ * sync_fence_merge() can size the new fence before filling it in.
+ */
 static void sync_fence_add_pt(struct sync_fence *fence,
 			      int *i, struct fence *pt)
 {
+	if (!fence) {
+		if (!test_bit(FENCE_FLAG_SIGNALED_BIT, &pt->flags))
+			(*i)++;
+		return;
+	}
+
 	fence->cbs[*i].sync_pt = pt;
 	fence->cbs[*i].fence = fence;
 
@@ -254,27 +264,21 @@ static void sync_fence_add_pt(struct sync_fence *fence,
 	}
 }
 
-struct sync_fence *sync_fence_merge(const char *name,
-				    struct sync_fence *a, struct sync_fence *b)
+/*
+ * Add the points of @a and @b to @fence, keeping only the later point of
+ * any timeline present in both, and return how many were added.
+ *
+ * Assume sync_fence a and b are both ordered and have no
+ * duplicates with the same context.
+ *
+ * If a sync_fence can only be created with sync_fence_merge
+ * and sync_fence_create, this is a reasonable assumption.
+ */
+static int sync_fence_merge_pts(struct sync_fence *fence,
+				struct sync_fence *a, struct sync_fence *b)
 {
-	int num_fences = a->num_fences + b->num_fences;
-	struct sync_fence *fence;
 	int i, i_a, i_b;
-	unsigned long size = offsetof(struct sync_fence, cbs[num_fences]);
-
-	fence = sync_fence_alloc(size, name);
-	if (fence == NULL)
-		return NULL;
 
-	atomic_set(&fence->status, num_fences);
-
-	/*
-	 * Assume sync_fence a and b are both ordered and have no
-	 * duplicates with the same context.
-	 *
-	 * If a sync_fence can only be created with sync_fence_merge
-	 * and sync_fence_create, this is a reasonable assumption.
-	 */
 	for (i = i_a = i_b = 0; i_a < a->num_fences && i_b < b->num_fences; ) {
 		struct fence *pt_a = a->cbs[i_a].sync_pt;
 		struct fence *pt_b = b->cbs[i_b].sync_pt;
@@ -304,6 +308,31 @@ struct sync_fence *sync_fence_merge(const char *name,
 	for (; i_b < b->num_fences; i_b++)
 		sync_fence_add_pt(fence, &i, b->cbs[i_b].sync_pt);
 
+	return i;
+}
+
+struct sync_fence *sync_fence_merge(const char *name,
+				    struct sync_fence *a, struct sync_fence *b)
+{
+	struct sync_fence *fence;
+	int num_fences, i;
+
+	/*
+	 * Merging already merged fences is common, so size the new fence
+	 * for the points that survive deduplication rather than for both
+	 * inputs.  Points signaling after the count are dropped below.
+	 */
+	num_fences = sync_fence_merge_pts(NULL, a, b);
+
+	fence = sync_fence_alloc(offsetof(struct sync_fence, cbs[num_fences]),
+				 name);
+	if (fence == NULL)
+		return NULL;
+
+	atomic_set(&fence->status, num_fences);
+
+	i = sync_fence_merge_pts(fence, a, b);
+
 	if (num_fences > i)
 		atomic_sub(num_fences - i, &fence->status);
 	fence->num_fences = i;
@@ -555,9 +584,12 @@ static unsigned int sync_fence_poll(struct file *file, poll_table *wait)
 	struct sync_fence *fence = file->private_data;
 	int status;
 
-	poll_wait(file, &fence->wq, wait);
-
+	/* No need to queue on the waitqueue of a signaled fence */
 	status = atomic_read(&fence->status);
+	if (status > 0) {
+		poll_wait(file, &fence->wq, wait);
+		status = atomic_read(&fence->status);
+	}
 
 	if (!status)
 		return POLLIN;
@@ -34,6 +34,38 @@ TRACE_EVENT(lowmemory_kill,
 		__entry->pagecache_limit, __entry->free)
 );
 
+TRACE_EVENT(lowmemory_select,
+	TP_PROTO(struct task_struct *selected, short min_score_adj,
+		 int nr_scanned, u64 latency_ns),
+
+	TP_ARGS(selected, min_score_adj, nr_scanned, latency_ns),
+
+	TP_STRUCT__entry(
+			__array(char, comm, TASK_COMM_LEN)
+			__field(pid_t, pid)
+			__field(short, min_score_adj)
+			__field(int, nr_scanned)
+			__field(u64, latency_ns)
+	),
+
+	TP_fast_assign(
+			if (selected) {
+				memcpy(__entry->comm, selected->comm,
+				       TASK_COMM_LEN);
+				__entry->pid = selected->pid;
+			} else {
+				strcpy(__entry->comm, "none");
+				__entry->pid = 0;
+			}
+			__entry->min_score_adj = min_score_adj;
+			__entry->nr_scanned = nr_scanned;
+			__entry->latency_ns = latency_ns;
+	),
+
+	TP_printk("%s (%d), min_score_adj %hd, scanned %d tasks in %lluns",
+		__entry->comm, __entry->pid, __entry->min_score_adj,
+		__entry->nr_scanned, __entry->latency_ns)
+);
 
 #endif /* if !defined(_TRACE_LOWMEMORYKILLER_H) || defined(TRACE_HEADER_MULTI_READ) */
 
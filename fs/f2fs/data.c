@@ -306,6 +306,8 @@ struct page *get_read_data_page(struct inode *inode, pgoff_t index,
 	err = get_dnode_of_data(&dn, index, LOOKUP_NODE);
 	if (err)
 		goto put_err;
+	if (dn.data_blkaddr != NULL_ADDR && dn.data_blkaddr != NEW_ADDR)
+		f2fs_cache_read_extent(inode, index, dn.data_blkaddr, 1);
 	f2fs_put_dnode(&dn);
 
 	if (unlikely(dn.data_blkaddr == NULL_ADDR)) {
@@ -557,6 +559,20 @@ out:
 	return;
 }
 
+/*
+ * Hand the part of a mapped run covered by the current dnode over to the
+ * extent cache, while the dnode page is still held.
+ */
+static void __cache_mapped_blocks(struct inode *inode,
+			struct f2fs_map_blocks *map, pgoff_t start, pgoff_t end)
+{
+	if (end <= start || map->m_pblk == NEW_ADDR)
+		return;
+
+	f2fs_cache_read_extent(inode, start,
+			map->m_pblk + start - map->m_lblk, end - start);
+}
+
 /*
  * f2fs_map_blocks() now supported readahead/bmap/rw direct_IO with
  * f2fs_map_blocks structure.
@@ -573,7 +589,7 @@ static int f2fs_map_blocks(struct inode *inode, struct f2fs_map_blocks *map,
 	struct dnode_of_data dn;
 	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
 	int mode = create ? ALLOC_NODE : LOOKUP_NODE_RA;
-	pgoff_t pgofs, end_offset;
+	pgoff_t pgofs, end_offset, cache_pgofs;
 	int err = 0, ofs = 1;
 	struct extent_info ei;
 	bool allocated = false;
@@ -583,6 +599,7 @@ static int f2fs_map_blocks(struct inode *inode, struct f2fs_map_blocks *map,
 
 	/* it only supports block size == page size */
 	pgofs =	(pgoff_t)map->m_lblk;
+	cache_pgofs = pgofs;
 
 	if (f2fs_lookup_extent_cache(inode, pgofs, &ei)) {
 		map->m_pblk = ei.blk + pgofs - ei.fofs;
@@ -644,6 +661,9 @@ get_next:
 		if (allocated)
 			sync_inode_page(&dn);
 		allocated = false;
+		if (!create)
+			__cache_mapped_blocks(inode, map, cache_pgofs, pgofs);
+		cache_pgofs = pgofs;
 		f2fs_put_dnode(&dn);
 
 		set_new_dnode(&dn, inode, NULL, NULL, 0);
@@ -698,6 +718,8 @@ get_next:
 sync_out:
 	if (allocated)
 		sync_inode_page(&dn);
+	if (!create)
+		__cache_mapped_blocks(inode, map, cache_pgofs, pgofs);
 put_out:
 	f2fs_put_dnode(&dn);
 unlock_out:
@@ -1081,6 +1103,10 @@ int do_write_data_page(struct f2fs_io_info *fio)
 
 	set_page_writeback(page);
 
+	/* a rewrite ends the lifetime of the old block, unless GC moves it */
+	if (fio->blk_addr != NEW_ADDR && !is_cold_data(page))
+		f2fs_update_data_age(inode, fio->blk_addr);
+
 	/*
 	 * If current allocation needs SSR,
 	 * it had better in-place writes for updated data.
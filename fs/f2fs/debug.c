@@ -40,6 +40,9 @@ static void update_general_status(struct f2fs_sb_info *sbi)
 	si->total_ext = atomic64_read(&sbi->total_hit_ext);
 	si->ext_tree = sbi->total_ext_tree;
 	si->ext_node = atomic_read(&sbi->total_ext_node);
+	si->hit_mostly = atomic64_read(&sbi->read_hit_mostly);
+	si->ext_fill = atomic64_read(&sbi->read_ext_fill);
+	si->read_ext_node = sbi->nr_read_ext_node;
 	si->ndirty_node = get_pages(sbi, F2FS_DIRTY_NODES);
 	si->ndirty_dent = get_pages(sbi, F2FS_DIRTY_DENTS);
 	si->ndirty_dirs = sbi->n_dirty_dirs;
@@ -90,6 +93,20 @@ static void update_general_status(struct f2fs_sb_info *sbi)
 	}
 
 	si->inplace_count = atomic_read(&sbi->inplace_count);
+
+	for (i = 0; i < NR_DATA_AGE_HIST; i++)
+		si->data_age_hist[i] = atomic64_read(&sbi->data_age_hist[i]);
+	for (i = CURSEG_HOT_DATA; i <= CURSEG_COLD_DATA; i++)
+		si->data_age_type[i] = atomic64_read(&sbi->data_age_type[i]);
+
+	if (SM_I(sbi)->dcc_info) {
+		struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+
+		si->discard_cmds = dcc->nr_pending;
+		si->discard_blks = dcc->pending_blks;
+		si->issued_discards = dcc->issued_cmds;
+		si->issued_discard_blks = dcc->issued_blks;
+	}
 }
 
 /*
@@ -167,6 +184,10 @@ static void update_mem_info(struct f2fs_sb_info *sbi)
 	si->base_mem += sizeof(struct dirty_seglist_info);
 	si->base_mem += NR_DIRTY_TYPE * f2fs_bitmap_size(MAIN_SEGS(sbi));
 	si->base_mem += f2fs_bitmap_size(MAIN_SECS(sbi));
+	si->base_mem += MAIN_SECS(sbi) * sizeof(struct victim_entry);
+	si->base_mem += DIRTY_I(sbi)->nr_victim_buckets *
+						sizeof(struct list_head);
+	si->base_mem += f2fs_bitmap_size(DIRTY_I(sbi)->nr_victim_buckets);
 
 	/* build nm */
 	si->base_mem += sizeof(struct f2fs_nm_info);
@@ -183,6 +204,13 @@ get_cache:
 	if (SM_I(sbi)->cmd_control_info)
 		si->cache_mem += sizeof(struct flush_cmd_control);
 
+	/* build discard thread */
+	if (SM_I(sbi)->dcc_info) {
+		si->cache_mem += sizeof(struct discard_cmd_control);
+		si->cache_mem += SM_I(sbi)->dcc_info->nr_pending *
+						sizeof(struct discard_cmd);
+	}
+
 	/* free nids */
 	si->cache_mem += NM_I(sbi)->fcnt * sizeof(struct free_nid);
 	si->cache_mem += NM_I(sbi)->nat_cnt * sizeof(struct nat_entry);
@@ -278,6 +306,8 @@ static int stat_show(struct seq_file *s, void *v)
 				si->node_segs, si->bg_node_segs);
 		seq_printf(s, "Try to move %d blocks (BG: %d)\n", si->tot_blks,
 				si->bg_data_blks + si->bg_node_blks);
+		seq_printf(s, "  - data blocks per segment : %d\n",
+				si->data_segs ? si->data_blks / si->data_segs : 0);
 		seq_printf(s, "  - data blocks : %d (%d)\n", si->data_blks,
 				si->bg_data_blks);
 		seq_printf(s, "  - node blocks : %d (%d)\n", si->node_blks,
@@ -292,6 +322,10 @@ static int stat_show(struct seq_file *s, void *v)
 				si->hit_total, si->total_ext);
 		seq_printf(s, "  - Inner Struct Count: tree: %d, node: %d\n",
 				si->ext_tree, si->ext_node);
+		seq_printf(s, "  - Read-mostly: hit: %llu, filled: %llu, "
+				"node: %d (budget: %u KB)\n",
+				si->hit_mostly, si->ext_fill,
+				si->read_ext_node, si->sbi->read_extent_budget);
 		seq_puts(s, "\nBalancing F2FS Async:\n");
 		seq_printf(s, "  - inmem: %4d, wb: %4d\n",
 			   si->inmem_pages, si->wb_pages);
@@ -325,6 +359,22 @@ static int stat_show(struct seq_file *s, void *v)
 			   si->block_count[SSR], si->segment_count[SSR]);
 		seq_printf(s, "LFS: %u blocks in %u segments\n",
 			   si->block_count[LFS], si->segment_count[LFS]);
+		seq_printf(s, "Data age: hot %llu, warm %llu, cold %llu blocks\n",
+			   si->data_age_type[CURSEG_HOT_DATA],
+			   si->data_age_type[CURSEG_WARM_DATA],
+			   si->data_age_type[CURSEG_COLD_DATA]);
+		seq_puts(s, "  - lifetime:");
+		for (j = 0; j < NR_DATA_AGE_HIST - 1; j++)
+			seq_printf(s, " <%uK: %llu", 1 <<
+				(DATA_AGE_HIST_SHIFT - 10 + 2 * j),
+				si->data_age_hist[j]);
+		seq_printf(s, " >=%uK: %llu blocks\n", 1 <<
+				(DATA_AGE_HIST_SHIFT - 10 + 2 * j),
+				si->data_age_hist[j]);
+		seq_printf(s, "Discard: %u cmds (%u blocks) pending, "
+			   "%llu cmds (%llu blocks) issued\n",
+			   si->discard_cmds, si->discard_blks,
+			   si->issued_discards, si->issued_discard_blks);
 
 		/* segment usage info */
 		update_sit_info(si->sbi);
@@ -363,6 +413,7 @@ int f2fs_build_stats(struct f2fs_sb_info *sbi)
 {
 	struct f2fs_super_block *raw_super = F2FS_RAW_SUPER(sbi);
 	struct f2fs_stat_info *si;
+	int i;
 
 	si = kzalloc(sizeof(struct f2fs_stat_info), GFP_KERNEL);
 	if (!si)
@@ -383,11 +434,17 @@ int f2fs_build_stats(struct f2fs_sb_info *sbi)
 	atomic64_set(&sbi->read_hit_rbtree, 0);
 	atomic64_set(&sbi->read_hit_largest, 0);
 	atomic64_set(&sbi->read_hit_cached, 0);
+	atomic64_set(&sbi->read_hit_mostly, 0);
+	atomic64_set(&sbi->read_ext_fill, 0);
 
 	atomic_set(&sbi->inline_xattr, 0);
 	atomic_set(&sbi->inline_inode, 0);
 	atomic_set(&sbi->inline_dir, 0);
 	atomic_set(&sbi->inplace_count, 0);
+	for (i = 0; i < NR_DATA_AGE_HIST; i++)
+		atomic64_set(&sbi->data_age_hist[i], 0);
+	for (i = CURSEG_HOT_DATA; i <= CURSEG_COLD_DATA; i++)
+		atomic64_set(&sbi->data_age_type[i], 0);
 
 	mutex_lock(&f2fs_stat_mutex);
 	list_add_tail(&si->stat_list, &f2fs_stat_list);
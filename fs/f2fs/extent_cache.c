@@ -33,6 +33,7 @@ static struct extent_node *__attach_extent_node(struct f2fs_sb_info *sbi,
 
 	en->ei = *ei;
 	INIT_LIST_HEAD(&en->list);
+	en->read_lru = false;
 
 	rb_link_node(&en->rb_node, parent, p);
 	rb_insert_color(&en->rb_node, &et->root);
@@ -52,6 +53,47 @@ static void __detach_extent_node(struct f2fs_sb_info *sbi,
 		et->cached_en = NULL;
 }
 
+static unsigned long __max_read_extent_nodes(struct f2fs_sb_info *sbi)
+{
+	u64 nodes = div_u64((u64)sbi->read_extent_budget << 10,
+					sizeof(struct extent_node));
+
+	return min_t(u64, nodes, ULONG_MAX);
+}
+
+/*
+ * Extent nodes of read-mostly files are kept in their own lru list, so that
+ * shrinking reclaims ordinary extents first and the read-mostly ones can be
+ * held under a separate memory budget.  sbi->extent_lock should be held.
+ */
+static void __lru_add_extent_node(struct f2fs_sb_info *sbi,
+				struct extent_tree *et, struct extent_node *en)
+{
+	en->read_lru = et->read_mostly && sbi->read_extent_budget;
+	if (en->read_lru) {
+		list_add_tail(&en->list, &sbi->read_extent_list);
+		sbi->nr_read_ext_node++;
+	} else {
+		list_add_tail(&en->list, &sbi->extent_list);
+	}
+}
+
+static void __lru_del_extent_node(struct f2fs_sb_info *sbi,
+						struct extent_node *en)
+{
+	list_del_init(&en->list);
+	if (en->read_lru)
+		sbi->nr_read_ext_node--;
+	en->read_lru = false;
+}
+
+static void __lru_move_extent_node(struct f2fs_sb_info *sbi,
+				struct extent_tree *et, struct extent_node *en)
+{
+	__lru_del_extent_node(sbi, en);
+	__lru_add_extent_node(sbi, et, en);
+}
+
 static struct extent_tree *__grab_extent_tree(struct inode *inode)
 {
 	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
@@ -70,6 +112,8 @@ static struct extent_tree *__grab_extent_tree(struct inode *inode)
 		rwlock_init(&et->lock);
 		atomic_set(&et->refcount, 0);
 		et->count = 0;
+		atomic_set(&et->reads, 0);
+		et->read_mostly = false;
 		sbi->total_ext_tree++;
 	}
 	atomic_inc(&et->refcount);
@@ -141,7 +185,7 @@ static unsigned int __free_extent_tree(struct f2fs_sb_info *sbi,
 		if (free_all) {
 			spin_lock(&sbi->extent_lock);
 			if (!list_empty(&en->list))
-				list_del_init(&en->list);
+				__lru_del_extent_node(sbi, en);
 			spin_unlock(&sbi->extent_lock);
 		}
 
@@ -197,7 +241,7 @@ static void __f2fs_init_extent_tree(struct inode *inode, struct f2fs_extent *i_e
 	en = __init_extent_tree(sbi, et, &ei);
 	if (en) {
 		spin_lock(&sbi->extent_lock);
-		list_add_tail(&en->list, &sbi->extent_list);
+		__lru_add_extent_node(sbi, et, en);
 		spin_unlock(&sbi->extent_lock);
 	}
 out:
@@ -212,6 +256,33 @@ void f2fs_init_extent_tree(struct inode *inode, struct f2fs_extent *i_ext)
 		set_inode_flag(F2FS_I(inode), FI_NO_EXTENT);
 }
 
+/*
+ * A file is treated as read-mostly once its name hints so, or once it has
+ * been looked up a number of times without any update in between.
+ */
+static void __try_promote_read_mostly(struct inode *inode,
+						struct extent_tree *et)
+{
+	if (et->read_mostly || !F2FS_I_SB(inode)->read_extent_budget)
+		return;
+
+	if (is_inode_flag_set(F2FS_I(inode), FI_READ_MOSTLY) ||
+		atomic_inc_return(&et->reads) >= READ_EXTENT_PROMOTE_READS)
+		et->read_mostly = true;
+}
+
+static void __demote_read_mostly(struct inode *inode)
+{
+	struct extent_tree *et = F2FS_I(inode)->extent_tree;
+
+	if (!et)
+		return;
+
+	atomic_set(&et->reads, 0);
+	if (!is_inode_flag_set(F2FS_I(inode), FI_READ_MOSTLY))
+		et->read_mostly = false;
+}
+
 static bool f2fs_lookup_extent_tree(struct inode *inode, pgoff_t pgofs,
 							struct extent_info *ei)
 {
@@ -226,6 +297,8 @@ static bool f2fs_lookup_extent_tree(struct inode *inode, pgoff_t pgofs,
 
 	read_lock(&et->lock);
 
+	__try_promote_read_mostly(inode, et);
+
 	if (et->largest.fofs <= pgofs &&
 			et->largest.fofs + et->largest.len > pgofs) {
 		*ei = et->largest;
@@ -239,12 +312,14 @@ static bool f2fs_lookup_extent_tree(struct inode *inode, pgoff_t pgofs,
 		*ei = en->ei;
 		spin_lock(&sbi->extent_lock);
 		if (!list_empty(&en->list))
-			list_move_tail(&en->list, &sbi->extent_list);
+			__lru_move_extent_node(sbi, et, en);
 		et->cached_en = en;
 		spin_unlock(&sbi->extent_lock);
 		ret = true;
 	}
 out:
+	if (ret && et->read_mostly)
+		stat_inc_read_mostly_hit(sbi);
 	stat_inc_total_hit(sbi);
 	read_unlock(&et->lock);
 
@@ -412,6 +487,7 @@ static unsigned int f2fs_update_extent_tree_range(struct inode *inode,
 	struct rb_node **insert_p = NULL, *insert_parent = NULL;
 	unsigned int end = fofs + len;
 	unsigned int pos = (unsigned int)fofs;
+	unsigned int min_len;
 
 	if (!et)
 		return false;
@@ -428,6 +504,9 @@ static unsigned int f2fs_update_extent_tree_range(struct inode *inode,
 	prev = et->largest;
 	dei.len = 0;
 
+	/* keep every fragment of read-mostly files to have their full map */
+	min_len = et->read_mostly ? 1 : F2FS_MIN_EXTENT_LEN;
+
 	/*
 	 * drop largest extent before lookup, in case it's already
 	 * been shrunk from extent tree
@@ -451,13 +530,13 @@ static unsigned int f2fs_update_extent_tree_range(struct inode *inode,
 		org_end = dei.fofs + dei.len;
 		f2fs_bug_on(sbi, pos >= org_end);
 
-		if (pos > dei.fofs &&	pos - dei.fofs >= F2FS_MIN_EXTENT_LEN) {
+		if (pos > dei.fofs &&	pos - dei.fofs >= min_len) {
 			en->ei.len = pos - en->ei.fofs;
 			prev_en = en;
 			parts = 1;
 		}
 
-		if (end < org_end && org_end - end >= F2FS_MIN_EXTENT_LEN) {
+		if (end < org_end && org_end - end >= min_len) {
 			if (parts) {
 				set_extent_info(&ei, end,
 						end - dei.fofs + dei.blk,
@@ -500,9 +579,9 @@ static unsigned int f2fs_update_extent_tree_range(struct inode *inode,
 		/* update in global extent list */
 		spin_lock(&sbi->extent_lock);
 		if (!parts && !list_empty(&en->list))
-			list_del(&en->list);
+			__lru_del_extent_node(sbi, en);
 		if (en1)
-			list_add_tail(&en1->list, &sbi->extent_list);
+			__lru_add_extent_node(sbi, et, en1);
 		spin_unlock(&sbi->extent_lock);
 
 		/* release extent node */
@@ -524,7 +603,7 @@ static unsigned int f2fs_update_extent_tree_range(struct inode *inode,
 						insert_p, insert_parent);
 
 		/* give up extent_cache, if split and small updates happen */
-		if (dei.len >= 1 &&
+		if (!et->read_mostly && dei.len >= 1 &&
 				prev.len < F2FS_MIN_EXTENT_LEN &&
 				et->largest.len < F2FS_MIN_EXTENT_LEN) {
 			et->largest.len = 0;
@@ -534,12 +613,12 @@ static unsigned int f2fs_update_extent_tree_range(struct inode *inode,
 		spin_lock(&sbi->extent_lock);
 		if (en1) {
 			if (list_empty(&en1->list))
-				list_add_tail(&en1->list, &sbi->extent_list);
+				__lru_add_extent_node(sbi, et, en1);
 			else
-				list_move_tail(&en1->list, &sbi->extent_list);
+				__lru_move_extent_node(sbi, et, en1);
 		}
 		if (den && !list_empty(&den->list))
-			list_del(&den->list);
+			__lru_del_extent_node(sbi, den);
 		spin_unlock(&sbi->extent_lock);
 
 		if (den)
@@ -554,10 +633,25 @@ static unsigned int f2fs_update_extent_tree_range(struct inode *inode,
 	return !__is_extent_same(&prev, &et->largest);
 }
 
-unsigned int f2fs_shrink_extent_tree(struct f2fs_sb_info *sbi, int nr_shrink)
+static int __detach_lru_extent_nodes(struct f2fs_sb_info *sbi,
+					struct list_head *head, int nr)
 {
-	struct extent_tree *treevec[EXT_TREE_VEC_SIZE];
 	struct extent_node *en, *tmp;
+	int detached = 0;
+
+	list_for_each_entry_safe(en, tmp, head, list) {
+		if (detached >= nr)
+			break;
+		__lru_del_extent_node(sbi, en);
+		detached++;
+	}
+	return detached;
+}
+
+static unsigned int __shrink_extent_tree(struct f2fs_sb_info *sbi,
+					int nr_shrink, bool read_only)
+{
+	struct extent_tree *treevec[EXT_TREE_VEC_SIZE];
 	unsigned long ino = F2FS_ROOT_INO(sbi);
 	struct radix_tree_root *root = &sbi->extent_tree_root;
 	unsigned int found;
@@ -571,7 +665,7 @@ unsigned int f2fs_shrink_extent_tree(struct f2fs_sb_info *sbi, int nr_shrink)
 		goto out;
 
 	/* 1. remove unreferenced extent tree */
-	while ((found = radix_tree_gang_lookup(root,
+	while (!read_only && (found = radix_tree_gang_lookup(root,
 				(void **)treevec, ino, EXT_TREE_VEC_SIZE))) {
 		unsigned i;
 
@@ -602,12 +696,14 @@ unsigned int f2fs_shrink_extent_tree(struct f2fs_sb_info *sbi, int nr_shrink)
 
 	remained = nr_shrink - (node_cnt + tree_cnt);
 
+	/* extents of read-mostly files go only after the ordinary ones */
 	spin_lock(&sbi->extent_lock);
-	list_for_each_entry_safe(en, tmp, &sbi->extent_list, list) {
-		if (!remained--)
-			break;
-		list_del_init(&en->list);
-	}
+	if (!read_only)
+		remained -= __detach_lru_extent_nodes(sbi,
+					&sbi->extent_list, remained);
+	if (remained > 0)
+		__detach_lru_extent_nodes(sbi, &sbi->read_extent_list,
+								remained);
 	spin_unlock(&sbi->extent_lock);
 
 	/*
@@ -639,6 +735,27 @@ out:
 	return node_cnt + tree_cnt;
 }
 
+unsigned int f2fs_shrink_extent_tree(struct f2fs_sb_info *sbi, int nr_shrink)
+{
+	return __shrink_extent_tree(sbi, nr_shrink, false);
+}
+
+/*
+ * Trim extents of read-mostly files back under their memory budget,
+ * dropping the least recently used ones first.
+ */
+unsigned int f2fs_shrink_read_extent_cache(struct f2fs_sb_info *sbi)
+{
+	unsigned long nr_nodes = sbi->nr_read_ext_node;
+	unsigned long max_nodes = __max_read_extent_nodes(sbi);
+
+	if (nr_nodes <= max_nodes)
+		return 0;
+
+	return __shrink_extent_tree(sbi, min_t(unsigned long,
+			nr_nodes - max_nodes, EXTENT_CACHE_SHRINK_NUMBER), true);
+}
+
 unsigned int f2fs_destroy_extent_node(struct inode *inode)
 {
 	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
@@ -705,6 +822,7 @@ void f2fs_update_extent_cache(struct dnode_of_data *dn)
 
 	f2fs_bug_on(F2FS_I_SB(dn->inode), dn->data_blkaddr == NEW_ADDR);
 
+	__demote_read_mostly(dn->inode);
 
 	fofs = start_bidx_of_node(ofs_of_node(dn->node_page), fi) +
 							dn->ofs_in_node;
@@ -720,18 +838,49 @@ void f2fs_update_extent_cache_range(struct dnode_of_data *dn,
 	if (!f2fs_may_extent_tree(dn->inode))
 		return;
 
+	__demote_read_mostly(dn->inode);
+
 	if (f2fs_update_extent_tree_range(dn->inode, fofs, blkaddr, len))
 		sync_inode_page(dn);
 }
 
+/*
+ * Cache the mapping found by a read which missed in the extent cache, so
+ * that read-mostly files build up their full extent map rather than only
+ * what has been written since mount.  Caller should hold the dnode page
+ * mapping the range, as writers update the extent cache under it as well.
+ */
+void f2fs_cache_read_extent(struct inode *inode, pgoff_t fofs,
+				block_t blkaddr, unsigned int len)
+{
+	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	struct extent_tree *et = F2FS_I(inode)->extent_tree;
+	unsigned long nr_nodes, max_nodes;
+
+	if (!f2fs_may_extent_tree(inode) || !et || !et->read_mostly)
+		return;
+
+	/* leave some slack for f2fs_balance_fs_bg to rotate the lru */
+	nr_nodes = sbi->nr_read_ext_node;
+	max_nodes = __max_read_extent_nodes(sbi);
+	if (nr_nodes >= max_nodes && nr_nodes - max_nodes >= max_nodes >> 3)
+		return;
+
+	f2fs_update_extent_tree_range(inode, fofs, blkaddr, len);
+	stat_inc_read_ext_fill(sbi);
+}
+
 void init_extent_cache_info(struct f2fs_sb_info *sbi)
 {
 	INIT_RADIX_TREE(&sbi->extent_tree_root, GFP_NOIO);
 	init_rwsem(&sbi->extent_tree_lock);
 	INIT_LIST_HEAD(&sbi->extent_list);
+	INIT_LIST_HEAD(&sbi->read_extent_list);
 	spin_lock_init(&sbi->extent_lock);
 	sbi->total_ext_tree = 0;
 	atomic_set(&sbi->total_ext_node, 0);
+	sbi->nr_read_ext_node = 0;
+	sbi->read_extent_budget = DEF_READ_EXTENT_BUDGET;
 }
 
 int __init create_extent_cache(void)
@@ -125,6 +125,14 @@ enum {
 #define BATCHED_TRIM_BLOCKS(sbi)	\
 		(BATCHED_TRIM_SEGMENTS(sbi) << (sbi)->log_blocks_per_seg)
 #define DEF_CP_INTERVAL			60	/* 60 secs */
+#define DEF_MAX_DISCARD_SEGMENTS	16	/* per discard round */
+#define DEF_DISCARD_INTERVAL		50	/* 50 ms */
+
+/* block lifetimes are measured in data blocks allocated meanwhile */
+#define DEF_HOT_DATA_AGE_THRESHOLD	262144	/* 1GB of data writes */
+#define DEF_WARM_DATA_AGE_THRESHOLD	2621440	/* 10GB of data writes */
+#define NR_DATA_AGE_HIST		8	/* lifetime histogram buckets */
+#define DATA_AGE_HIST_SHIFT		12	/* 1st bucket is < 4K blocks */
 
 struct cp_control {
 	int reason;
@@ -340,6 +348,12 @@ enum {
 /* number of extent info in extent cache we try to shrink */
 #define EXTENT_CACHE_SHRINK_NUMBER	128
 
+/* memory budget (KB) of extents kept for read-mostly files */
+#define DEF_READ_EXTENT_BUDGET		4096
+
+/* # of extent lookups without a write to treat a file as read-mostly */
+#define READ_EXTENT_PROMOTE_READS	64
+
 struct extent_info {
 	unsigned int fofs;		/* start offset in a file */
 	u32 blk;			/* start block address of the extent */
@@ -350,6 +364,7 @@ struct extent_node {
 	struct rb_node rb_node;		/* rb node located in rb-tree */
 	struct list_head list;		/* node in global extent list of sbi */
 	struct extent_info ei;		/* extent info */
+	bool read_lru;			/* linked in read-mostly extent list */
 };
 
 struct extent_tree {
@@ -360,6 +375,8 @@ struct extent_tree {
 	rwlock_t lock;			/* protect extent info rb-tree */
 	atomic_t refcount;		/* reference count of rb-tree */
 	unsigned int count;		/* # of extent node in rb-tree*/
+	atomic_t reads;			/* # of lookups since last update */
+	bool read_mostly;		/* keep full extent map of the file */
 };
 
 /*
@@ -441,6 +458,8 @@ struct f2fs_inode_info {
 
 	struct extent_tree *extent_tree;	/* cached extent_tree entry */
 
+	unsigned long long i_data_age;	/* avg. lifetime of rewritten blocks */
+
 #ifdef CONFIG_F2FS_FS_ENCRYPTION
 	/* Encryption params */
 	struct f2fs_crypt_info *i_crypt_info;
@@ -598,6 +617,27 @@ struct flush_cmd_control {
 	struct llist_node *dispatch_list;	/* list for command dispatch */
 };
 
+/* for discard commands handed to the discard thread */
+struct discard_cmd {
+	struct list_head list;	/* pending or issue list */
+	block_t lstart;		/* start block address of the discard */
+	block_t len;		/* # of consecutive blocks of the discard */
+};
+
+struct discard_cmd_control {
+	struct task_struct *f2fs_issue_discard;	/* discard thread */
+	wait_queue_head_t discard_wait_queue;	/* waiting queue for wake-up */
+	wait_queue_head_t discard_done_queue;	/* waiting queue for completion */
+	struct mutex cmd_lock;			/* protects lists and counters */
+	struct list_head pend_list;		/* pending discards by address */
+	struct list_head issue_list;		/* discards being issued */
+	unsigned int nr_pending;		/* # of pending discard commands */
+	unsigned int pending_blks;		/* # of blocks pending discard */
+	unsigned int issue_seq;			/* bumped on every completion */
+	unsigned long long issued_cmds;		/* # of issued discard commands */
+	unsigned long long issued_blks;		/* # of issued discard blocks */
+};
+
 struct f2fs_sm_info {
 	struct sit_info *sit_info;		/* whole segment information */
 	struct free_segmap_info *free_info;	/* free segment information */
@@ -624,6 +664,10 @@ struct f2fs_sm_info {
 	/* for batched trimming */
 	unsigned int trim_sections;		/* # of sections to trim */
 
+	/* for background discard */
+	unsigned int max_discard_blocks;	/* max. blocks per discard round */
+	unsigned int discard_interval;		/* discard round interval in ms */
+
 	struct list_head sit_entry_set;	/* sit entry set list */
 
 	unsigned int ipu_policy;	/* in-place-update policy */
@@ -633,6 +677,9 @@ struct f2fs_sm_info {
 	/* for flush command control */
 	struct flush_cmd_control *cmd_control_info;
 
+	/* for discard command control */
+	struct discard_cmd_control *dcc_info;
+
 };
 
 /*
@@ -752,9 +799,12 @@ struct f2fs_sb_info {
 	struct radix_tree_root extent_tree_root;/* cache extent cache entries */
 	struct rw_semaphore extent_tree_lock;	/* locking extent radix tree */
 	struct list_head extent_list;		/* lru list for shrinker */
-	spinlock_t extent_lock;			/* locking extent lru list */
+	struct list_head read_extent_list;	/* lru list of read-mostly files */
+	spinlock_t extent_lock;			/* locking extent lru lists */
 	int total_ext_tree;			/* extent tree count */
 	atomic_t total_ext_node;		/* extent info count */
+	int nr_read_ext_node;			/* # of read-mostly extent info */
+	unsigned int read_extent_budget;	/* read-mostly extents budget (KB) */
 
 	/* basic filesystem units */
 	unsigned int log_sectors_per_block;	/* log2 sectors per block */
@@ -792,6 +842,11 @@ struct f2fs_sb_info {
 	/* maximum # of trials to find a victim segment for SSR and GC */
 	unsigned int max_victim_search;
 
+	/* for block age based data temperature */
+	atomic64_t data_age_clock;		/* # of data blocks allocated */
+	unsigned int hot_data_age_threshold;	/* shorter lifetime is hot */
+	unsigned int warm_data_age_threshold;	/* shorter lifetime is warm */
+
 	/*
 	 * for stat information.
 	 * one is for the LFS mode, and the other is for the SSR mode.
@@ -805,9 +860,13 @@ struct f2fs_sb_info {
 	atomic64_t read_hit_rbtree;		/* # of hit rbtree extent node */
 	atomic64_t read_hit_largest;		/* # of hit largest extent node */
 	atomic64_t read_hit_cached;		/* # of hit cached extent node */
+	atomic64_t read_hit_mostly;		/* # of hit in read-mostly files */
+	atomic64_t read_ext_fill;		/* # of extents cached by reads */
 	atomic_t inline_xattr;			/* # of inline_xattr inodes */
 	atomic_t inline_inode;			/* # of inline_data inodes */
 	atomic_t inline_dir;			/* # of inline_dentry inodes */
+	atomic64_t data_age_hist[NR_DATA_AGE_HIST];	/* block lifetimes */
+	atomic64_t data_age_type[CURSEG_COLD_DATA + 1];	/* blocks per log */
 	int bg_gc;				/* background gc calls */
 	unsigned int n_dirty_dirs;		/* # of dir inodes */
 #endif
@@ -1416,6 +1475,7 @@ enum {
 	FI_DROP_CACHE,		/* drop dirty page cache */
 	FI_DATA_EXIST,		/* indicate data exists */
 	FI_INLINE_DOTS,		/* indicate inline dot dentries */
+	FI_READ_MOSTLY,		/* file is expected to be read-mostly */
 };
 
 static inline void set_inode_flag(struct f2fs_inode_info *fi, int flag)
@@ -1774,9 +1834,14 @@ void f2fs_balance_fs_bg(struct f2fs_sb_info *);
 int f2fs_issue_flush(struct f2fs_sb_info *);
 int create_flush_cmd_control(struct f2fs_sb_info *);
 void destroy_flush_cmd_control(struct f2fs_sb_info *);
+int create_discard_cmd_control(struct f2fs_sb_info *);
+void destroy_discard_cmd_control(struct f2fs_sb_info *);
+void f2fs_flush_discard_cmds(struct f2fs_sb_info *);
 void invalidate_blocks(struct f2fs_sb_info *, block_t);
 bool is_checkpointed_data(struct f2fs_sb_info *, block_t);
 void refresh_sit_entry(struct f2fs_sb_info *, block_t, block_t);
+void f2fs_update_data_age(struct inode *, block_t);
+void refresh_victim_entry(struct f2fs_sb_info *, unsigned int);
 void clear_prefree_segments(struct f2fs_sb_info *, struct cp_control *);
 void release_discard_addrs(struct f2fs_sb_info *);
 bool discard_next_dnode(struct f2fs_sb_info *, block_t);
@@ -1879,11 +1944,14 @@ struct f2fs_stat_info {
 	int main_area_segs, main_area_sections, main_area_zones;
 	unsigned long long hit_largest, hit_cached, hit_rbtree;
 	unsigned long long hit_total, total_ext;
-	int ext_tree, ext_node;
+	unsigned long long hit_mostly, ext_fill;
+	int ext_tree, ext_node, read_ext_node;
 	int ndirty_node, ndirty_dent, ndirty_dirs, ndirty_meta;
 	int nats, dirty_nats, sits, dirty_sits, fnids;
 	int total_count, utilization;
 	int bg_gc, inmem_pages, wb_pages;
+	unsigned int discard_cmds, discard_blks;
+	unsigned long long issued_discards, issued_discard_blks;
 	int inline_xattr, inline_inode, inline_dir;
 	unsigned int valid_count, valid_node_count, valid_inode_count;
 	unsigned int bimodal, avg_vblocks;
@@ -1902,6 +1970,8 @@ struct f2fs_stat_info {
 	unsigned int segment_count[2];
 	unsigned int block_count[2];
 	unsigned int inplace_count;
+	unsigned long long data_age_hist[NR_DATA_AGE_HIST];
+	unsigned long long data_age_type[CURSEG_COLD_DATA + 1];
 	unsigned long long base_mem, cache_mem, page_mem;
 };
 
@@ -1919,6 +1989,8 @@ static inline struct f2fs_stat_info *F2FS_STAT(struct f2fs_sb_info *sbi)
 #define stat_inc_rbtree_node_hit(sbi)	(atomic64_inc(&(sbi)->read_hit_rbtree))
 #define stat_inc_largest_node_hit(sbi)	(atomic64_inc(&(sbi)->read_hit_largest))
 #define stat_inc_cached_node_hit(sbi)	(atomic64_inc(&(sbi)->read_hit_cached))
+#define stat_inc_read_mostly_hit(sbi)	(atomic64_inc(&(sbi)->read_hit_mostly))
+#define stat_inc_read_ext_fill(sbi)	(atomic64_inc(&(sbi)->read_ext_fill))
 #define stat_inc_inline_xattr(inode)					\
 	do {								\
 		if (f2fs_has_inline_xattr(inode))			\
@@ -1955,6 +2027,10 @@ static inline struct f2fs_stat_info *F2FS_STAT(struct f2fs_sb_info *sbi)
 		((sbi)->block_count[(curseg)->alloc_type]++)
 #define stat_inc_inplace_blocks(sbi)					\
 		(atomic_inc(&(sbi)->inplace_count))
+#define stat_inc_data_age_hist(sbi, i)					\
+		(atomic64_inc(&(sbi)->data_age_hist[i]))
+#define stat_inc_data_age_type(sbi, type)				\
+		(atomic64_inc(&(sbi)->data_age_type[type]))
 #define stat_inc_seg_count(sbi, type, gc_type)				\
 	do {								\
 		struct f2fs_stat_info *si = F2FS_STAT(sbi);		\
@@ -2001,6 +2077,8 @@ void f2fs_destroy_root_stats(void);
 #define stat_inc_rbtree_node_hit(sb)
 #define stat_inc_largest_node_hit(sbi)
 #define stat_inc_cached_node_hit(sbi)
+#define stat_inc_read_mostly_hit(sbi)
+#define stat_inc_read_ext_fill(sbi)
 #define stat_inc_inline_xattr(inode)
 #define stat_dec_inline_xattr(inode)
 #define stat_inc_inline_inode(inode)
@@ -2010,6 +2088,8 @@ void f2fs_destroy_root_stats(void);
 #define stat_inc_seg_type(sbi, curseg)
 #define stat_inc_block_count(sbi, curseg)
 #define stat_inc_inplace_blocks(sbi)
+#define stat_inc_data_age_hist(sbi, i)
+#define stat_inc_data_age_type(sbi, type)
 #define stat_inc_seg_count(sbi, type, gc_type)
 #define stat_inc_tot_blk_count(si, blks)
 #define stat_inc_data_blk_count(sbi, blks, gc_type)
@@ -2071,12 +2151,14 @@ void f2fs_leave_shrinker(struct f2fs_sb_info *);
  * extent_cache.c
  */
 unsigned int f2fs_shrink_extent_tree(struct f2fs_sb_info *, int);
+unsigned int f2fs_shrink_read_extent_cache(struct f2fs_sb_info *);
 void f2fs_drop_largest_extent(struct inode *, pgoff_t);
 void f2fs_init_extent_tree(struct inode *, struct f2fs_extent *);
 unsigned int f2fs_destroy_extent_node(struct inode *);
 void f2fs_destroy_extent_tree(struct inode *);
 bool f2fs_lookup_extent_cache(struct inode *, pgoff_t, struct extent_info *);
 void f2fs_update_extent_cache(struct dnode_of_data *);
+void f2fs_cache_read_extent(struct inode *, pgoff_t, block_t, unsigned int);
 void f2fs_update_extent_cache_range(struct dnode_of_data *dn,
 						pgoff_t, block_t, unsigned int);
 void init_extent_cache_info(struct f2fs_sb_info *);
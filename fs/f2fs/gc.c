@@ -24,6 +24,127 @@
 #include "gc.h"
 #include <trace/events/f2fs.h>
 
+/*
+ * Sample the statistics of the whole disk, since IO to other partitions
+ * competes with GC as well.  The disk was busy if requests are in flight or
+ * it accounted busy time since the last sample; the latency of the IOs that
+ * completed meanwhile is folded into avg_latency.
+ */
+static void sample_disk_activity(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_gc_kthread *gc_th = sbi->gc_thread;
+	struct hd_struct *part = &sbi->sb->s_bdev->bd_disk->part0;
+	unsigned long io_ticks, ios, ticks;
+	unsigned int latency;
+
+	io_ticks = part_stat_read(part, io_ticks);
+	ios = part_stat_read(part, ios[READ]) + part_stat_read(part, ios[WRITE]);
+	ticks = part_stat_read(part, ticks[READ]) +
+				part_stat_read(part, ticks[WRITE]);
+
+	if (part_in_flight(part) || io_ticks != gc_th->last_io_ticks)
+		gc_th->last_busy = jiffies;
+
+	if (ios != gc_th->last_ios) {
+		latency = jiffies_to_usecs(ticks - gc_th->last_ticks) /
+						(ios - gc_th->last_ios);
+		gc_th->avg_latency = gc_th->avg_latency ?
+			(3 * gc_th->avg_latency + latency) / 4 : latency;
+	}
+
+	gc_th->last_io_ticks = io_ticks;
+	gc_th->last_ios = ios;
+	gc_th->last_ticks = ticks;
+}
+
+/*
+ * 0 while free sections are plenty, up to GC_MAX_URGENCY as they come down
+ * to the point where foreground GC takes over.
+ */
+static unsigned int gc_urgency(struct f2fs_sb_info *sbi)
+{
+	int node_secs = get_blocktype_secs(sbi, F2FS_DIRTY_NODES);
+	int dent_secs = get_blocktype_secs(sbi, F2FS_DIRTY_DENTS);
+	int fg_secs = node_secs + 2 * dent_secs + reserved_sections(sbi);
+	int free_secs = free_sections(sbi);
+
+	if (free_secs <= fg_secs)
+		return GC_MAX_URGENCY;
+	if (free_secs >= 3 * fg_secs)
+		return 0;
+	return GC_MAX_URGENCY * (3 * fg_secs - free_secs) / (2 * fg_secs);
+}
+
+/*
+ * The gap has to outlast a few recent IOs, so that a slow disk is not
+ * taken as idle between two requests of the same burst of foreground IO.
+ * It shrinks with urgency.
+ */
+static bool disk_is_idle(struct f2fs_sb_info *sbi, unsigned int urgency)
+{
+	struct f2fs_gc_kthread *gc_th = sbi->gc_thread;
+	struct hd_struct *part = &sbi->sb->s_bdev->bd_disk->part0;
+	unsigned int gap_ms;
+
+	if (part_in_flight(part))
+		return false;
+
+	gap_ms = max(gc_th->idle_gap, 4 * gc_th->avg_latency / 1000);
+	return time_after_eq(jiffies, gc_th->last_busy +
+				(msecs_to_jiffies(gap_ms) >> urgency));
+}
+
+/*
+ * Idle-aware background GC: poll the disk and collect a bounded burst of
+ * sections once it has been idle long enough.  The burst stops as soon as
+ * other IO shows up and grows as free sections run out.
+ */
+static void idle_gc(struct f2fs_sb_info *sbi, long *wait_ms)
+{
+	struct f2fs_gc_kthread *gc_th = sbi->gc_thread;
+	struct hd_struct *part = &sbi->sb->s_bdev->bd_disk->part0;
+	unsigned int urgency = gc_urgency(sbi);
+	unsigned int burst, i;
+
+	sample_disk_activity(sbi);
+
+	if (!urgency && !has_enough_invalid_blocks(sbi)) {
+		*wait_ms = gc_th->max_sleep_time;
+		return;
+	}
+
+	*wait_ms = DEF_GC_IDLE_POLL_TIME;
+	if (!disk_is_idle(sbi, urgency))
+		return;
+
+	burst = max(gc_th->burst_sections, 1U) << urgency;
+	for (i = 0; i < burst && !kthread_should_stop(); i++) {
+		if (!mutex_trylock(&sbi->gc_mutex))
+			break;
+
+		stat_inc_bggc_count(sbi);
+
+		/* if return value is not zero, no victim was selected */
+		if (f2fs_gc(sbi, test_opt(sbi, FORCE_FG_GC))) {
+			*wait_ms = gc_th->no_gc_sleep_time;
+			break;
+		}
+
+		if (part_in_flight(part))
+			break;
+	}
+
+	trace_f2fs_background_gc(sbi->sb, *wait_ms,
+			prefree_segments(sbi), free_segments(sbi));
+
+	/* balancing f2fs's metadata periodically */
+	f2fs_balance_fs_bg(sbi);
+
+	/* our own IO is no idleness, wait for the next gap */
+	sample_disk_activity(sbi);
+	gc_th->last_busy = jiffies;
+}
+
 static int gc_thread_func(void *data)
 {
 	struct f2fs_sb_info *sbi = data;
@@ -48,6 +169,11 @@ static int gc_thread_func(void *data)
 			continue;
 		}
 
+		if (gc_th->idle_aware) {
+			idle_gc(sbi, &wait_ms);
+			continue;
+		}
+
 		/*
 		 * [GC triggering condition]
 		 * 0. GC is not conducted currently.
@@ -109,6 +235,15 @@ int start_gc_thread(struct f2fs_sb_info *sbi)
 
 	gc_th->gc_idle = 0;
 
+	gc_th->idle_aware = 0;
+	gc_th->idle_gap = DEF_GC_IDLE_GAP;
+	gc_th->burst_sections = DEF_GC_BURST_SECTIONS;
+	gc_th->last_busy = jiffies;
+	gc_th->last_io_ticks = 0;
+	gc_th->last_ios = 0;
+	gc_th->last_ticks = 0;
+	gc_th->avg_latency = 0;
+
 	sbi->gc_thread = gc_th;
 	init_waitqueue_head(&sbi->gc_thread->gc_wait_queue_head);
 	sbi->gc_thread->f2fs_gc_task = kthread_run(gc_thread_func, sbi,
@@ -205,18 +340,14 @@ static unsigned int get_cb_cost(struct f2fs_sb_info *sbi, unsigned int segno)
 {
 	struct sit_info *sit_i = SIT_I(sbi);
 	unsigned int secno = GET_SECNO(sbi, segno);
-	unsigned int start = secno * sbi->segs_per_sec;
-	unsigned long long mtime = 0;
+	unsigned long long mtime;
 	unsigned int vblocks;
 	unsigned char age = 0;
 	unsigned char u;
-	unsigned int i;
 
-	for (i = 0; i < sbi->segs_per_sec; i++)
-		mtime += get_seg_entry(sbi, start + i)->mtime;
+	mtime = get_sec_mtime(sbi, secno);
 	vblocks = get_valid_blocks(sbi, segno, sbi->segs_per_sec);
 
-	mtime = div_u64(mtime, sbi->segs_per_sec);
 	vblocks = div_u64(vblocks, sbi->segs_per_sec);
 
 	u = (vblocks * 100) >> sbi->log_blocks_per_seg;
@@ -246,6 +377,54 @@ static inline unsigned int get_gc_cost(struct f2fs_sb_info *sbi,
 		return get_cb_cost(sbi, segno);
 }
 
+/*
+ * LFS victims are looked up in the valid block buckets rather than by
+ * scanning dirty_segmap.  Greedy takes the first usable section of the
+ * lowest bucket; cost-benefit only has to compare the head of each bucket,
+ * since sections of a bucket share utilization and are kept oldest first.
+ */
+static void lookup_victim_buckets(struct f2fs_sb_info *sbi, int gc_type,
+						struct victim_sel_policy *p)
+{
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	struct victim_entry *ve, *tmp;
+	unsigned int bucket, secno, segno;
+	unsigned long cost;
+
+	for_each_set_bit(bucket, dirty_i->victim_bucketmap,
+					dirty_i->nr_victim_buckets) {
+		list_for_each_entry_safe(ve, tmp,
+				&dirty_i->victim_buckets[bucket], list) {
+			secno = ve - dirty_i->victim_entries;
+
+			if (sec_usage_check(sbi, secno))
+				continue;
+			if (gc_type == BG_GC &&
+					test_bit(secno, dirty_i->victim_secmap))
+				continue;
+
+			segno = secno * sbi->segs_per_sec;
+
+			/* it missed updates while holding a current segment */
+			if (unlikely(get_valid_blocks(sbi, segno,
+					sbi->segs_per_sec) != ve->vblocks)) {
+				refresh_victim_entry(sbi, secno);
+				continue;
+			}
+
+			cost = get_gc_cost(sbi, segno, p);
+			if (p->min_cost > cost) {
+				p->min_segno = segno;
+				p->min_cost = cost;
+			}
+			break;
+		}
+
+		if (p->gc_mode == GC_GREEDY && p->min_segno != NULL_SEGNO)
+			break;
+	}
+}
+
 /*
  * This function is called from two paths.
  * One is garbage collection and the other is SSR segment selection.
@@ -280,6 +459,11 @@ static int get_victim_by_default(struct f2fs_sb_info *sbi,
 			goto got_it;
 	}
 
+	if (p.alloc_mode == LFS) {
+		lookup_victim_buckets(sbi, gc_type, &p);
+		goto done;
+	}
+
 	while (1) {
 		unsigned long cost;
 		unsigned int segno;
@@ -320,6 +504,7 @@ static int get_victim_by_default(struct f2fs_sb_info *sbi,
 			break;
 		}
 	}
+done:
 	if (p.min_segno != NULL_SEGNO) {
 got_it:
 		if (p.alloc_mode == LFS) {
@@ -16,10 +16,14 @@
 #define DEF_GC_THREAD_MIN_SLEEP_TIME	30000	/* milliseconds */
 #define DEF_GC_THREAD_MAX_SLEEP_TIME	60000
 #define DEF_GC_THREAD_NOGC_SLEEP_TIME	300000	/* wait 5 min */
+#define DEF_GC_IDLE_POLL_TIME		100	/* milliseconds */
+#define DEF_GC_IDLE_GAP			500	/* milliseconds */
+#define DEF_GC_BURST_SECTIONS		4
+#define GC_MAX_URGENCY			4	/* near foreground GC */
 #define LIMIT_INVALID_BLOCK	40 /* percentage over total user space */
 #define LIMIT_FREE_BLOCK	40 /* percentage over invalid + free space */
 
-/* Search max. number of dirty segments to select a victim segment */
+/* Search max. number of dirty segments to select an SSR victim segment */
 #define DEF_MAX_VICTIM_SEARCH 4096 /* covers 8GB */
 
 struct f2fs_gc_kthread {
@@ -33,6 +37,18 @@ struct f2fs_gc_kthread {
 
 	/* for changing gc mode */
 	unsigned int gc_idle;
+
+	/* for gc in device idle gaps */
+	unsigned int idle_aware;	/* gc only when the disk is idle */
+	unsigned int idle_gap;		/* ms of disk idleness before a burst */
+	unsigned int burst_sections;	/* # of sections per burst */
+
+	/* disk activity seen at the last sample */
+	unsigned long last_busy;	/* jiffies when it was last busy */
+	unsigned long last_io_ticks;	/* io_ticks of the whole disk */
+	unsigned long last_ios;		/* completed IOs of the whole disk */
+	unsigned long last_ticks;	/* time spent by those IOs */
+	unsigned int avg_latency;	/* recent avg. IO latency in us */
 };
 
 struct gc_inode_list {
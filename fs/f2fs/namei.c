@@ -120,6 +120,30 @@ static inline void set_cold_files(struct f2fs_sb_info *sbi, struct inode *inode,
 	}
 }
 
+/*
+ * Packages and compiled code are written once and read on every launch,
+ * so let the extent cache keep their full block map.
+ */
+static const char * const read_mostly_extensions[] = {
+	"apk", "dex", "odex", "vdex", "oat", "obb",
+};
+
+static inline void set_read_mostly_file(struct f2fs_sb_info *sbi,
+		struct inode *inode, const unsigned char *name)
+{
+	int i;
+
+	if (test_opt(sbi, DISABLE_EXT_IDENTIFY) || !S_ISREG(inode->i_mode))
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(read_mostly_extensions); i++) {
+		if (is_multimedia_file(name, read_mostly_extensions[i])) {
+			set_inode_flag(F2FS_I(inode), FI_READ_MOSTLY);
+			break;
+		}
+	}
+}
+
 static int f2fs_create(struct inode *dir, struct dentry *dentry, umode_t mode,
 						bool excl)
 {
@@ -136,6 +160,7 @@ static int f2fs_create(struct inode *dir, struct dentry *dentry, umode_t mode,
 
 	if (!test_opt(sbi, DISABLE_EXT_IDENTIFY))
 		set_cold_files(sbi, inode, dentry->d_name.name);
+	set_read_mostly_file(sbi, inode, dentry->d_name.name);
 
 	inode->i_op = &f2fs_file_inode_operations;
 	inode->i_fop = &f2fs_file_operations;
@@ -267,6 +292,8 @@ static struct dentry *f2fs_lookup(struct inode *dir, struct dentry *dentry,
 	if (IS_ERR(inode))
 		return ERR_CAST(inode);
 
+	set_read_mostly_file(F2FS_I_SB(inode), inode, dentry->d_name.name);
+
 	if (f2fs_has_inline_dots(inode)) {
 		err = __recover_dot_dentries(inode, dir->i_ino);
 		if (err)
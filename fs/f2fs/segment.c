@@ -14,18 +14,21 @@
 #include <linux/blkdev.h>
 #include <linux/prefetch.h>
 #include <linux/kthread.h>
+#include <linux/list_sort.h>
 #include <linux/swap.h>
 #include <linux/timer.h>
 
 #include "f2fs.h"
 #include "segment.h"
 #include "node.h"
+#include "gc.h"
 #include "trace.h"
 #include <trace/events/f2fs.h>
 
 #define __reverse_ffz(x) __reverse_ffs(~(x))
 
 static struct kmem_cache *discard_entry_slab;
+static struct kmem_cache *discard_cmd_slab;
 static struct kmem_cache *sit_entry_set_slab;
 static struct kmem_cache *inmem_entry_slab;
 
@@ -299,6 +302,9 @@ void f2fs_balance_fs_bg(struct f2fs_sb_info *sbi)
 	if (!available_free_memory(sbi, EXTENT_CACHE))
 		f2fs_shrink_extent_tree(sbi, EXTENT_CACHE_SHRINK_NUMBER);
 
+	/* keep extents of read-mostly files within their budget */
+	f2fs_shrink_read_extent_cache(sbi);
+
 	/* check the # of cached NAT entries */
 	if (!available_free_memory(sbi, NAT_ENTRIES))
 		try_to_free_nats(sbi, NAT_ENTRY_PER_BLOCK);
@@ -417,6 +423,345 @@ void destroy_flush_cmd_control(struct f2fs_sb_info *sbi)
 	SM_I(sbi)->cmd_control_info = NULL;
 }
 
+static struct discard_cmd *__create_discard_cmd(block_t lstart, block_t len)
+{
+	struct discard_cmd *dc;
+
+	dc = f2fs_kmem_cache_alloc(discard_cmd_slab, GFP_NOFS);
+	INIT_LIST_HEAD(&dc->list);
+	dc->lstart = lstart;
+	dc->len = len;
+	return dc;
+}
+
+static void __remove_discard_cmd(struct discard_cmd_control *dcc,
+						struct discard_cmd *dc)
+{
+	list_del(&dc->list);
+	dcc->nr_pending--;
+	dcc->pending_blks -= dc->len;
+	kmem_cache_free(discard_cmd_slab, dc);
+}
+
+/*
+ * Add [lstart, lstart + len) to the address-ordered pending list, merging it
+ * with every pending command it overlaps or touches.
+ * Should be called with cmd_lock held.
+ */
+static void __queue_discard_cmd(struct discard_cmd_control *dcc,
+						block_t lstart, block_t len)
+{
+	struct list_head *head = &dcc->pend_list;
+	struct discard_cmd *dc, *prev = NULL, *next;
+	block_t end;
+
+	/* checkpoint queues in ascending order, so the tail is the usual hit */
+	list_for_each_entry_reverse(dc, head, list) {
+		if (dc->lstart <= lstart) {
+			prev = dc;
+			break;
+		}
+	}
+
+	if (prev && prev->lstart + prev->len >= lstart) {
+		dc = prev;
+		end = max(dc->lstart + dc->len, lstart + len);
+		dcc->pending_blks += end - dc->lstart - dc->len;
+		dc->len = end - dc->lstart;
+	} else {
+		dc = __create_discard_cmd(lstart, len);
+		list_add(&dc->list, prev ? &prev->list : head);
+		dcc->nr_pending++;
+		dcc->pending_blks += len;
+	}
+
+	while (!list_is_last(&dc->list, head)) {
+		next = list_next_entry(dc, list);
+		if (next->lstart > dc->lstart + dc->len)
+			break;
+		end = max(dc->lstart + dc->len, next->lstart + next->len);
+		dcc->pending_blks += end - dc->lstart - dc->len;
+		dc->len = end - dc->lstart;
+		__remove_discard_cmd(dcc, next);
+	}
+}
+
+/*
+ * Issue up to @budget blocks from the head of the pending list.  Commands
+ * being issued are kept in issue_list so that f2fs_wait_discard_range() can
+ * find them; cmd_lock is dropped around the actual discard.
+ */
+static void __issue_discard_cmds(struct f2fs_sb_info *sbi,
+			struct discard_cmd_control *dcc, unsigned int budget)
+{
+	struct block_device *bdev = sbi->sb->s_bdev;
+	struct discard_cmd *dc;
+	block_t len;
+
+	mutex_lock(&dcc->cmd_lock);
+	while (budget && !list_empty(&dcc->pend_list)) {
+		dc = list_first_entry(&dcc->pend_list, struct discard_cmd, list);
+		len = min_t(block_t, dc->len, budget);
+
+		if (len < dc->len) {
+			struct discard_cmd *front;
+
+			front = __create_discard_cmd(dc->lstart, len);
+			dc->lstart += len;
+			dc->len -= len;
+			dcc->pending_blks -= len;
+			dc = front;
+		} else {
+			list_del(&dc->list);
+			dcc->nr_pending--;
+			dcc->pending_blks -= len;
+		}
+		list_add_tail(&dc->list, &dcc->issue_list);
+		mutex_unlock(&dcc->cmd_lock);
+
+		trace_f2fs_issue_discard(sbi->sb, dc->lstart, dc->len);
+		blkdev_issue_discard(bdev, SECTOR_FROM_BLOCK(dc->lstart),
+				SECTOR_FROM_BLOCK(dc->len), GFP_NOFS, 0);
+
+		mutex_lock(&dcc->cmd_lock);
+		list_del(&dc->list);
+		kmem_cache_free(discard_cmd_slab, dc);
+		dcc->issued_cmds++;
+		dcc->issued_blks += len;
+		dcc->issue_seq++;
+		wake_up_all(&dcc->discard_done_queue);
+		budget -= len;
+	}
+	mutex_unlock(&dcc->cmd_lock);
+}
+
+/* Should be called with cmd_lock held. */
+static bool __discard_issuing(struct discard_cmd_control *dcc,
+						block_t start, block_t end)
+{
+	struct discard_cmd *dc;
+
+	list_for_each_entry(dc, &dcc->issue_list, list)
+		if (dc->lstart < end && start < dc->lstart + dc->len)
+			return true;
+	return false;
+}
+
+/* Should be called with cmd_lock held, which is dropped while waiting. */
+static void __wait_discard_issuing(struct discard_cmd_control *dcc,
+						block_t start, block_t end)
+{
+	unsigned int seq;
+
+	while (__discard_issuing(dcc, start, end)) {
+		seq = dcc->issue_seq;
+		mutex_unlock(&dcc->cmd_lock);
+		wait_event(dcc->discard_done_queue,
+				READ_ONCE(dcc->issue_seq) != seq);
+		mutex_lock(&dcc->cmd_lock);
+	}
+}
+
+/*
+ * Blocks in [start, start + len) are about to be reused, so a discard must
+ * neither be issued for them later nor be in flight while they are written.
+ * Pending parts are dropped, in-flight ones are waited for.
+ */
+static void f2fs_wait_discard_range(struct f2fs_sb_info *sbi,
+						block_t start, block_t len)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	struct discard_cmd *dc, *tmp;
+	block_t end = start + len;
+	block_t dc_end;
+
+	if (!dcc)
+		return;
+
+	mutex_lock(&dcc->cmd_lock);
+	list_for_each_entry_safe(dc, tmp, &dcc->pend_list, list) {
+		if (dc->lstart >= end)
+			break;
+		dc_end = dc->lstart + dc->len;
+		if (dc_end <= start)
+			continue;
+
+		if (dc->lstart < start && dc_end > end) {
+			struct discard_cmd *tail;
+
+			tail = __create_discard_cmd(end, dc_end - end);
+			list_add(&tail->list, &dc->list);
+			dcc->nr_pending++;
+			dc->len = start - dc->lstart;
+			dcc->pending_blks -= len;
+		} else if (dc->lstart < start) {
+			dcc->pending_blks -= dc_end - start;
+			dc->len = start - dc->lstart;
+		} else if (dc_end > end) {
+			dcc->pending_blks -= end - dc->lstart;
+			dc->len = dc_end - end;
+			dc->lstart = end;
+		} else {
+			__remove_discard_cmd(dcc, dc);
+		}
+	}
+	__wait_discard_issuing(dcc, start, end);
+	mutex_unlock(&dcc->cmd_lock);
+}
+
+/*
+ * Issue every pending discard from the caller's context and wait for the
+ * ones the discard thread has in flight.  Used by FITRIM and at umount.
+ */
+void f2fs_flush_discard_cmds(struct f2fs_sb_info *sbi)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+
+	if (!dcc)
+		return;
+
+	__issue_discard_cmds(sbi, dcc, UINT_MAX);
+
+	mutex_lock(&dcc->cmd_lock);
+	__wait_discard_issuing(dcc, 0, MAX_BLKADDR(sbi));
+	mutex_unlock(&dcc->cmd_lock);
+}
+
+static int issue_discard_thread(void *data)
+{
+	struct f2fs_sb_info *sbi = data;
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	wait_queue_head_t *q = &dcc->discard_wait_queue;
+	unsigned int budget;
+	long timeout;
+repeat:
+	if (kthread_should_stop())
+		return 0;
+
+	if (READ_ONCE(dcc->nr_pending) && is_idle(sbi)) {
+		budget = SM_I(sbi)->max_discard_blocks;
+		__issue_discard_cmds(sbi, dcc, budget ? budget : UINT_MAX);
+	}
+
+	if (READ_ONCE(dcc->nr_pending)) {
+		/* discard_interval may be set to 0, don't spin on it */
+		timeout = max_t(long, 1,
+			msecs_to_jiffies(SM_I(sbi)->discard_interval));
+		wait_event_interruptible_timeout(*q, kthread_should_stop(),
+								timeout);
+	} else
+		wait_event_interruptible(*q, kthread_should_stop() ||
+					READ_ONCE(dcc->nr_pending));
+	goto repeat;
+}
+
+int create_discard_cmd_control(struct f2fs_sb_info *sbi)
+{
+	dev_t dev = sbi->sb->s_bdev->bd_dev;
+	struct discard_cmd_control *dcc;
+	int err;
+
+	dcc = kzalloc(sizeof(struct discard_cmd_control), GFP_KERNEL);
+	if (!dcc)
+		return -ENOMEM;
+	init_waitqueue_head(&dcc->discard_wait_queue);
+	init_waitqueue_head(&dcc->discard_done_queue);
+	mutex_init(&dcc->cmd_lock);
+	INIT_LIST_HEAD(&dcc->pend_list);
+	INIT_LIST_HEAD(&dcc->issue_list);
+	dcc->f2fs_issue_discard = kthread_create(issue_discard_thread, sbi,
+				"f2fs_discard-%u:%u", MAJOR(dev), MINOR(dev));
+	if (IS_ERR(dcc->f2fs_issue_discard)) {
+		err = PTR_ERR(dcc->f2fs_issue_discard);
+		kfree(dcc);
+		return err;
+	}
+
+	/*
+	 * Users load dcc_info without locking and may already be running on
+	 * a remount to rw, so publish it only once the thread exists.
+	 */
+	smp_store_release(&SM_I(sbi)->dcc_info, dcc);
+	wake_up_process(dcc->f2fs_issue_discard);
+	return 0;
+}
+
+void destroy_discard_cmd_control(struct f2fs_sb_info *sbi)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+
+	if (!dcc)
+		return;
+
+	kthread_stop(dcc->f2fs_issue_discard);
+	f2fs_flush_discard_cmds(sbi);
+	kfree(dcc);
+	SM_I(sbi)->dcc_info = NULL;
+}
+
+/*
+ * Put a section into the bucket of its current valid blocks.  Buckets are
+ * kept in mtime order, oldest first; a section is re-inserted whenever its
+ * blocks change, so it normally goes right to the tail.
+ * Should be called with seglist_lock held.
+ */
+static void __insert_victim_entry(struct f2fs_sb_info *sbi, unsigned int secno)
+{
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	struct victim_entry *ve = &dirty_i->victim_entries[secno];
+	unsigned long long mtime;
+	struct victim_entry *pos;
+	struct list_head *head;
+	unsigned int vblocks;
+
+	vblocks = get_valid_blocks(sbi, secno * sbi->segs_per_sec,
+							sbi->segs_per_sec);
+	if (unlikely(vblocks >= dirty_i->nr_victim_buckets)) {
+		f2fs_bug_on(sbi, 1);
+		vblocks = dirty_i->nr_victim_buckets - 1;
+	}
+
+	head = &dirty_i->victim_buckets[vblocks];
+	if (!dirty_i->victim_sorted) {
+		/* mount time, sorted once in sort_victim_buckets() */
+		list_add_tail(&ve->list, head);
+		goto out;
+	}
+
+	mtime = get_sec_mtime(sbi, secno);
+	list_for_each_entry_reverse(pos, head, list)
+		if (get_sec_mtime(sbi, pos - dirty_i->victim_entries) <= mtime)
+			break;
+	list_add(&ve->list, &pos->list);
+out:
+
+	ve->vblocks = vblocks;
+	set_bit(vblocks, dirty_i->victim_bucketmap);
+}
+
+static void __remove_victim_entry(struct f2fs_sb_info *sbi, unsigned int secno)
+{
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	struct victim_entry *ve = &dirty_i->victim_entries[secno];
+
+	list_del(&ve->list);
+	if (list_empty(&dirty_i->victim_buckets[ve->vblocks]))
+		clear_bit(ve->vblocks, dirty_i->victim_bucketmap);
+}
+
+/*
+ * Move a section holding dirty segments to the bucket matching its valid
+ * blocks.  Should be called with seglist_lock held.
+ */
+void refresh_victim_entry(struct f2fs_sb_info *sbi, unsigned int secno)
+{
+	if (!DIRTY_I(sbi)->victim_entries[secno].nr_dirty)
+		return;
+
+	__remove_victim_entry(sbi, secno);
+	__insert_victim_entry(sbi, secno);
+}
+
 static void __locate_dirty_segment(struct f2fs_sb_info *sbi, unsigned int segno,
 		enum dirty_type dirty_type)
 {
@@ -426,9 +771,17 @@ static void __locate_dirty_segment(struct f2fs_sb_info *sbi, unsigned int segno,
 	if (IS_CURSEG(sbi, segno))
 		return;
 
-	if (!test_and_set_bit(segno, dirty_i->dirty_segmap[dirty_type]))
+	if (!test_and_set_bit(segno, dirty_i->dirty_segmap[dirty_type])) {
 		dirty_i->nr_dirty[dirty_type]++;
 
+		if (dirty_type == DIRTY) {
+			unsigned int secno = GET_SECNO(sbi, segno);
+
+			if (!dirty_i->victim_entries[secno].nr_dirty++)
+				__insert_victim_entry(sbi, secno);
+		}
+	}
+
 	if (dirty_type == DIRTY) {
 		struct seg_entry *sentry = get_seg_entry(sbi, segno);
 		enum dirty_type t = sentry->type;
@@ -447,9 +800,17 @@ static void __remove_dirty_segment(struct f2fs_sb_info *sbi, unsigned int segno,
 {
 	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
 
-	if (test_and_clear_bit(segno, dirty_i->dirty_segmap[dirty_type]))
+	if (test_and_clear_bit(segno, dirty_i->dirty_segmap[dirty_type])) {
 		dirty_i->nr_dirty[dirty_type]--;
 
+		if (dirty_type == DIRTY) {
+			unsigned int secno = GET_SECNO(sbi, segno);
+
+			if (!--dirty_i->victim_entries[secno].nr_dirty)
+				__remove_victim_entry(sbi, secno);
+		}
+	}
+
 	if (dirty_type == DIRTY) {
 		struct seg_entry *sentry = get_seg_entry(sbi, segno);
 		enum dirty_type t = sentry->type;
@@ -490,14 +851,15 @@ static void locate_dirty_segment(struct f2fs_sb_info *sbi, unsigned int segno)
 		__remove_dirty_segment(sbi, segno, DIRTY);
 	}
 
+	/* the valid blocks of this section have just changed */
+	refresh_victim_entry(sbi, GET_SECNO(sbi, segno));
+
 	mutex_unlock(&dirty_i->seglist_lock);
 }
 
-static int f2fs_issue_discard(struct f2fs_sb_info *sbi,
+static void __mark_discarded(struct f2fs_sb_info *sbi,
 				block_t blkstart, block_t blklen)
 {
-	sector_t start = SECTOR_FROM_BLOCK(blkstart);
-	sector_t len = SECTOR_FROM_BLOCK(blklen);
 	struct seg_entry *se;
 	unsigned int offset;
 	block_t i;
@@ -509,10 +871,39 @@ static int f2fs_issue_discard(struct f2fs_sb_info *sbi,
 		if (!f2fs_test_and_set_bit(offset, se->discard_map))
 			sbi->discard_blks--;
 	}
+}
+
+static int f2fs_issue_discard(struct f2fs_sb_info *sbi,
+				block_t blkstart, block_t blklen)
+{
+	sector_t start = SECTOR_FROM_BLOCK(blkstart);
+	sector_t len = SECTOR_FROM_BLOCK(blklen);
+
+	__mark_discarded(sbi, blkstart, blklen);
 	trace_f2fs_issue_discard(sbi->sb, blkstart, blklen);
 	return blkdev_issue_discard(sbi->sb->s_bdev, start, len, GFP_NOFS, 0);
 }
 
+/*
+ * Hand the range to the discard thread instead of issuing it inline, so
+ * that a checkpoint after a large delete does not stall on the device.
+ */
+static void f2fs_queue_discard(struct f2fs_sb_info *sbi,
+				block_t blkstart, block_t blklen)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+
+	if (!dcc) {
+		f2fs_issue_discard(sbi, blkstart, blklen);
+		return;
+	}
+
+	__mark_discarded(sbi, blkstart, blklen);
+	mutex_lock(&dcc->cmd_lock);
+	__queue_discard_cmd(dcc, blkstart, blklen);
+	mutex_unlock(&dcc->cmd_lock);
+}
+
 bool discard_next_dnode(struct f2fs_sb_info *sbi, block_t blkaddr)
 {
 	int err = -ENOTSUPP;
@@ -630,11 +1021,11 @@ void clear_prefree_segments(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
 	unsigned long *prefree_map = dirty_i->dirty_segmap[PRE];
 	unsigned int start = 0, end = -1;
+	int i;
 
 	mutex_lock(&dirty_i->seglist_lock);
 
 	while (1) {
-		int i;
 		start = find_next_bit(prefree_map, MAIN_SEGS(sbi), end + 1);
 		if (start >= MAIN_SEGS(sbi))
 			break;
@@ -649,7 +1040,7 @@ void clear_prefree_segments(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 		if (!test_opt(sbi, DISCARD))
 			continue;
 
-		f2fs_issue_discard(sbi, START_BLOCK(sbi, start),
+		f2fs_queue_discard(sbi, START_BLOCK(sbi, start),
 				(end - start) << sbi->log_blocks_per_seg);
 	}
 	mutex_unlock(&dirty_i->seglist_lock);
@@ -658,13 +1049,24 @@ void clear_prefree_segments(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 	list_for_each_entry_safe(entry, this, head, list) {
 		if (cpc->reason == CP_DISCARD && entry->len < cpc->trim_minlen)
 			goto skip;
-		f2fs_issue_discard(sbi, entry->blkaddr, entry->len);
+		f2fs_queue_discard(sbi, entry->blkaddr, entry->len);
 		cpc->trimmed += entry->len;
 skip:
 		list_del(&entry->list);
 		SM_I(sbi)->nr_discards -= entry->len;
 		kmem_cache_free(discard_entry_slab, entry);
 	}
+
+	/*
+	 * Current segments keep allocating right after the checkpoint without
+	 * going through new_curseg() or change_curseg() again.
+	 */
+	for (i = CURSEG_HOT_DATA; i <= CURSEG_COLD_NODE; i++)
+		f2fs_wait_discard_range(sbi, START_BLOCK(sbi,
+				CURSEG_I(sbi, i)->segno), sbi->blocks_per_seg);
+
+	if (SM_I(sbi)->dcc_info)
+		wake_up(&SM_I(sbi)->dcc_info->discard_wait_queue);
 }
 
 static bool __mark_sit_entry_dirty(struct f2fs_sb_info *sbi, unsigned int segno)
@@ -996,9 +1398,19 @@ static void new_curseg(struct f2fs_sb_info *sbi, int type, bool new_sec)
 		dir = ALLOC_RIGHT;
 
 	get_new_segment(sbi, &segno, new_sec, dir);
+	f2fs_wait_discard_range(sbi, START_BLOCK(sbi, segno),
+						sbi->blocks_per_seg);
 	curseg->next_segno = segno;
 	reset_curseg(sbi, type, 1);
 	curseg->alloc_type = LFS;
+
+	/*
+	 * Blocks written by LFS are born while the segment is current, so
+	 * this dates them; SSR segments keep the birth of their older blocks.
+	 */
+	if (IS_DATASEG(type))
+		get_seg_entry(sbi, segno)->birth =
+				atomic64_read(&sbi->data_age_clock);
 }
 
 static void __next_free_blkoff(struct f2fs_sb_info *sbi,
@@ -1048,6 +1460,8 @@ static void change_curseg(struct f2fs_sb_info *sbi, int type, bool reuse)
 	write_sum_page(sbi, curseg->sum_blk,
 				GET_SUM_BLOCK(sbi, curseg->segno));
 	__set_test_and_inuse(sbi, new_segno);
+	f2fs_wait_discard_range(sbi, START_BLOCK(sbi, new_segno),
+						sbi->blocks_per_seg);
 
 	mutex_lock(&dirty_i->seglist_lock);
 	__remove_dirty_segment(sbi, new_segno, PRE);
@@ -1167,6 +1581,9 @@ int f2fs_trim_fs(struct f2fs_sb_info *sbi, struct fstrim_range *range)
 		write_checkpoint(sbi, &cpc);
 		mutex_unlock(&sbi->gc_mutex);
 	}
+
+	/* FITRIM returns once the discards are done */
+	f2fs_flush_discard_cmds(sbi);
 out:
 	range->len = F2FS_BLK_TO_BYTES(cpc.trimmed);
 	return 0;
@@ -1205,6 +1622,53 @@ static int __get_segment_type_4(struct page *page, enum page_type p_type)
 	}
 }
 
+/*
+ * A block dies when it is rewritten; its lifetime is the number of data
+ * blocks allocated since its segment was opened.  Keep a per-inode moving
+ * average of it, which picks the data log for the inode's next writes.
+ */
+void f2fs_update_data_age(struct inode *inode, block_t old_blkaddr)
+{
+	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	struct f2fs_inode_info *fi = F2FS_I(inode);
+	unsigned long long birth, age;
+	int i;
+
+	birth = get_seg_entry(sbi, GET_SEGNO(sbi, old_blkaddr))->birth;
+
+	/* written before mount */
+	if (!birth)
+		return;
+
+	age = atomic64_read(&sbi->data_age_clock) - birth;
+	fi->i_data_age = fi->i_data_age ? (3 * fi->i_data_age + age) >> 2 : age;
+
+	age >>= DATA_AGE_HIST_SHIFT;
+	for (i = 0; age && i < NR_DATA_AGE_HIST - 1; age >>= 2)
+		i++;
+	stat_inc_data_age_hist(sbi, i);
+}
+
+static int __get_data_age_type(struct inode *inode)
+{
+	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	unsigned long long age = F2FS_I(inode)->i_data_age;
+	int type;
+
+	/* nothing rewritten yet */
+	if (!age)
+		type = CURSEG_WARM_DATA;
+	else if (age < sbi->hot_data_age_threshold)
+		type = CURSEG_HOT_DATA;
+	else if (age < sbi->warm_data_age_threshold)
+		type = CURSEG_WARM_DATA;
+	else
+		type = CURSEG_COLD_DATA;
+
+	stat_inc_data_age_type(sbi, type);
+	return type;
+}
+
 static int __get_segment_type_6(struct page *page, enum page_type p_type)
 {
 	if (p_type == DATA) {
@@ -1215,7 +1679,7 @@ static int __get_segment_type_6(struct page *page, enum page_type p_type)
 		else if (is_cold_data(page) || file_is_cold(inode))
 			return CURSEG_COLD_DATA;
 		else
-			return CURSEG_WARM_DATA;
+			return __get_data_age_type(inode);
 	} else {
 		if (IS_DNODE(page))
 			return is_cold_node(page) ? CURSEG_WARM_NODE :
@@ -1251,6 +1715,9 @@ void allocate_data_block(struct f2fs_sb_info *sbi, struct page *page,
 
 	curseg = CURSEG_I(sbi, type);
 
+	if (IS_DATASEG(type))
+		atomic64_inc(&sbi->data_age_clock);
+
 	mutex_lock(&curseg->curseg_mutex);
 	mutex_lock(&sit_i->sentry_lock);
 
@@ -2226,6 +2693,58 @@ static int init_victim_secmap(struct f2fs_sb_info *sbi)
 	return 0;
 }
 
+static int init_victim_buckets(struct f2fs_sb_info *sbi)
+{
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	unsigned int nr = sbi->blocks_per_seg * sbi->segs_per_sec + 1;
+	unsigned int i;
+
+	dirty_i->victim_entries = f2fs_kvzalloc(MAIN_SECS(sbi) *
+				sizeof(struct victim_entry), GFP_KERNEL);
+	if (!dirty_i->victim_entries)
+		return -ENOMEM;
+
+	dirty_i->victim_buckets = f2fs_kvmalloc(nr * sizeof(struct list_head),
+								GFP_KERNEL);
+	if (!dirty_i->victim_buckets)
+		return -ENOMEM;
+	for (i = 0; i < nr; i++)
+		INIT_LIST_HEAD(&dirty_i->victim_buckets[i]);
+
+	dirty_i->victim_bucketmap = f2fs_kvzalloc(f2fs_bitmap_size(nr),
+								GFP_KERNEL);
+	if (!dirty_i->victim_bucketmap)
+		return -ENOMEM;
+
+	dirty_i->nr_victim_buckets = nr;
+	return 0;
+}
+
+static int victim_mtime_cmp(void *priv, struct list_head *a,
+						struct list_head *b)
+{
+	struct f2fs_sb_info *sbi = priv;
+	struct victim_entry *base = DIRTY_I(sbi)->victim_entries;
+	unsigned long long ma, mb;
+
+	ma = get_sec_mtime(sbi, list_entry(a, struct victim_entry, list) - base);
+	mb = get_sec_mtime(sbi, list_entry(b, struct victim_entry, list) - base);
+	return ma < mb ? -1 : ma > mb;
+}
+
+static void sort_victim_buckets(struct f2fs_sb_info *sbi)
+{
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	unsigned int i;
+
+	mutex_lock(&dirty_i->seglist_lock);
+	for_each_set_bit(i, dirty_i->victim_bucketmap,
+					dirty_i->nr_victim_buckets)
+		list_sort(sbi, &dirty_i->victim_buckets[i], victim_mtime_cmp);
+	dirty_i->victim_sorted = true;
+	mutex_unlock(&dirty_i->seglist_lock);
+}
+
 static int build_dirty_segmap(struct f2fs_sb_info *sbi)
 {
 	struct dirty_seglist_info *dirty_i;
@@ -2247,7 +2766,11 @@ static int build_dirty_segmap(struct f2fs_sb_info *sbi)
 			return -ENOMEM;
 	}
 
+	if (init_victim_buckets(sbi))
+		return -ENOMEM;
+
 	init_dirty_segmap(sbi);
+	sort_victim_buckets(sbi);
 	return init_victim_secmap(sbi);
 }
 
@@ -2311,6 +2834,10 @@ int build_segment_manager(struct f2fs_sb_info *sbi)
 
 	sm_info->trim_sections = DEF_BATCHED_TRIM_SECTIONS;
 
+	sm_info->max_discard_blocks = DEF_MAX_DISCARD_SEGMENTS *
+						sbi->blocks_per_seg;
+	sm_info->discard_interval = DEF_DISCARD_INTERVAL;
+
 	INIT_LIST_HEAD(&sm_info->sit_entry_set);
 
 	if (test_opt(sbi, FLUSH_MERGE) && !f2fs_readonly(sbi->sb)) {
@@ -2319,6 +2846,12 @@ int build_segment_manager(struct f2fs_sb_info *sbi)
 			return err;
 	}
 
+	if (test_opt(sbi, DISCARD) && !f2fs_readonly(sbi->sb)) {
+		err = create_discard_cmd_control(sbi);
+		if (err)
+			return err;
+	}
+
 	err = build_sit_info(sbi);
 	if (err)
 		return err;
@@ -2358,6 +2891,15 @@ static void destroy_victim_secmap(struct f2fs_sb_info *sbi)
 	kvfree(dirty_i->victim_secmap);
 }
 
+static void destroy_victim_buckets(struct f2fs_sb_info *sbi)
+{
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+
+	kvfree(dirty_i->victim_bucketmap);
+	kvfree(dirty_i->victim_buckets);
+	kvfree(dirty_i->victim_entries);
+}
+
 static void destroy_dirty_segmap(struct f2fs_sb_info *sbi)
 {
 	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
@@ -2371,6 +2913,7 @@ static void destroy_dirty_segmap(struct f2fs_sb_info *sbi)
 		discard_dirty_segmap(sbi, i);
 
 	destroy_victim_secmap(sbi);
+	destroy_victim_buckets(sbi);
 	SM_I(sbi)->dirty_info = NULL;
 	kfree(dirty_i);
 }
@@ -2432,6 +2975,7 @@ void destroy_segment_manager(struct f2fs_sb_info *sbi)
 	if (!sm_info)
 		return;
 	destroy_flush_cmd_control(sbi);
+	destroy_discard_cmd_control(sbi);
 	destroy_dirty_segmap(sbi);
 	destroy_curseg(sbi);
 	destroy_free_segmap(sbi);
@@ -2447,10 +2991,15 @@ int __init create_segment_manager_caches(void)
 	if (!discard_entry_slab)
 		goto fail;
 
+	discard_cmd_slab = f2fs_kmem_cache_create("discard_cmd",
+			sizeof(struct discard_cmd));
+	if (!discard_cmd_slab)
+		goto destory_discard_entry;
+
 	sit_entry_set_slab = f2fs_kmem_cache_create("sit_entry_set",
 			sizeof(struct sit_entry_set));
 	if (!sit_entry_set_slab)
-		goto destory_discard_entry;
+		goto destroy_discard_cmd;
 
 	inmem_entry_slab = f2fs_kmem_cache_create("inmem_page_entry",
 			sizeof(struct inmem_pages));
@@ -2460,6 +3009,8 @@ int __init create_segment_manager_caches(void)
 
 destroy_sit_entry_set:
 	kmem_cache_destroy(sit_entry_set_slab);
+destroy_discard_cmd:
+	kmem_cache_destroy(discard_cmd_slab);
 destory_discard_entry:
 	kmem_cache_destroy(discard_entry_slab);
 fail:
@@ -2469,6 +3020,7 @@ fail:
 void destroy_segment_manager_caches(void)
 {
 	kmem_cache_destroy(sit_entry_set_slab);
+	kmem_cache_destroy(discard_cmd_slab);
 	kmem_cache_destroy(discard_entry_slab);
 	kmem_cache_destroy(inmem_entry_slab);
 }
@@ -169,6 +169,7 @@ struct seg_entry {
 	unsigned char *discard_map;
 	unsigned char type;		/* segment type like CURSEG_XXX_TYPE */
 	unsigned long long mtime;	/* modification time of the segment */
+	unsigned long long birth;	/* data age clock when it was opened */
 };
 
 struct sec_entry {
@@ -239,12 +240,26 @@ enum dirty_type {
 	NR_DIRTY_TYPE
 };
 
+/* a section holding dirty segments, bucketed by its valid blocks */
+struct victim_entry {
+	struct list_head list;		/* link in a victim bucket */
+	unsigned int vblocks;		/* bucket, i.e. # of valid blocks */
+	unsigned int nr_dirty;		/* # of dirty segments in the section */
+};
+
 struct dirty_seglist_info {
 	const struct victim_selection *v_ops;	/* victim selction operation */
 	unsigned long *dirty_segmap[NR_DIRTY_TYPE];
 	struct mutex seglist_lock;		/* lock for segment bitmaps */
 	int nr_dirty[NR_DIRTY_TYPE];		/* # of dirty segments */
 	unsigned long *victim_secmap;		/* background GC victims */
+
+	/* for GC victim selection without scanning dirty_segmap */
+	struct victim_entry *victim_entries;	/* one entry per section */
+	struct list_head *victim_buckets;	/* by valid blocks, oldest first */
+	unsigned long *victim_bucketmap;	/* non-empty buckets */
+	unsigned int nr_victim_buckets;		/* # of valid block counts */
+	bool victim_sorted;			/* buckets are in mtime order */
 };
 
 /* victim selection function for cleaning and SSR */
@@ -305,6 +320,18 @@ static inline unsigned int get_valid_blocks(struct f2fs_sb_info *sbi,
 		return get_seg_entry(sbi, segno)->valid_blocks;
 }
 
+static inline unsigned long long get_sec_mtime(struct f2fs_sb_info *sbi,
+						unsigned int secno)
+{
+	unsigned int start = secno * sbi->segs_per_sec;
+	unsigned long long mtime = 0;
+	unsigned int i;
+
+	for (i = 0; i < sbi->segs_per_sec; i++)
+		mtime += get_seg_entry(sbi, start + i)->mtime;
+	return div_u64(mtime, sbi->segs_per_sec);
+}
+
 static inline void seg_info_from_raw_sit(struct seg_entry *se,
 					struct f2fs_sit_entry *rs)
 {
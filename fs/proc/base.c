@@ -87,6 +87,7 @@
 #include <linux/slab.h>
 #include <linux/flex_array.h>
 #include <linux/posix-timers.h>
+#include <linux/page_idle.h>
 #ifdef CONFIG_HARDWALL
 #include <asm/hardwall.h>
 #endif
@@ -1116,6 +1117,7 @@ static ssize_t oom_adj_write(struct file *file, const char __user *buf,
 		  task_pid_nr(task));
 
 	task->signal->oom_score_adj = oom_adj;
+	lowmem_adj_index_update(task);
 	trace_oom_score_adj_update(task);
 err_sighand:
 	unlock_task_sighand(task, &flags);
@@ -1204,6 +1206,7 @@ static ssize_t oom_score_adj_write(struct file *file, const char __user *buf,
 	task->signal->oom_score_adj = (short)oom_score_adj;
 	if (has_capability_noaudit(current, CAP_SYS_RESOURCE))
 		task->signal->oom_score_adj_min = (short)oom_score_adj;
+	lowmem_adj_index_update(task);
 	trace_oom_score_adj_update(task);
 
 err_sighand:
@@ -3008,6 +3011,28 @@ static int proc_pid_personality(struct seq_file *m, struct pid_namespace *ns,
 	return err;
 }
 
+#ifdef CONFIG_IDLE_PAGE_AGE
+/*
+ * Anonymous pages by idle age as of the last kidled pass, one line per
+ * histogram bucket: the lowest idle age of the bucket and its page count.
+ */
+static int proc_pid_idle_age(struct seq_file *m, struct pid_namespace *ns,
+				struct pid *pid, struct task_struct *task)
+{
+	struct mm_struct *mm = get_task_mm(task);
+	int i;
+
+	if (!mm)
+		return 0;
+
+	for (i = 0; i < NR_IDLE_AGE_BUCKETS; i++)
+		seq_printf(m, "%u %lu\n", idle_age_bucket_min(i),
+			   READ_ONCE(mm->idle_hist[i]));
+	mmput(mm);
+	return 0;
+}
+#endif
+
 /*
  * Thread groups
  */
@@ -3062,6 +3087,9 @@ static const struct pid_entry tgid_base_stuff[] = {
 #ifdef CONFIG_PROCESS_RECLAIM
 	REG("reclaim", S_IWUSR, proc_reclaim_operations),
 #endif
+#ifdef CONFIG_IDLE_PAGE_AGE
+	ONE("idle_age",   S_IRUGO, proc_pid_idle_age),
+#endif
 #ifdef CONFIG_PROC_PAGE_MONITOR
 	REG("clear_refs", S_IWUSR, proc_clear_refs_operations),
 	REG("smaps",      S_IRUGO, proc_pid_smaps_operations),
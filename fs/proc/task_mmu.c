@@ -1444,6 +1444,10 @@ cont:
 		if (!page)
 			continue;
 
+		if (rp->min_age && (pte_young(ptent) || !page_is_idle(page) ||
+				    page_idle_age(page) < rp->min_age))
+			continue;
+
 		if (isolate_lru_page(page))
 			continue;
 
@@ -1477,7 +1481,7 @@ enum reclaim_type {
 };
 
 struct reclaim_param reclaim_task_anon(struct task_struct *task,
-		int nr_to_reclaim)
+		int nr_to_reclaim, unsigned int min_age)
 {
 	struct mm_struct *mm;
 	struct vm_area_struct *vma;
@@ -1495,6 +1499,7 @@ struct reclaim_param reclaim_task_anon(struct task_struct *task,
 	reclaim_walk.pmd_entry = reclaim_pte_range;
 
 	rp.nr_to_reclaim = nr_to_reclaim;
+	rp.min_age = min_age;
 	reclaim_walk.private = &rp;
 
 	down_read(&mm->mmap_sem);
@@ -1597,6 +1602,7 @@ static ssize_t reclaim_write(struct file *file, const char __user *buf,
 
 	rp.nr_to_reclaim = ~0;
 	rp.nr_reclaimed = 0;
+	rp.min_age = 0;
 	reclaim_walk.private = &rp;
 
 	down_read(&mm->mmap_sem);
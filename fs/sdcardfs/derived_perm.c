@@ -20,6 +20,26 @@
 
 #include "sdcardfs.h"
 
+/*
+ * Bumped whenever the derived state of existing inodes may change, i.e.
+ * on package list updates and renames.  Inodes remember the generation
+ * and the parent they were derived at, and get_derived_permission()
+ * skips rederiving them, and looking up the package list, while both
+ * still match.  Starts at 1 so that new inodes never match.
+ *
+ * A child may be derived from a parent the fixup has not reached yet,
+ * i.e. from stale state, after the bump.  So every derivation also gets
+ * a sequence number, which children record from their parent, and the
+ * shortcut is only taken while the parent was not rederived since.
+ */
+static atomic_t derived_gen = ATOMIC_INIT(1);
+static atomic_t derived_seq = ATOMIC_INIT(0);
+
+void invalidate_derived_permissions(void)
+{
+	atomic_inc(&derived_gen);
+}
+
 /* copy derived state from parent inode */
 static void inherit_derived_state(struct inode *parent, struct inode *child)
 {
@@ -50,6 +70,8 @@ void get_derived_permission_new(struct dentry *parent, struct dentry *dentry, st
 	struct sdcardfs_sb_info *sbi = SDCARDFS_SB(dentry->d_sb);
 	struct sdcardfs_inode_info *info = SDCARDFS_I(dentry->d_inode);
 	struct sdcardfs_inode_info *parent_info= SDCARDFS_I(parent->d_inode);
+	unsigned int gen = atomic_read(&derived_gen);
+	unsigned int parent_seq = parent_info->derived_seq;
 	appid_t appid;
 
 	/* By default, each inode inherits from its parent.
@@ -102,10 +124,26 @@ void get_derived_permission_new(struct dentry *parent, struct dentry *dentry, st
 			}
 			break;
 	}
+
+	/*
+	 * Anything changing meanwhile bumped the generation past ours, and
+	 * rederiving the parent later on moves its sequence past parent_seq.
+	 */
+	info->derived_gen = gen;
+	info->derived_parent = parent->d_inode;
+	info->derived_parent_seq = parent_seq;
+	info->derived_seq = atomic_inc_return(&derived_seq);
 }
 
 void get_derived_permission(struct dentry *parent, struct dentry *dentry)
 {
+	struct sdcardfs_inode_info *info = SDCARDFS_I(dentry->d_inode);
+
+	if (info->derived_gen == atomic_read(&derived_gen) &&
+	    info->derived_parent == parent->d_inode &&
+	    info->derived_parent_seq == SDCARDFS_I(parent->d_inode)->derived_seq)
+		return;
+
 	get_derived_permission_new(parent, dentry, dentry);
 }
 
@@ -21,6 +21,7 @@
 #include "sdcardfs.h"
 #include <linux/hashtable.h>
 #include <linux/delay.h>
+#include <linux/rcupdate.h>
 
 
 #include <linux/init.h>
@@ -33,6 +34,7 @@
 
 struct hashtable_entry {
 	struct hlist_node hlist;
+	struct rcu_head rcu;
 	void *key;
 	unsigned int value;
 };
@@ -42,6 +44,7 @@ struct sb_list {
 	struct list_head list;
 };
 
+/* lookups only need rcu_read_lock(), hashtable_lock serializes updates */
 struct packagelist_data {
 	DECLARE_HASHTABLE(package_to_appid,8);
 	struct mutex hashtable_lock;
@@ -71,15 +74,15 @@ appid_t get_appid(void *pkgl_id, const char *app_name)
 	unsigned int hash = str_hash(app_name);
 	appid_t ret_id;
 
-	mutex_lock(&pkgl_dat->hashtable_lock);
-	hash_for_each_possible(pkgl_dat->package_to_appid, hash_cur, hlist, hash) {
+	rcu_read_lock();
+	hash_for_each_possible_rcu(pkgl_dat->package_to_appid, hash_cur, hlist, hash) {
 		if (!strcasecmp(app_name, hash_cur->key)) {
-			ret_id = (appid_t)hash_cur->value;
-			mutex_unlock(&pkgl_dat->hashtable_lock);
+			ret_id = (appid_t)READ_ONCE(hash_cur->value);
+			rcu_read_unlock();
 			return ret_id;
 		}
 	}
-	mutex_unlock(&pkgl_dat->hashtable_lock);
+	rcu_read_unlock();
 	return 0;
 }
 
@@ -129,7 +132,7 @@ static int insert_str_to_int_lock(struct packagelist_data *pkgl_dat, char *key,
 
 	hash_for_each_possible(pkgl_dat->package_to_appid, hash_cur, hlist, hash) {
 		if (!strcasecmp(key, hash_cur->key)) {
-			hash_cur->value = value;
+			WRITE_ONCE(hash_cur->value, value);
 			return 0;
 		}
 	}
@@ -137,8 +140,12 @@ static int insert_str_to_int_lock(struct packagelist_data *pkgl_dat, char *key,
 	if (!new_entry)
 		return -ENOMEM;
 	new_entry->key = kstrdup(key, GFP_KERNEL);
+	if (!new_entry->key) {
+		kmem_cache_free(hashtable_entry_cachep, new_entry);
+		return -ENOMEM;
+	}
 	new_entry->value = value;
-	hash_add(pkgl_dat->package_to_appid, &new_entry->hlist, hash);
+	hash_add_rcu(pkgl_dat->package_to_appid, &new_entry->hlist, hash);
 	return 0;
 }
 
@@ -158,6 +165,7 @@ static int insert_str_to_int(struct packagelist_data *pkgl_dat, char *key,
 	mutex_lock(&pkgl_dat->hashtable_lock);
 	ret = insert_str_to_int_lock(pkgl_dat, key, value);
 	mutex_unlock(&pkgl_dat->hashtable_lock);
+	invalidate_derived_permissions();
 
 	list_for_each_entry(sbinfo, &sdcardfs_super_list, list) {
 		if (sbinfo) {
@@ -168,12 +176,20 @@ static int insert_str_to_int(struct packagelist_data *pkgl_dat, char *key,
 	return ret;
 }
 
-static void remove_str_to_int_lock(struct hashtable_entry *h_entry) {
+static void free_hashtable_entry(struct rcu_head *head)
+{
+	struct hashtable_entry *h_entry =
+		container_of(head, struct hashtable_entry, rcu);
+
 	kfree(h_entry->key);
-	hash_del(&h_entry->hlist);
 	kmem_cache_free(hashtable_entry_cachep, h_entry);
 }
 
+static void remove_str_to_int_lock(struct hashtable_entry *h_entry) {
+	hash_del_rcu(&h_entry->hlist);
+	call_rcu(&h_entry->rcu, free_hashtable_entry);
+}
+
 static void remove_str_to_int(struct packagelist_data *pkgl_dat, const char *key)
 {
 	struct sdcardfs_sb_info *sbinfo;
@@ -188,6 +204,7 @@ static void remove_str_to_int(struct packagelist_data *pkgl_dat, const char *key
 		}
 	}
 	mutex_unlock(&pkgl_dat->hashtable_lock);
+	invalidate_derived_permissions();
 	list_for_each_entry(sbinfo, &sdcardfs_super_list, list) {
 		if (sbinfo) {
 			fixup_perms(sbinfo->sb);
@@ -333,13 +350,12 @@ static ssize_t packages_attr_show(struct config_item *item,
 					 char *page)
 {
 	struct hashtable_entry *hash_cur;
-	struct hlist_node *h_t;
 	int i;
 	int count = 0, written = 0;
 	char errormsg[] = "<truncated>\n";
 
-	mutex_lock(&pkgl_data_all->hashtable_lock);
-	hash_for_each_safe(pkgl_data_all->package_to_appid, i, h_t, hash_cur, hlist) {
+	rcu_read_lock();
+	hash_for_each_rcu(pkgl_data_all->package_to_appid, i, hash_cur, hlist) {
 		written = scnprintf(page + count, PAGE_SIZE - sizeof(errormsg) - count, "%s %d\n", (char *)hash_cur->key, hash_cur->value);
 		if (count + written == PAGE_SIZE - sizeof(errormsg)) {
 			count += scnprintf(page + count, PAGE_SIZE - count, errormsg);
@@ -347,7 +363,7 @@ static ssize_t packages_attr_show(struct config_item *item,
 		}
 		count += written;
 	}
-	mutex_unlock(&pkgl_data_all->hashtable_lock);
+	rcu_read_unlock();
 
 	return count;
 }
@@ -439,6 +455,8 @@ void packagelist_exit(void)
 {
 	configfs_sdcardfs_exit();
 	packagelist_destroy(pkgl_data_all);
+	/* wait for the entries freed by call_rcu() */
+	rcu_barrier();
 	if (hashtable_entry_cachep)
 		kmem_cache_destroy(hashtable_entry_cachep);
 }
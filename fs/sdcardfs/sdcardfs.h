@@ -169,6 +169,12 @@ struct sdcardfs_inode_info {
 	userid_t userid;
 	uid_t d_uid;
 	bool under_android;
+	/* generation and parent the state above was derived at */
+	unsigned int derived_gen;
+	struct inode *derived_parent;
+	/* sequence of this derivation and of the parent's it copied */
+	unsigned int derived_seq;
+	unsigned int derived_parent_seq;
 
 	struct inode vfs_inode;
 };
@@ -408,6 +414,7 @@ extern void setup_derived_state(struct inode *inode, perm_t perm,
 extern void get_derived_permission(struct dentry *parent, struct dentry *dentry);
 extern void get_derived_permission_new(struct dentry *parent, struct dentry *dentry, struct dentry *newdentry);
 extern void get_derive_permissions_recursive(struct dentry *parent);
+extern void invalidate_derived_permissions(void);
 
 extern void update_derived_permission_lock(struct dentry *dentry);
 extern int need_graft_path(struct dentry *dentry);
@@ -2349,9 +2349,11 @@ struct reclaim_param {
 	int nr_to_reclaim;
 	/* pages reclaimed */
 	int nr_reclaimed;
+	/* only reclaim pages idle for this many aging passes, if set */
+	unsigned int min_age;
 };
 extern struct reclaim_param reclaim_task_anon(struct task_struct *task,
-		int nr_to_reclaim);
+		int nr_to_reclaim, unsigned int min_age);
 #endif
 
 #endif /* __KERNEL__ */
@@ -399,6 +399,13 @@ struct mm_rss_stat {
 	atomic_long_t count[NR_MM_COUNTERS];
 };
 
+/*
+ * Idle anonymous pages are counted in log2 buckets of their idle age: bucket
+ * 0 holds pages referenced during the last aging pass, bucket n holds pages
+ * idle for [2^(n-1), 2^n) passes, and the last one everything above.
+ */
+#define NR_IDLE_AGE_BUCKETS	9
+
 struct kioctx_table;
 struct mm_struct {
 	struct vm_area_struct *mmap;		/* list of VMAs */
@@ -527,6 +534,10 @@ struct mm_struct {
 #ifdef CONFIG_HUGETLB_PAGE
 	atomic_long_t hugetlb_usage;
 #endif
+#ifdef CONFIG_IDLE_PAGE_AGE
+	/* anon pages by idle age, see mm_idle_age_scan() */
+	unsigned long idle_hist[NR_IDLE_AGE_BUCKETS];
+#endif
 };
 
 static inline void mm_init_cpumask(struct mm_struct *mm)
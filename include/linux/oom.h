@@ -116,6 +116,31 @@ static inline bool task_will_free_mem(struct task_struct *task)
 extern void dump_tasks(struct mem_cgroup *memcg,
 		const nodemask_t *nodemask);
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+extern void lowmem_adj_index_add(struct task_struct *p);
+extern void lowmem_adj_index_del(struct task_struct *p);
+extern void lowmem_adj_index_update(struct task_struct *p);
+extern void lowmem_adj_index_replace(struct task_struct *leader,
+				     struct task_struct *tsk);
+#else
+static inline void lowmem_adj_index_add(struct task_struct *p)
+{
+}
+
+static inline void lowmem_adj_index_del(struct task_struct *p)
+{
+}
+
+static inline void lowmem_adj_index_update(struct task_struct *p)
+{
+}
+
+static inline void lowmem_adj_index_replace(struct task_struct *leader,
+					    struct task_struct *tsk)
+{
+}
+#endif
+
 /* sysctls */
 extern int sysctl_oom_dump_tasks;
 extern int sysctl_oom_kill_allocating_task;
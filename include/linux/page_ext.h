@@ -47,6 +47,10 @@ struct page_ext {
 	unsigned int nr_entries;
 	unsigned long trace_entries[8];
 #endif
+#ifdef CONFIG_IDLE_PAGE_AGE
+	/* number of aging passes the page stayed idle, see page_idle.h */
+	unsigned char idle_age;
+#endif
 };
 
 extern void pgdat_page_ext_init(struct pglist_data *pgdat);
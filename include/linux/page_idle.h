@@ -136,4 +136,66 @@ static inline void clear_page_idle(struct page *page)
 
 #endif /* CONFIG_IDLE_PAGE_TRACKING */
 
+#ifdef CONFIG_IDLE_PAGE_AGE
+#define IDLE_AGE_MAX	255U
+
+extern struct page_ext_operations page_idle_age_ops;
+
+/*
+ * Number of consecutive mm_idle_age_scan() passes during which the page was
+ * found idle. Only maintained for anonymous pages mapped by a single mm.
+ */
+static inline unsigned int page_idle_age(struct page *page)
+{
+	struct page_ext *page_ext = lookup_page_ext(page);
+
+	if (unlikely(!page_ext))
+		return 0;
+
+	return READ_ONCE(page_ext->idle_age);
+}
+
+static inline void set_page_idle_age(struct page *page, unsigned int age)
+{
+	struct page_ext *page_ext = lookup_page_ext(page);
+
+	if (unlikely(!page_ext))
+		return;
+
+	WRITE_ONCE(page_ext->idle_age, min_t(unsigned int, age, IDLE_AGE_MAX));
+}
+
+static inline int idle_age_bucket(unsigned int age)
+{
+	return min(fls(age), NR_IDLE_AGE_BUCKETS - 1);
+}
+
+/* Lowest idle age counted in @bucket */
+static inline unsigned int idle_age_bucket_min(int bucket)
+{
+	return bucket ? 1U << (bucket - 1) : 0;
+}
+
+extern void mm_idle_age_scan(struct mm_struct *mm);
+extern unsigned long mm_idle_pages(struct mm_struct *mm, unsigned int min_age);
+
+#else /* !CONFIG_IDLE_PAGE_AGE */
+
+static inline unsigned int page_idle_age(struct page *page)
+{
+	return 0;
+}
+
+static inline void set_page_idle_age(struct page *page, unsigned int age)
+{
+}
+
+static inline unsigned long mm_idle_pages(struct mm_struct *mm,
+					  unsigned int min_age)
+{
+	return 0;
+}
+
+#endif /* CONFIG_IDLE_PAGE_AGE */
+
 #endif /* _LINUX_MM_PAGE_IDLE_H */
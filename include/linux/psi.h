@@ -0,0 +1,42 @@
+#ifndef _LINUX_PSI_H
+#define _LINUX_PSI_H
+
+#include <linux/psi_types.h>
+#include <linux/sched.h>
+
+struct notifier_block;
+
+#ifdef CONFIG_PSI
+
+extern bool psi_disabled;
+
+void psi_init(void);
+
+void psi_task_change(struct task_struct *task, int clear, int set);
+
+void psi_memstall_enter(unsigned long *flags);
+void psi_memstall_leave(unsigned long *flags);
+
+int psi_mem_notifier_register(struct notifier_block *nb);
+int psi_mem_notifier_unregister(struct notifier_block *nb);
+
+#else /* CONFIG_PSI */
+
+static inline void psi_init(void) {}
+
+static inline void psi_memstall_enter(unsigned long *flags) {}
+static inline void psi_memstall_leave(unsigned long *flags) {}
+
+static inline int psi_mem_notifier_register(struct notifier_block *nb)
+{
+	return 0;
+}
+
+static inline int psi_mem_notifier_unregister(struct notifier_block *nb)
+{
+	return 0;
+}
+
+#endif /* CONFIG_PSI */
+
+#endif /* _LINUX_PSI_H */
@@ -33,11 +33,21 @@ enum {
 	BINDER_TYPE_HANDLE	= B_PACK_CHARS('s', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_WEAK_HANDLE	= B_PACK_CHARS('w', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_FD		= B_PACK_CHARS('f', 'd', '*', B_TYPE_LARGE),
+	BINDER_TYPE_FDA		= B_PACK_CHARS('f', 'd', 'a', B_TYPE_LARGE),
+	BINDER_TYPE_PTR		= B_PACK_CHARS('p', 't', '*', B_TYPE_LARGE),
 };
 
 enum {
 	FLAT_BINDER_FLAG_PRIORITY_MASK = 0xff,
 	FLAT_BINDER_FLAG_ACCEPTS_FDS = 0x100,
+	/*
+	 * Scheduling policy of the minimum priority in
+	 * FLAT_BINDER_FLAG_PRIORITY_MASK: SCHED_NORMAL, SCHED_FIFO, SCHED_RR
+	 * or SCHED_BATCH.  The priority is a nice value for SCHED_NORMAL
+	 * and SCHED_BATCH and an RT priority for the other two.
+	 */
+	FLAT_BINDER_FLAG_SCHED_POLICY_SHIFT = 9,
+	FLAT_BINDER_FLAG_SCHED_POLICY_MASK = 3U << 9,
 };
 
 #ifdef BINDER_IPC_32BIT
@@ -70,6 +80,56 @@ struct flat_binder_object {
 	binder_uintptr_t	cookie;
 };
 
+/*
+ * All objects in the offsets array start with the type, like the type
+ * field of flat_binder_object.  The driver reads it first to find out
+ * which structure it is looking at.
+ */
+struct binder_object_header {
+	__u32		type;
+};
+
+/*
+ * A BINDER_TYPE_PTR object describes a buffer of the sender that is
+ * copied into the target's mmap'd area right behind the offsets array,
+ * and rewritten to point at that copy.  The space for all such buffers
+ * of a transaction must be accounted for in buffers_size of
+ * BC_TRANSACTION_SG or BC_REPLY_SG.
+ *
+ * With BINDER_BUFFER_FLAG_HAS_PARENT set, the pointer to the copy is also
+ * stored at parent_offset in the buffer of the object at index parent of
+ * the offsets array, which must be a BINDER_TYPE_PTR object that comes
+ * earlier in the array.  Fixups have to be applied in order: each one
+ * must be at a higher offset than the previous one into the same parent.
+ */
+struct binder_buffer_object {
+	struct binder_object_header	hdr;
+	__u32			flags;
+	binder_uintptr_t	buffer;
+	binder_size_t		length;
+	binder_size_t		parent;
+	binder_size_t		parent_offset;
+};
+
+enum {
+	BINDER_BUFFER_FLAG_HAS_PARENT = 0x01,
+};
+
+/*
+ * A BINDER_TYPE_FDA object describes an array of num_fds 32-bit file
+ * descriptors at parent_offset in the buffer of the BINDER_TYPE_PTR
+ * object at index parent of the offsets array.  Every fd is installed in
+ * the target process and replaced by its number there.  The target's
+ * fds are closed again when it frees the transaction buffer.
+ */
+struct binder_fd_array_object {
+	struct binder_object_header	hdr;
+	__u32			pad;
+	binder_size_t		num_fds;
+	binder_size_t		parent;
+	binder_size_t		parent_offset;
+};
+
 /*
  * On 64-bit platforms where user code may run in 32-bits the driver must
  * translate the buffer (and local binder) addresses appropriately.
@@ -104,6 +164,7 @@ struct binder_version {
 #define BINDER_SET_CONTEXT_MGR		_IOW('b', 7, __s32)
 #define BINDER_THREAD_EXIT		_IOW('b', 8, __s32)
 #define BINDER_VERSION			_IOWR('b', 9, struct binder_version)
+#define BINDER_SET_CONTEXT_MGR_EXT	_IOW('b', 13, struct flat_binder_object)
 
 /*
  * NOTE: Two special error codes you should check for when calling
@@ -162,6 +223,11 @@ struct binder_transaction_data {
 	} data;
 };
 
+struct binder_transaction_data_sg {
+	struct binder_transaction_data transaction_data;
+	binder_size_t buffers_size;
+};
+
 struct binder_ptr_cookie {
 	binder_uintptr_t ptr;
 	binder_uintptr_t cookie;
@@ -346,6 +412,13 @@ enum binder_driver_command_protocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command, with room for
+	 * buffers_size bytes of BINDER_TYPE_PTR buffers.
+	 */
 };
 
 #endif /* _UAPI_LINUX_BINDER_H */
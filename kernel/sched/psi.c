@@ -0,0 +1,976 @@
+/*
+ * Pressure stall information for CPU, memory and IO
+ *
+ * When CPU, memory and IO are contended, tasks experience delays that
+ * reduce throughput and introduce latencies into the workload. Memory
+ * and IO contention, in addition, can cause a full loss of forward
+ * progress in which the CPU goes idle.
+ *
+ * This code aggregates individual task delays into resource pressure
+ * metrics that indicate problems with both workload health and
+ * resource utilization.
+ *
+ *			Model
+ *
+ * The time in which a task can execute on a CPU is our baseline for
+ * productivity. Pressure expresses the amount of time in which this
+ * potential cannot be realized due to resource contention.
+ *
+ * SOME is the state in which at least one task on a CPU is delayed on
+ * a resource, FULL is the state in which all non-idle tasks are delayed
+ * on it at the same time. The per-CPU stall times are weighed by the
+ * non-idle time of each CPU, so that idle CPUs do not dilute the
+ * system-wide numbers.
+ *
+ *			Interfaces
+ *
+ * /proc/pressure/{cpu,memory,io} report running averages over 10s, 60s
+ * and 300s and the total stall time in us:
+ *
+ *	some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+ *	full avg10=0.00 avg60=0.00 avg300=0.00 total=0
+ *
+ * Writing "<some|full> <stall us> <window us>" to one of the files turns
+ * the open file into a trigger: poll() returns POLLPRI once the stall
+ * time within any window of the given size exceeds the threshold.
+ *
+ * In-kernel users such as the low memory killer register with
+ * psi_mem_notifier_register() and are called with the share of time,
+ * in percent, that tasks were stalled on memory over the last poll
+ * period.
+ *
+ * Only system-wide pressure is tracked; cgroups are not accounted
+ * separately.
+ */
+
+#include <linux/export.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
+#include <linux/uaccess.h>
+#include <linux/notifier.h>
+#include <linux/poll.h>
+#include <linux/psi.h>
+#include "sched.h"
+
+static int psi_bug __read_mostly;
+
+bool psi_disabled __read_mostly;
+
+static int __init setup_psi(char *str)
+{
+	bool enabled;
+
+	if (!strtobool(str, &enabled))
+		psi_disabled = !enabled;
+	return 1;
+}
+__setup("psi=", setup_psi);
+
+/* Running averages - we need to be higher-res than loadavg */
+#define PSI_FREQ	(2*HZ+1)	/* 2 sec intervals */
+#define EXP_10s		1677		/* 1/exp(2s/10s) as fixed-point */
+#define EXP_60s		1981		/* 1/exp(2s/60s) */
+#define EXP_300s	2034		/* 1/exp(2s/300s) */
+
+#define LOAD_INT(x)	((x) >> FSHIFT)
+#define LOAD_FRAC(x)	LOAD_INT(((x) & (FIXED_1 - 1)) * 100)
+
+/* Triggers and in-kernel notifiers are checked at this rate */
+#define PSI_POLL_PERIOD	(HZ / 10)
+
+#define WINDOW_MIN_US	500000		/* Min window size is 500ms */
+#define WINDOW_MAX_US	10000000	/* Max window size is 10s */
+
+/* Number of states the averages and totals are kept for */
+#define NR_PSI_AGG_STATES	(NR_PSI_STATES - 1)
+
+struct psi_window {
+	/* Window size in ns */
+	u64 size;
+
+	/* Start time of the current window in ns */
+	u64 start_time;
+
+	/* Value at the start of the window */
+	u64 start_value;
+
+	/* Value growth in the previous window */
+	u64 prev_growth;
+};
+
+struct psi_trigger {
+	/* PSI state being monitored by the trigger */
+	enum psi_states state;
+
+	/* User-specified threshold in ns */
+	u64 threshold;
+
+	/* List node inside the triggers list */
+	struct list_head node;
+
+	/* Stall growth tracking window */
+	struct psi_window win;
+
+	/* Time of the last event, only one event per window */
+	u64 last_event_time;
+
+	/* Wait queue and pending flag for poll() */
+	wait_queue_head_t event_wait;
+	int event;
+};
+
+struct psi_group {
+	struct psi_group_cpu __percpu *pcpu;
+
+	/* Serializes the aggregators and protects the fields below */
+	struct mutex avgs_lock;
+
+	/* Total stall times observed, in ns */
+	u64 total[NR_PSI_AGG_STATES];
+
+	/* Running pressure averages */
+	u64 avg_total[NR_PSI_AGG_STATES];
+	u64 avg_last_update;
+	u64 avg_next_update;
+	unsigned long avg[NR_PSI_AGG_STATES][3];
+	struct delayed_work avgs_work;
+
+	/* Triggers, protected by trigger_lock */
+	struct mutex trigger_lock;
+	struct list_head triggers;
+
+	/* Memory stall reporting to in-kernel users */
+	u64 mem_total;
+	u64 mem_time;
+	unsigned long mem_pressure;
+	struct delayed_work poll_work;
+};
+
+static DEFINE_PER_CPU(struct psi_group_cpu, system_group_pcpu);
+static struct psi_group psi_system = {
+	.pcpu = &system_group_pcpu,
+};
+
+static BLOCKING_NOTIFIER_HEAD(psi_mem_notifier);
+static atomic_t psi_mem_notifier_users = ATOMIC_INIT(0);
+
+/* The workqueues are not up before core_initcall */
+static bool psi_ready __read_mostly;
+
+/* Sampling frequency in nanoseconds */
+static u64 psi_period __read_mostly;
+
+static void psi_avgs_work(struct work_struct *work);
+static void psi_poll_work(struct work_struct *work);
+
+void __init psi_init(void)
+{
+	struct psi_group *group = &psi_system;
+	int cpu;
+
+	if (psi_disabled)
+		return;
+
+	psi_period = jiffies_to_nsecs(PSI_FREQ);
+
+	for_each_possible_cpu(cpu)
+		seqcount_init(&per_cpu_ptr(group->pcpu, cpu)->seq);
+	mutex_init(&group->avgs_lock);
+	mutex_init(&group->trigger_lock);
+	INIT_LIST_HEAD(&group->triggers);
+	INIT_DELAYED_WORK(&group->avgs_work, psi_avgs_work);
+	INIT_DELAYED_WORK(&group->poll_work, psi_poll_work);
+	group->avg_next_update = sched_clock() + psi_period;
+}
+
+static bool test_state(unsigned int *tasks, enum psi_states state)
+{
+	switch (state) {
+	case PSI_IO_SOME:
+		return tasks[NR_IOWAIT];
+	case PSI_IO_FULL:
+		return tasks[NR_IOWAIT] && !tasks[NR_RUNNING];
+	case PSI_MEM_SOME:
+		return tasks[NR_MEMSTALL];
+	case PSI_MEM_FULL:
+		return tasks[NR_MEMSTALL] && !tasks[NR_RUNNING];
+	case PSI_CPU_SOME:
+		return tasks[NR_RUNNING] > 1;
+	case PSI_NONIDLE:
+		return tasks[NR_IOWAIT] || tasks[NR_MEMSTALL] ||
+			tasks[NR_RUNNING];
+	default:
+		return false;
+	}
+}
+
+static void get_recent_times(struct psi_group *group, int cpu, u32 *times)
+{
+	struct psi_group_cpu *groupc = per_cpu_ptr(group->pcpu, cpu);
+	u64 now, state_start;
+	u32 state_mask;
+	unsigned int seq;
+	int s;
+
+	/* Snapshot a coherent view of the CPU state */
+	do {
+		seq = read_seqcount_begin(&groupc->seq);
+		now = cpu_clock(cpu);
+		memcpy(times, groupc->times, sizeof(groupc->times));
+		state_mask = groupc->state_mask;
+		state_start = groupc->state_start;
+	} while (read_seqcount_retry(&groupc->seq, seq));
+
+	/* Calculate state time deltas against the previous snapshot */
+	for (s = 0; s < NR_PSI_STATES; s++) {
+		u32 delta;
+
+		/*
+		 * In addition to already concluded states, we also
+		 * incorporate currently active states on the CPU,
+		 * since states may last for many sampling periods.
+		 */
+		if (state_mask & (1 << s))
+			times[s] += now - state_start;
+
+		delta = times[s] - groupc->times_prev[s];
+		groupc->times_prev[s] = times[s];
+		times[s] = delta;
+	}
+}
+
+/* Fold the per-CPU times into group->total, avgs_lock held */
+static bool collect_percpu_times(struct psi_group *group)
+{
+	u64 deltas[NR_PSI_AGG_STATES] = { 0, };
+	unsigned long nonidle_total = 0;
+	int cpu;
+	int s;
+
+	/*
+	 * Collect the per-cpu time buckets and average them into a
+	 * single time sample that is normalized to wallclock time.
+	 *
+	 * For averaging, each CPU is weighted by its non-idle time in
+	 * the sampling period. This eliminates artifacts from uneven
+	 * loading, or even entirely idle CPUs.
+	 */
+	for_each_possible_cpu(cpu) {
+		u32 times[NR_PSI_STATES];
+		u32 nonidle;
+
+		get_recent_times(group, cpu, times);
+
+		nonidle = nsecs_to_jiffies(times[PSI_NONIDLE]);
+		nonidle_total += nonidle;
+
+		for (s = 0; s < NR_PSI_AGG_STATES; s++)
+			deltas[s] += (u64)times[s] * nonidle;
+	}
+
+	/*
+	 * Integrate the sample into the running statistics that are
+	 * reported to userspace: the cumulative stall times and the
+	 * decaying averages.
+	 *
+	 * Pressure percentages are sampled at PSI_FREQ. We might be
+	 * called more often when the user polls more frequently than
+	 * that; we might be called less often when there is no task
+	 * activity, thus no data, and clock ticks are sporadic. The
+	 * below handles both.
+	 */
+	for (s = 0; s < NR_PSI_AGG_STATES; s++)
+		group->total[s] += div_u64(deltas[s], max(nonidle_total, 1UL));
+
+	return nonidle_total;
+}
+
+static unsigned long calc_load(unsigned long load, unsigned long exp,
+			       unsigned long active)
+{
+	unsigned long newload;
+
+	newload = load * exp + active * (FIXED_1 - exp);
+	if (active >= load)
+		newload += FIXED_1 - 1;
+
+	return newload / FIXED_1;
+}
+
+static void calc_avgs(unsigned long avg[3], int missed_periods,
+		      u64 time, u64 period)
+{
+	unsigned long pct;
+	int i;
+
+	/* Fill in zeroes for periods of no activity */
+	for (i = 0; i < missed_periods; i++) {
+		if (!avg[0] && !avg[1] && !avg[2])
+			break;
+		avg[0] = calc_load(avg[0], EXP_10s, 0);
+		avg[1] = calc_load(avg[1], EXP_60s, 0);
+		avg[2] = calc_load(avg[2], EXP_300s, 0);
+	}
+
+	/* Sample the most recent active period */
+	pct = div_u64(time * 100, period);
+	pct *= FIXED_1;
+	avg[0] = calc_load(avg[0], EXP_10s, pct);
+	avg[1] = calc_load(avg[1], EXP_60s, pct);
+	avg[2] = calc_load(avg[2], EXP_300s, pct);
+}
+
+/* Returns the time the averages are due next, avgs_lock held */
+static u64 update_averages(struct psi_group *group, u64 now)
+{
+	unsigned long missed_periods = 0;
+	u64 expires, period;
+	u64 avg_next_update;
+	int s;
+
+	/*
+	 * The periodic clock tick can get delayed for various
+	 * reasons, especially on loaded systems. To avoid clock
+	 * drift, we schedule the clock in fixed psi_period intervals.
+	 * But the deltas we sample out of the per-cpu buckets above
+	 * are based on the actual time elapsing between clock ticks.
+	 */
+	expires = group->avg_next_update;
+	if (now - expires >= psi_period)
+		missed_periods = div64_u64(now - expires, psi_period);
+
+	avg_next_update = expires + ((1 + missed_periods) * psi_period);
+	period = now - (group->avg_last_update + (missed_periods * psi_period));
+	group->avg_last_update = now;
+
+	for (s = 0; s < NR_PSI_AGG_STATES; s++) {
+		u64 sample;
+
+		sample = group->total[s] - group->avg_total[s];
+		/*
+		 * Due to the lockless sampling of the time buckets,
+		 * recorded time deltas can slip into the next period,
+		 * which under full pressure can result in samples in
+		 * excess of the period length.
+		 *
+		 * We don't want to report non-sensical pressures in
+		 * excess of 100%, nor do we want to drop such events
+		 * on the floor. Instead we punt any overage into the
+		 * future until pressure subsides. By doing this we
+		 * don't underreport the occurring pressure curve, we
+		 * just report it delayed by one period length.
+		 */
+		if (sample > period)
+			sample = period;
+		group->avg_total[s] += sample;
+		calc_avgs(group->avg[s], missed_periods, sample, period);
+	}
+
+	return avg_next_update;
+}
+
+static void psi_avgs_work(struct work_struct *work)
+{
+	struct delayed_work *dwork = to_delayed_work(work);
+	struct psi_group *group = container_of(dwork, struct psi_group,
+					       avgs_work);
+	bool nonidle;
+	u64 now;
+
+	mutex_lock(&group->avgs_lock);
+
+	now = sched_clock();
+
+	nonidle = collect_percpu_times(group);
+	/*
+	 * If there is task activity, periodically fold the per-cpu
+	 * times and feed samples into the running averages. If things
+	 * are idle and there is no data to process, stop the clock.
+	 * Once restarted, we'll catch up the running averages in one
+	 * go - see calc_avgs() and missed_periods.
+	 */
+	if (now >= group->avg_next_update)
+		group->avg_next_update = update_averages(group, now);
+
+	if (nonidle) {
+		schedule_delayed_work(dwork, nsecs_to_jiffies(
+				group->avg_next_update - now) + 1);
+	}
+
+	mutex_unlock(&group->avgs_lock);
+}
+
+static void window_reset(struct psi_window *win, u64 now, u64 value,
+			 u64 prev_growth)
+{
+	win->start_time = now;
+	win->start_value = value;
+	win->prev_growth = prev_growth;
+}
+
+/*
+ * PSI growth tracking window update and growth calculation routine.
+ *
+ * This approximates a sliding tracking window by interpolating
+ * partially elapsed windows using historical growth data from the
+ * previous intervals. This minimizes memory requirements (by not storing
+ * all the intermediate values in the previous window) and simplifies
+ * the calculations. It works well because PSI signal changes only in
+ * positive direction and over relatively small window sizes the growth
+ * is close to linear.
+ */
+static u64 window_update(struct psi_window *win, u64 now, u64 value)
+{
+	u64 elapsed;
+	u64 growth;
+
+	elapsed = now - win->start_time;
+	growth = value - win->start_value;
+	/*
+	 * After each tracking window passes win->start_value and
+	 * win->start_time get reset and win->prev_growth stores
+	 * the average per-window growth of the previous window.
+	 * win->prev_growth is then used to interpolate additional
+	 * growth from the previous window assuming it was linear.
+	 */
+	if (elapsed > win->size) {
+		window_reset(win, now, value, growth);
+	} else {
+		u64 remaining = win->size - elapsed;
+
+		growth += div64_u64(win->prev_growth * remaining, win->size);
+	}
+
+	return growth;
+}
+
+static void psi_poll_kick(struct psi_group *group)
+{
+	if (psi_ready && !delayed_work_pending(&group->poll_work))
+		schedule_delayed_work(&group->poll_work, PSI_POLL_PERIOD);
+}
+
+static void psi_poll_triggers(struct psi_group *group, u64 *total, u64 now)
+{
+	struct psi_trigger *t;
+
+	list_for_each_entry(t, &group->triggers, node) {
+		u64 growth;
+
+		growth = window_update(&t->win, now, total[t->state]);
+		if (growth < t->threshold)
+			continue;
+
+		/* Limit event signaling to once per window */
+		if (now < t->last_event_time + t->win.size)
+			continue;
+
+		/* Generate an event */
+		if (cmpxchg(&t->event, 0, 1) == 0)
+			wake_up_interruptible(&t->event_wait);
+		t->last_event_time = now;
+	}
+}
+
+/*
+ * Report the share of the last period that tasks spent stalled on
+ * memory to the in-kernel users. Returns true while there is pressure
+ * to report, so that the caller keeps polling.
+ */
+static bool psi_poll_notifiers(struct psi_group *group, u64 *total, u64 now)
+{
+	unsigned long pressure = 0;
+	u64 stall, period;
+
+	stall = total[PSI_MEM_SOME] - group->mem_total;
+	period = now - group->mem_time;
+	group->mem_total = total[PSI_MEM_SOME];
+	group->mem_time = now;
+
+	if (!atomic_read(&psi_mem_notifier_users))
+		return false;
+
+	if (period)
+		pressure = min_t(u64, div64_u64(stall * 100, period), 100);
+
+	/* Report once more when pressure went away, then go quiet */
+	if (pressure || group->mem_pressure)
+		blocking_notifier_call_chain(&psi_mem_notifier, pressure,
+					     NULL);
+	group->mem_pressure = pressure;
+
+	return pressure;
+}
+
+static void psi_poll_work(struct work_struct *work)
+{
+	struct delayed_work *dwork = to_delayed_work(work);
+	struct psi_group *group = container_of(dwork, struct psi_group,
+					       poll_work);
+	u64 total[NR_PSI_AGG_STATES];
+	bool again;
+	u64 now;
+
+	mutex_lock(&group->avgs_lock);
+	now = sched_clock();
+	collect_percpu_times(group);
+	memcpy(total, group->total, sizeof(total));
+	mutex_unlock(&group->avgs_lock);
+
+	mutex_lock(&group->trigger_lock);
+	psi_poll_triggers(group, total, now);
+	again = !list_empty(&group->triggers);
+	mutex_unlock(&group->trigger_lock);
+
+	if (psi_poll_notifiers(group, total, now))
+		again = true;
+
+	if (again)
+		schedule_delayed_work(dwork, PSI_POLL_PERIOD);
+}
+
+static void record_times(struct psi_group_cpu *groupc, u64 now)
+{
+	u32 delta;
+	int s;
+
+	delta = now - groupc->state_start;
+	groupc->state_start = now;
+
+	for (s = 0; s < NR_PSI_STATES; s++)
+		if (groupc->state_mask & (1 << s))
+			groupc->times[s] += delta;
+}
+
+static void psi_group_change(struct psi_group *group, int cpu,
+			     unsigned int clear, unsigned int set)
+{
+	struct psi_group_cpu *groupc = per_cpu_ptr(group->pcpu, cpu);
+	u32 state_mask = 0;
+	unsigned int t;
+	int s;
+
+	/*
+	 * First we assess the aggregate resource states this CPU's
+	 * tasks have been in since the last change, and account any
+	 * SOME and FULL time these may have resulted in.
+	 *
+	 * Then we update the task counts according to the state
+	 * change requested through the @clear and @set bits.
+	 */
+	write_seqcount_begin(&groupc->seq);
+
+	record_times(groupc, cpu_clock(cpu));
+
+	for (t = 0; t < NR_PSI_TASK_COUNTS; t++) {
+		if (!(clear & (1 << t)))
+			continue;
+		if (unlikely(!groupc->tasks[t])) {
+			if (!psi_bug) {
+				printk_deferred(KERN_ERR "psi: task underflow! cpu=%d t=%d tasks=[%u %u %u] clear=%x set=%x\n",
+						cpu, t, groupc->tasks[0],
+						groupc->tasks[1],
+						groupc->tasks[2], clear, set);
+				psi_bug = 1;
+			}
+			continue;
+		}
+		groupc->tasks[t]--;
+	}
+
+	for (t = 0; t < NR_PSI_TASK_COUNTS; t++)
+		if (set & (1 << t))
+			groupc->tasks[t]++;
+
+	/* Calculate state mask representing active states */
+	for (s = 0; s < NR_PSI_STATES; s++)
+		if (test_state(groupc->tasks, s))
+			state_mask |= (1 << s);
+	groupc->state_mask = state_mask;
+
+	write_seqcount_end(&groupc->seq);
+}
+
+/* Called with the task's rq lock held */
+void psi_task_change(struct task_struct *task, int clear, int set)
+{
+	struct psi_group *group = &psi_system;
+
+	if (!task->pid)
+		return;
+
+	if (((task->psi_flags & set) ||
+	     (task->psi_flags & clear) != clear) &&
+	    !psi_bug) {
+		printk_deferred(KERN_ERR "psi: inconsistent task state! task=%d:%s cpu=%d psi_flags=%x clear=%x set=%x\n",
+				task->pid, task->comm, task_cpu(task),
+				task->psi_flags, clear, set);
+		psi_bug = 1;
+	}
+
+	task->psi_flags &= ~clear;
+	task->psi_flags |= set;
+
+	psi_group_change(group, task_cpu(task), clear, set);
+
+	/* Only arms a timer, safe under the rq lock */
+	if (psi_ready && !delayed_work_pending(&group->avgs_work))
+		schedule_delayed_work(&group->avgs_work, PSI_FREQ);
+}
+
+/**
+ * psi_memstall_enter - mark the beginning of a memory stall section
+ * @flags: flags to handle nested sections
+ *
+ * Marks the calling task as being stalled due to a lack of memory,
+ * such as waiting for a refault or performing reclaim.
+ */
+void psi_memstall_enter(unsigned long *flags)
+{
+	unsigned long irqflags;
+	struct rq *rq;
+
+	if (unlikely(psi_disabled))
+		return;
+
+	*flags = current->flags & PF_MEMSTALL;
+	if (*flags)
+		return;
+	/*
+	 * PF_MEMSTALL setting & accounting needs to be atomic wrt
+	 * changes to the task's scheduling state, otherwise we can
+	 * race with CPU migration.
+	 */
+	local_irq_save(irqflags);
+	rq = this_rq();
+	raw_spin_lock(&rq->lock);
+
+	current->flags |= PF_MEMSTALL;
+	psi_task_change(current, 0, TSK_MEMSTALL);
+
+	raw_spin_unlock(&rq->lock);
+	local_irq_restore(irqflags);
+
+	if (atomic_read(&psi_mem_notifier_users))
+		psi_poll_kick(&psi_system);
+}
+
+/**
+ * psi_memstall_leave - mark the end of an memory stall section
+ * @flags: flags to handle nested memdelay sections
+ *
+ * Marks the calling task as no longer stalled due to lack of memory.
+ */
+void psi_memstall_leave(unsigned long *flags)
+{
+	unsigned long irqflags;
+	struct rq *rq;
+
+	if (unlikely(psi_disabled))
+		return;
+
+	if (*flags)
+		return;
+	/*
+	 * PF_MEMSTALL clearing & accounting needs to be atomic wrt
+	 * changes to the task's scheduling state, otherwise we could
+	 * race with CPU migration.
+	 */
+	local_irq_save(irqflags);
+	rq = this_rq();
+	raw_spin_lock(&rq->lock);
+
+	current->flags &= ~PF_MEMSTALL;
+	psi_task_change(current, TSK_MEMSTALL, 0);
+
+	raw_spin_unlock(&rq->lock);
+	local_irq_restore(irqflags);
+}
+
+int psi_mem_notifier_register(struct notifier_block *nb)
+{
+	int ret;
+
+	ret = blocking_notifier_chain_register(&psi_mem_notifier, nb);
+	if (!ret)
+		atomic_inc(&psi_mem_notifier_users);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(psi_mem_notifier_register);
+
+int psi_mem_notifier_unregister(struct notifier_block *nb)
+{
+	int ret;
+
+	ret = blocking_notifier_chain_unregister(&psi_mem_notifier, nb);
+	if (!ret)
+		atomic_dec(&psi_mem_notifier_users);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(psi_mem_notifier_unregister);
+
+static int psi_show(struct seq_file *m, struct psi_group *group,
+		    enum psi_res res)
+{
+	int full;
+	u64 now;
+
+	if (psi_disabled)
+		return -EOPNOTSUPP;
+
+	/* Update averages before reporting them */
+	mutex_lock(&group->avgs_lock);
+	now = sched_clock();
+	collect_percpu_times(group);
+	if (now >= group->avg_next_update)
+		group->avg_next_update = update_averages(group, now);
+
+	for (full = 0; full < 2 - (res == PSI_CPU); full++) {
+		unsigned long avg[3];
+		u64 total;
+		int w;
+
+		for (w = 0; w < 3; w++)
+			avg[w] = group->avg[res * 2 + full][w];
+		total = div_u64(group->total[res * 2 + full], NSEC_PER_USEC);
+
+		seq_printf(m, "%s avg10=%lu.%02lu avg60=%lu.%02lu avg300=%lu.%02lu total=%llu\n",
+			   full ? "full" : "some",
+			   LOAD_INT(avg[0]), LOAD_FRAC(avg[0]),
+			   LOAD_INT(avg[1]), LOAD_FRAC(avg[1]),
+			   LOAD_INT(avg[2]), LOAD_FRAC(avg[2]),
+			   total);
+	}
+	mutex_unlock(&group->avgs_lock);
+
+	return 0;
+}
+
+static struct psi_trigger *psi_trigger_create(struct psi_group *group,
+					      char *buf, enum psi_res res)
+{
+	struct psi_trigger *t;
+	enum psi_states state;
+	u32 threshold_us;
+	u32 window_us;
+	u64 now;
+
+	if (sscanf(buf, "some %u %u", &threshold_us, &window_us) == 2)
+		state = res * 2;
+	else if (sscanf(buf, "full %u %u", &threshold_us, &window_us) == 2)
+		state = res * 2 + 1;
+	else
+		return ERR_PTR(-EINVAL);
+
+	/* There is no full state for CPU */
+	if (state >= PSI_NONIDLE)
+		return ERR_PTR(-EINVAL);
+
+	if (window_us < WINDOW_MIN_US || window_us > WINDOW_MAX_US)
+		return ERR_PTR(-EINVAL);
+
+	/* Check threshold */
+	if (threshold_us == 0 || threshold_us > window_us)
+		return ERR_PTR(-EINVAL);
+
+	t = kzalloc(sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return ERR_PTR(-ENOMEM);
+
+	t->state = state;
+	t->threshold = threshold_us * NSEC_PER_USEC;
+	t->win.size = window_us * NSEC_PER_USEC;
+	init_waitqueue_head(&t->event_wait);
+
+	mutex_lock(&group->avgs_lock);
+	now = sched_clock();
+	collect_percpu_times(group);
+	window_reset(&t->win, now, group->total[state], 0);
+	mutex_unlock(&group->avgs_lock);
+
+	mutex_lock(&group->trigger_lock);
+	list_add(&t->node, &group->triggers);
+	mutex_unlock(&group->trigger_lock);
+
+	psi_poll_kick(group);
+
+	return t;
+}
+
+static void psi_trigger_destroy(struct psi_group *group,
+				struct psi_trigger *t)
+{
+	mutex_lock(&group->trigger_lock);
+	list_del(&t->node);
+	mutex_unlock(&group->trigger_lock);
+
+	/* Wake up pollers that might still be waiting on the trigger */
+	wake_up_interruptible(&t->event_wait);
+	kfree(t);
+}
+
+static int psi_io_show(struct seq_file *m, void *v)
+{
+	return psi_show(m, &psi_system, PSI_IO);
+}
+
+static int psi_memory_show(struct seq_file *m, void *v)
+{
+	return psi_show(m, &psi_system, PSI_MEM);
+}
+
+static int psi_cpu_show(struct seq_file *m, void *v)
+{
+	return psi_show(m, &psi_system, PSI_CPU);
+}
+
+static int psi_io_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, psi_io_show, NULL);
+}
+
+static int psi_memory_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, psi_memory_show, NULL);
+}
+
+static int psi_cpu_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, psi_cpu_show, NULL);
+}
+
+/* Serializes trigger creation and removal on the same open file */
+static DEFINE_MUTEX(psi_file_lock);
+
+static ssize_t psi_write(struct file *file, const char __user *user_buf,
+			 size_t nbytes, enum psi_res res)
+{
+	struct seq_file *seq = file->private_data;
+	struct psi_trigger *t;
+	char buf[32];
+	size_t buf_size;
+
+	if (psi_disabled)
+		return -EOPNOTSUPP;
+
+	if (!nbytes)
+		return -EINVAL;
+
+	buf_size = min(nbytes, sizeof(buf));
+	if (copy_from_user(buf, user_buf, buf_size))
+		return -EFAULT;
+
+	buf[buf_size - 1] = '\0';
+
+	mutex_lock(&psi_file_lock);
+
+	/* Allow only one trigger per file descriptor */
+	if (seq->private) {
+		mutex_unlock(&psi_file_lock);
+		return -EBUSY;
+	}
+
+	t = psi_trigger_create(&psi_system, buf, res);
+	if (IS_ERR(t)) {
+		mutex_unlock(&psi_file_lock);
+		return PTR_ERR(t);
+	}
+
+	seq->private = t;
+	mutex_unlock(&psi_file_lock);
+
+	return nbytes;
+}
+
+static ssize_t psi_io_write(struct file *file, const char __user *user_buf,
+			    size_t nbytes, loff_t *ppos)
+{
+	return psi_write(file, user_buf, nbytes, PSI_IO);
+}
+
+static ssize_t psi_memory_write(struct file *file,
+				const char __user *user_buf,
+				size_t nbytes, loff_t *ppos)
+{
+	return psi_write(file, user_buf, nbytes, PSI_MEM);
+}
+
+static ssize_t psi_cpu_write(struct file *file, const char __user *user_buf,
+			     size_t nbytes, loff_t *ppos)
+{
+	return psi_write(file, user_buf, nbytes, PSI_CPU);
+}
+
+static unsigned int psi_fop_poll(struct file *file, poll_table *wait)
+{
+	struct seq_file *seq = file->private_data;
+	struct psi_trigger *t;
+	unsigned int ret = DEFAULT_POLLMASK;
+
+	/* The trigger only goes away with the file, see psi_fop_release() */
+	t = READ_ONCE(seq->private);
+	if (!t)
+		return DEFAULT_POLLMASK | POLLERR | POLLPRI;
+
+	poll_wait(file, &t->event_wait, wait);
+
+	if (cmpxchg(&t->event, 1, 0) == 1)
+		ret |= POLLPRI;
+
+	return ret;
+}
+
+static int psi_fop_release(struct inode *inode, struct file *file)
+{
+	struct seq_file *seq = file->private_data;
+
+	if (seq->private)
+		psi_trigger_destroy(&psi_system, seq->private);
+	return single_release(inode, file);
+}
+
+static const struct file_operations psi_io_fops = {
+	.open		= psi_io_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.write		= psi_io_write,
+	.poll		= psi_fop_poll,
+	.release	= psi_fop_release,
+};
+
+static const struct file_operations psi_memory_fops = {
+	.open		= psi_memory_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.write		= psi_memory_write,
+	.poll		= psi_fop_poll,
+	.release	= psi_fop_release,
+};
+
+static const struct file_operations psi_cpu_fops = {
+	.open		= psi_cpu_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.write		= psi_cpu_write,
+	.poll		= psi_fop_poll,
+	.release	= psi_fop_release,
+};
+
+static int __init psi_proc_init(void)
+{
+	if (psi_disabled)
+		return 0;
+
+	proc_mkdir("pressure", NULL);
+	proc_create("pressure/io", S_IRUGO | S_IWUSR, NULL, &psi_io_fops);
+	proc_create("pressure/memory", S_IRUGO | S_IWUSR, NULL,
+		    &psi_memory_fops);
+	proc_create("pressure/cpu", S_IRUGO | S_IWUSR, NULL, &psi_cpu_fops);
+
+	psi_ready = true;
+	schedule_delayed_work(&psi_system.avgs_work, PSI_FREQ);
+
+	return 0;
+}
+core_initcall(psi_proc_init);
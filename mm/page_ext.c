@@ -60,6 +60,9 @@ static struct page_ext_operations *page_ext_ops[] = {
 #if defined(CONFIG_IDLE_PAGE_TRACKING) && !defined(CONFIG_64BIT)
 	&page_idle_ops,
 #endif
+#ifdef CONFIG_IDLE_PAGE_AGE
+	&page_idle_age_ops,
+#endif
 };
 
 static unsigned long total_usage;
@@ -4,6 +4,7 @@
 #include <linux/sysfs.h>
 #include <linux/kobject.h>
 #include <linux/mm.h>
+#include <linux/hugetlb.h>
 #include <linux/mmzone.h>
 #include <linux/pagemap.h>
 #include <linux/rmap.h>
@@ -218,6 +219,113 @@ struct page_ext_operations page_idle_ops = {
 };
 #endif
 
+#ifdef CONFIG_IDLE_PAGE_AGE
+static bool need_page_idle_age(void)
+{
+	return true;
+}
+struct page_ext_operations page_idle_age_ops = {
+	.need = need_page_idle_age,
+};
+
+static int idle_age_pte_range(pmd_t *pmd, unsigned long addr,
+			      unsigned long end, struct mm_walk *walk)
+{
+	unsigned long *hist = walk->private;
+	struct vm_area_struct *vma = walk->vma;
+	pte_t *orig_pte, *pte;
+	spinlock_t *ptl;
+
+	/* Transparent huge pages are not aged */
+	if (pmd_trans_unstable(pmd))
+		return 0;
+
+	orig_pte = pte = pte_offset_map_lock(walk->mm, pmd, addr, &ptl);
+	for (; addr != end; pte++, addr += PAGE_SIZE) {
+		struct page *page;
+		unsigned int age;
+		bool young;
+
+		if (!pte_present(*pte))
+			continue;
+
+		page = vm_normal_page(vma, addr, *pte);
+		if (!page || !PageAnon(page) || !PageLRU(page) ||
+		    page_mapcount(page) != 1)
+			continue;
+
+		/*
+		 * Same protocol as the page_idle bitmap: the accessed bit is
+		 * moved to the young flag so that reclaim still sees it, and
+		 * the idle flag is cleared by any reference in between.
+		 */
+		young = ptep_clear_young_notify(vma, addr, pte);
+		if (young)
+			set_page_young(page);
+
+		if (young || !page_is_idle(page))
+			age = 0;
+		else
+			age = min(page_idle_age(page) + 1, IDLE_AGE_MAX);
+
+		set_page_idle(page);
+		set_page_idle_age(page, age);
+		hist[idle_age_bucket(age)]++;
+	}
+	pte_unmap_unlock(orig_pte, ptl);
+	cond_resched();
+	return 0;
+}
+
+/**
+ * mm_idle_age_scan - age the anonymous pages of an mm by one pass
+ * @mm: mm to scan, the caller holds a reference on it
+ *
+ * Pages referenced since the previous pass restart at age 0, all others get
+ * one pass older. The resulting histogram replaces mm->idle_hist, which is
+ * left untouched if mmap_sem could not be taken without waiting.
+ */
+void mm_idle_age_scan(struct mm_struct *mm)
+{
+	unsigned long hist[NR_IDLE_AGE_BUCKETS] = { 0 };
+	struct vm_area_struct *vma;
+	struct mm_walk walk = {
+		.pmd_entry = idle_age_pte_range,
+		.mm = mm,
+		.private = hist,
+	};
+	int i;
+
+	if (!down_read_trylock(&mm->mmap_sem))
+		return;
+
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (vma->vm_file || is_vm_hugetlb_page(vma))
+			continue;
+		walk_page_range(vma->vm_start, vma->vm_end, &walk);
+	}
+	up_read(&mm->mmap_sem);
+
+	for (i = 0; i < NR_IDLE_AGE_BUCKETS; i++)
+		WRITE_ONCE(mm->idle_hist[i], hist[i]);
+}
+
+/*
+ * Number of pages idle for at least @min_age passes as of the last scan, with
+ * @min_age rounded down to the lowest age of its histogram bucket.
+ */
+unsigned long mm_idle_pages(struct mm_struct *mm, unsigned int min_age)
+{
+	unsigned long pages = 0;
+	int i;
+
+	for (i = idle_age_bucket(min_age); i < NR_IDLE_AGE_BUCKETS; i++)
+		pages += READ_ONCE(mm->idle_hist[i]);
+
+	return pages;
+}
+#endif /* CONFIG_IDLE_PAGE_AGE */
+
 static int __init page_idle_init(void)
 {
 	int err;
@@ -20,6 +20,10 @@
 #include <linux/rcupdate.h>
 #include <linux/notifier.h>
 #include <linux/vmpressure.h>
+#include <linux/psi.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/page_idle.h>
 
 #define CREATE_TRACE_POINTS
 #include <trace/events/process_reclaim.h>
@@ -48,10 +52,49 @@ static unsigned long pressure_max = 90;
 module_param_named(pressure_min, pressure_min, ulong, S_IRUGO | S_IWUSR);
 module_param_named(pressure_max, pressure_max, ulong, S_IRUGO | S_IWUSR);
 
+/*
+ * Use the memory stall percentage reported by PSI instead of vmpressure,
+ * and the region of it where process reclaim operates.
+ */
+static int use_psi;
+module_param_named(use_psi, use_psi, int, S_IRUGO | S_IWUSR);
+
+static unsigned long psi_pressure_min = 10;
+static unsigned long psi_pressure_max = 40;
+module_param_named(psi_pressure_min, psi_pressure_min, ulong,
+	S_IRUGO | S_IWUSR);
+module_param_named(psi_pressure_max, psi_pressure_max, ulong,
+	S_IRUGO | S_IWUSR);
+
 static short min_score_adj = 360;
 module_param_named(min_score_adj, min_score_adj, short,
 	S_IRUGO | S_IWUSR);
 
+#ifdef CONFIG_IDLE_PAGE_AGE
+/*
+ * While process reclaim is enabled, kidled ages the anonymous pages of the
+ * tasks at or above min_score_adj once every idle_age_period seconds. When
+ * min_idle_age is set, only pages which stayed idle for that many passes
+ * are reclaimed, and tasks are weighted by their number of such pages.
+ */
+static unsigned int idle_age_period = 120;
+module_param_named(idle_age_period, idle_age_period, uint,
+	S_IRUGO | S_IWUSR);
+
+static unsigned int min_idle_age;
+module_param_named(min_idle_age, min_idle_age, uint, S_IRUGO | S_IWUSR);
+
+static inline unsigned int reclaim_min_age(void)
+{
+	return READ_ONCE(min_idle_age);
+}
+#else
+static inline unsigned int reclaim_min_age(void)
+{
+	return 0;
+}
+#endif
+
 /*
  * Scheduling process reclaim workqueue unecessarily
  * when the reclaim efficiency is low does not make
@@ -122,6 +165,7 @@ static void swap_fn(struct work_struct *work)
 	int total_reclaimed = 0;
 	int nr_to_reclaim;
 	int efficiency;
+	unsigned int min_age = reclaim_min_age();
 
 	rcu_read_lock();
 	for_each_process(tsk) {
@@ -144,7 +188,10 @@ static void swap_fn(struct work_struct *work)
 			continue;
 		}
 
-		tasksize = get_mm_counter(p->mm, MM_ANONPAGES);
+		if (min_age)
+			tasksize = mm_idle_pages(p->mm, min_age);
+		else
+			tasksize = get_mm_counter(p->mm, MM_ANONPAGES);
 		task_unlock(p);
 
 		if (tasksize <= 0)
@@ -188,7 +235,7 @@ static void swap_fn(struct work_struct *work)
 		if (!nr_to_reclaim)
 			nr_to_reclaim = 1;
 
-		rp = reclaim_task_anon(selected[si].p, nr_to_reclaim);
+		rp = reclaim_task_anon(selected[si].p, nr_to_reclaim, min_age);
 
 		trace_process_reclaim(selected[si].tasksize,
 				selected[si].oom_score_adj, rp.nr_scanned,
@@ -217,23 +264,37 @@ static void swap_fn(struct work_struct *work)
 	}
 }
 
+static void process_reclaim_kick(unsigned long pressure,
+				 unsigned long min, unsigned long max)
+{
+	if (atomic_dec_if_positive(&skip_reclaim) >= 0)
+		return;
+
+	if ((pressure >= min) && (pressure < max))
+		if (!work_pending(&swap_work))
+			queue_work(system_unbound_wq, &swap_work);
+}
+
 static int vmpressure_notifier(struct notifier_block *nb,
 			unsigned long action, void *data)
 {
-	unsigned long pressure = action;
-
-	if (!enable_process_reclaim)
+	if (!enable_process_reclaim || use_psi)
 		return 0;
 
 	if (!current_is_kswapd())
 		return 0;
 
-	if (atomic_dec_if_positive(&skip_reclaim) >= 0)
+	process_reclaim_kick(action, pressure_min, pressure_max);
+	return 0;
+}
+
+static int psi_notifier(struct notifier_block *nb,
+			unsigned long action, void *data)
+{
+	if (!enable_process_reclaim || !use_psi)
 		return 0;
 
-	if ((pressure >= pressure_min) && (pressure < pressure_max))
-		if (!work_pending(&swap_work))
-			queue_work(system_unbound_wq, &swap_work);
+	process_reclaim_kick(action, psi_pressure_min, psi_pressure_max);
 	return 0;
 }
 
@@ -241,15 +302,105 @@ static struct notifier_block vmpr_nb = {
 	.notifier_call = vmpressure_notifier,
 };
 
+static struct notifier_block psi_nb = {
+	.notifier_call = psi_notifier,
+};
+
+#ifdef CONFIG_IDLE_PAGE_AGE
+static struct task_struct *kidled_task;
+
+/*
+ * Age the pages of one reclaim candidate, starting the search at thread
+ * group id @nr. Returns the id to continue from, or 0 once all have been
+ * visited.
+ */
+static int kidled_scan_next(int nr)
+{
+	struct task_struct *task, *p;
+	struct mm_struct *mm;
+	struct pid *pid;
+
+	rcu_read_lock();
+	for (;;) {
+		pid = find_ge_pid(nr, &init_pid_ns);
+		if (!pid) {
+			rcu_read_unlock();
+			return 0;
+		}
+		nr = pid_nr(pid) + 1;
+
+		task = pid_task(pid, PIDTYPE_PID);
+		if (!task || !has_group_leader_pid(task) ||
+		    (task->flags & PF_KTHREAD))
+			continue;
+
+		p = find_lock_task_mm(task);
+		if (!p)
+			continue;
+
+		if (p->signal->oom_score_adj < min_score_adj) {
+			task_unlock(p);
+			continue;
+		}
+
+		mm = p->mm;
+		atomic_inc(&mm->mm_users);
+		task_unlock(p);
+		break;
+	}
+	rcu_read_unlock();
+
+	mm_idle_age_scan(mm);
+	mmput(mm);
+	return nr;
+}
+
+static int kidled(void *unused)
+{
+	set_freezable();
+	set_user_nice(current, MAX_NICE);
+
+	while (!kthread_should_stop()) {
+		unsigned int period = READ_ONCE(idle_age_period);
+		int nr = 1;
+
+		if (enable_process_reclaim && period) {
+			while (nr && !kthread_should_stop()) {
+				nr = kidled_scan_next(nr);
+				try_to_freeze();
+				cond_resched();
+			}
+		}
+
+		schedule_timeout_interruptible((period ? period : 60) * HZ);
+		try_to_freeze();
+	}
+	return 0;
+}
+#endif
+
 static int __init process_reclaim_init(void)
 {
 	vmpressure_notifier_register(&vmpr_nb);
+	psi_mem_notifier_register(&psi_nb);
+#ifdef CONFIG_IDLE_PAGE_AGE
+	kidled_task = kthread_run(kidled, NULL, "kidled");
+	if (IS_ERR(kidled_task)) {
+		pr_err("process_reclaim: failed to start kidled\n");
+		kidled_task = NULL;
+	}
+#endif
 	return 0;
 }
 
 static void __exit process_reclaim_exit(void)
 {
+#ifdef CONFIG_IDLE_PAGE_AGE
+	if (kidled_task)
+		kthread_stop(kidled_task);
+#endif
 	vmpressure_notifier_unregister(&vmpr_nb);
+	psi_mem_notifier_unregister(&psi_nb);
 }
 
 module_init(process_reclaim_init);
@@ -0,0 +1,592 @@
+/*
+ * binder_stress - binder transaction throughput under contention
+ *
+ * The test becomes the binder context manager and runs rounds of
+ * 1, 2, 4, ... up to one client/server pair per CPU.  Every pair is two
+ * forked processes: the server registers a binder node with the context
+ * manager, the client looks it up and then issues synchronous
+ * BC_TRANSACTION/BC_REPLY round trips to it for a fixed time.  The
+ * aggregated number of transactions per second is printed for every
+ * round, so a driver that serializes all processes shows up as a flat
+ * line rather than one that scales with the number of pairs.
+ *
+ * Needs /dev/binder and must not run while servicemanager is up, since
+ * there can only be one context manager.
+ *
+ * Usage: binder_stress [-t seconds] [-p max_pairs]
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <linux/android/binder.h>
+
+#define BINDER_DEV		"/dev/binder"
+#define BINDER_VM_SIZE		(128 * 1024)
+
+/* transaction codes understood by the context manager and the servers */
+#define CODE_REGISTER		1
+#define CODE_LOOKUP		2
+#define CODE_PING		3
+#define CODE_QUIT		4
+
+struct bproc {
+	int fd;
+	void *map;
+};
+
+struct bcmd_txn {
+	uint32_t cmd;
+	struct binder_transaction_data tr;
+} __attribute__((packed));
+
+struct bcmd_free_reply {
+	uint32_t free_cmd;
+	binder_uintptr_t buffer;
+	uint32_t reply_cmd;
+	struct binder_transaction_data tr;
+} __attribute__((packed));
+
+struct bcmd_free_txn {
+	uint32_t free_cmd;
+	binder_uintptr_t buffer;
+	uint32_t txn_cmd;
+	struct binder_transaction_data tr;
+} __attribute__((packed));
+
+/* payload of CODE_REGISTER and CODE_LOOKUP */
+struct bmsg {
+	struct flat_binder_object obj;
+	uint32_t index;
+};
+
+static int duration = 2;
+
+static int binder_open(struct bproc *bp)
+{
+	struct binder_version version;
+
+	bp->fd = open(BINDER_DEV, O_RDWR | O_CLOEXEC);
+	if (bp->fd < 0)
+		return -errno;
+	if (ioctl(bp->fd, BINDER_VERSION, &version) < 0 ||
+	    version.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder protocol version mismatch\n");
+		close(bp->fd);
+		return -EPROTO;
+	}
+	bp->map = mmap(NULL, BINDER_VM_SIZE, PROT_READ, MAP_PRIVATE,
+		       bp->fd, 0);
+	if (bp->map == MAP_FAILED) {
+		close(bp->fd);
+		return -errno;
+	}
+	return 0;
+}
+
+static int binder_write_read(struct bproc *bp, void *wbuf, size_t wsize,
+			     void *rbuf, size_t rsize, size_t *consumed)
+{
+	struct binder_write_read bwr;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_buffer = (uintptr_t)wbuf;
+	bwr.write_size = wsize;
+	bwr.read_buffer = (uintptr_t)rbuf;
+	bwr.read_size = rsize;
+
+	do {
+		if (ioctl(bp->fd, BINDER_WRITE_READ, &bwr) >= 0)
+			break;
+		if (errno != EINTR)
+			return -errno;
+		/* only retry the part that did not make it */
+		bwr.write_buffer += bwr.write_consumed;
+		bwr.write_size -= bwr.write_consumed;
+		bwr.write_consumed = 0;
+	} while (1);
+
+	if (consumed)
+		*consumed = bwr.read_consumed;
+	return 0;
+}
+
+static int binder_write(struct bproc *bp, void *data, size_t size)
+{
+	return binder_write_read(bp, data, size, NULL, 0, NULL);
+}
+
+/*
+ * Read until a transaction or reply shows up, acknowledging reference
+ * count requests on the way.  @want is BR_TRANSACTION or BR_REPLY.
+ */
+static int binder_wait(struct bproc *bp, void *wbuf, size_t wsize,
+		       uint32_t want, struct binder_transaction_data *tr)
+{
+	uint32_t rbuf[128];
+
+	for (;;) {
+		size_t consumed;
+		char *ptr, *end;
+		int ret;
+
+		ret = binder_write_read(bp, wbuf, wsize, rbuf, sizeof(rbuf),
+					&consumed);
+		if (ret)
+			return ret;
+		wbuf = NULL;
+		wsize = 0;
+
+		ptr = (char *)rbuf;
+		end = ptr + consumed;
+		while (ptr < end) {
+			uint32_t cmd = *(uint32_t *)ptr;
+
+			ptr += sizeof(uint32_t);
+			switch (cmd) {
+			case BR_NOOP:
+			case BR_TRANSACTION_COMPLETE:
+			case BR_SPAWN_LOOPER:
+				break;
+			case BR_INCREFS:
+			case BR_ACQUIRE: {
+				struct {
+					uint32_t cmd;
+					struct binder_ptr_cookie pc;
+				} __attribute__((packed)) ack;
+
+				ack.cmd = cmd == BR_INCREFS ?
+					BC_INCREFS_DONE : BC_ACQUIRE_DONE;
+				memcpy(&ack.pc, ptr, sizeof(ack.pc));
+				ptr += sizeof(struct binder_ptr_cookie);
+				ret = binder_write(bp, &ack, sizeof(ack));
+				if (ret)
+					return ret;
+				break;
+			}
+			case BR_RELEASE:
+			case BR_DECREFS:
+				ptr += sizeof(struct binder_ptr_cookie);
+				break;
+			case BR_DEAD_BINDER:
+			case BR_CLEAR_DEATH_NOTIFICATION_DONE:
+				ptr += sizeof(binder_uintptr_t);
+				break;
+			case BR_TRANSACTION:
+			case BR_REPLY:
+				memcpy(tr, ptr, sizeof(*tr));
+				ptr += sizeof(*tr);
+				if (cmd != want) {
+					fprintf(stderr, "unexpected %s\n",
+						cmd == BR_REPLY ? "BR_REPLY" :
+						"BR_TRANSACTION");
+					return -EPROTO;
+				}
+				return 0;
+			case BR_DEAD_REPLY:
+				return -EPIPE;
+			case BR_FAILED_REPLY:
+				return -EIO;
+			default:
+				fprintf(stderr, "unknown return command %x\n",
+					cmd);
+				return -EPROTO;
+			}
+		}
+	}
+}
+
+static struct binder_transaction_data binder_txn(uint32_t handle,
+		uint32_t code, struct bmsg *msg, binder_size_t *offsets)
+{
+	struct binder_transaction_data tr;
+
+	memset(&tr, 0, sizeof(tr));
+	tr.target.handle = handle;
+	tr.code = code;
+	if (msg) {
+		tr.data_size = sizeof(*msg);
+		tr.data.ptr.buffer = (uintptr_t)msg;
+		if (msg->obj.type) {
+			offsets[0] = 0;
+			tr.offsets_size = sizeof(binder_size_t);
+			tr.data.ptr.offsets = (uintptr_t)offsets;
+		}
+	}
+	return tr;
+}
+
+static int binder_free_buffer(struct bproc *bp, binder_uintptr_t buffer)
+{
+	struct {
+		uint32_t cmd;
+		binder_uintptr_t buffer;
+	} __attribute__((packed)) fb = { BC_FREE_BUFFER, buffer };
+
+	return binder_write(bp, &fb, sizeof(fb));
+}
+
+static int binder_handle_cmd(struct bproc *bp, uint32_t cmd, uint32_t handle)
+{
+	struct {
+		uint32_t cmd;
+		uint32_t handle;
+	} __attribute__((packed)) hc = { cmd, handle };
+
+	return binder_write(bp, &hc, sizeof(hc));
+}
+
+/* Synchronous call whose reply carries nothing the caller needs. */
+static int binder_call(struct bproc *bp, uint32_t handle, uint32_t code,
+		       struct bmsg *msg, struct binder_transaction_data *reply)
+{
+	binder_size_t offsets[1];
+	struct bcmd_txn txn;
+	int ret;
+
+	txn.cmd = BC_TRANSACTION;
+	txn.tr = binder_txn(handle, code, msg, offsets);
+	ret = binder_wait(bp, &txn, sizeof(txn), BR_REPLY, reply);
+	if (ret)
+		return ret;
+	if (reply->flags & TF_STATUS_CODE) {
+		binder_free_buffer(bp, reply->data.ptr.buffer);
+		return -EIO;
+	}
+	return 0;
+}
+
+static void server_main(int index)
+{
+	struct binder_transaction_data tr;
+	struct bcmd_free_reply fr;
+	struct bproc bp;
+	struct bmsg msg;
+	uint32_t cmd;
+
+	if (binder_open(&bp))
+		exit(1);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.obj.type = BINDER_TYPE_BINDER;
+	msg.obj.flags = 0x7f | FLAT_BINDER_FLAG_ACCEPTS_FDS;
+	msg.obj.binder = index + 1;
+	msg.obj.cookie = index + 1;
+	msg.index = index;
+	if (binder_call(&bp, 0, CODE_REGISTER, &msg, &tr))
+		exit(1);
+	binder_free_buffer(&bp, tr.data.ptr.buffer);
+
+	cmd = BC_ENTER_LOOPER;
+	if (binder_write(&bp, &cmd, sizeof(cmd)))
+		exit(1);
+
+	fr.free_cmd = BC_FREE_BUFFER;
+	fr.reply_cmd = BC_REPLY;
+	memset(&fr.tr, 0, sizeof(fr.tr));
+	if (binder_wait(&bp, NULL, 0, BR_TRANSACTION, &tr))
+		exit(1);
+	for (;;) {
+		uint32_t code = tr.code;
+
+		/* Free the request and reply in one go, then wait again */
+		fr.buffer = tr.data.ptr.buffer;
+		if (code == CODE_QUIT) {
+			binder_write(&bp, &fr, sizeof(fr));
+			exit(0);
+		}
+		if (binder_wait(&bp, &fr, sizeof(fr), BR_TRANSACTION, &tr))
+			exit(1);
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void client_main(int index, int start_fd, int result_fd)
+{
+	struct binder_transaction_data tr;
+	struct bcmd_free_txn ft;
+	struct bcmd_txn txn;
+	unsigned long count = 0;
+	struct bproc bp;
+	struct bmsg msg;
+	uint32_t handle;
+	double end;
+	char c;
+
+	if (binder_open(&bp))
+		exit(1);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.index = index;
+	if (binder_call(&bp, 0, CODE_LOOKUP, &msg, &tr))
+		exit(1);
+	if (tr.data_size < sizeof(msg))
+		exit(1);
+	memcpy(&msg, (void *)(uintptr_t)tr.data.ptr.buffer, sizeof(msg));
+	handle = msg.obj.handle;
+	/* Keep the handle once the reply buffer is gone */
+	if (binder_handle_cmd(&bp, BC_ACQUIRE, handle))
+		exit(1);
+	binder_free_buffer(&bp, tr.data.ptr.buffer);
+
+	if (read(start_fd, &c, 1) != 1)
+		exit(1);
+
+	txn.cmd = BC_TRANSACTION;
+	txn.tr = binder_txn(handle, CODE_PING, NULL, NULL);
+	if (binder_wait(&bp, &txn, sizeof(txn), BR_REPLY, &tr))
+		exit(1);
+	count++;
+
+	ft.free_cmd = BC_FREE_BUFFER;
+	ft.txn_cmd = BC_TRANSACTION;
+	ft.tr = txn.tr;
+	end = now() + duration;
+	while (now() < end) {
+		ft.buffer = tr.data.ptr.buffer;
+		if (binder_wait(&bp, &ft, sizeof(ft), BR_REPLY, &tr))
+			exit(1);
+		count++;
+	}
+	binder_free_buffer(&bp, tr.data.ptr.buffer);
+
+	txn.tr.code = CODE_QUIT;
+	if (binder_wait(&bp, &txn, sizeof(txn), BR_REPLY, &tr))
+		exit(1);
+	binder_free_buffer(&bp, tr.data.ptr.buffer);
+
+	if (write(result_fd, &count, sizeof(count)) != sizeof(count))
+		exit(1);
+	exit(0);
+}
+
+/*
+ * Serve @nr registration or lookup requests as context manager.
+ * handles[] holds @pairs entries and is filled in on CODE_REGISTER.
+ */
+static int ctxmgr_serve(struct bproc *bp, int nr, int pairs,
+			uint32_t *handles)
+{
+	struct binder_transaction_data tr;
+	binder_size_t offsets[1];
+	struct bcmd_free_reply fr;
+	struct bmsg msg;
+	int ret;
+
+	while (nr--) {
+		ret = binder_wait(bp, NULL, 0, BR_TRANSACTION, &tr);
+		if (ret)
+			return ret;
+		if (tr.data_size < sizeof(msg)) {
+			binder_free_buffer(bp, tr.data.ptr.buffer);
+			return -EPROTO;
+		}
+		memcpy(&msg, (void *)(uintptr_t)tr.data.ptr.buffer,
+		       sizeof(msg));
+		if (msg.index >= pairs) {
+			binder_free_buffer(bp, tr.data.ptr.buffer);
+			return -EPROTO;
+		}
+
+		fr.free_cmd = BC_FREE_BUFFER;
+		fr.buffer = tr.data.ptr.buffer;
+		fr.reply_cmd = BC_REPLY;
+		if (tr.code == CODE_REGISTER) {
+			handles[msg.index] = msg.obj.handle;
+			/* The ref would go away with the buffer otherwise */
+			ret = binder_handle_cmd(bp, BC_ACQUIRE,
+						msg.obj.handle);
+			if (ret)
+				return ret;
+			fr.tr = binder_txn(0, 0, NULL, NULL);
+		} else {
+			memset(&msg.obj, 0, sizeof(msg.obj));
+			msg.obj.type = BINDER_TYPE_HANDLE;
+			msg.obj.handle = handles[msg.index];
+			fr.tr = binder_txn(0, 0, &msg, offsets);
+		}
+		ret = binder_write(bp, &fr, sizeof(fr));
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int wait_children(pid_t *pids, int nr)
+{
+	int i, status, failed = 0;
+
+	for (i = 0; i < nr; i++) {
+		if (pids[i] <= 0)
+			continue;
+		if (waitpid(pids[i], &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status))
+			failed = 1;
+	}
+	return failed;
+}
+
+static int run_round(struct bproc *bp, int pairs)
+{
+	int start_pipe[2], result_pipe[2];
+	unsigned long total = 0, count;
+	pid_t *servers, *clients;
+	uint32_t *handles;
+	int i, ret = 0;
+
+	servers = calloc(pairs, sizeof(*servers));
+	clients = calloc(pairs, sizeof(*clients));
+	handles = calloc(pairs, sizeof(*handles));
+	if (!servers || !clients || !handles)
+		return -ENOMEM;
+	if (pipe(start_pipe) || pipe(result_pipe))
+		return -errno;
+
+	for (i = 0; i < pairs; i++) {
+		servers[i] = fork();
+		if (servers[i] == 0)
+			server_main(i);
+		if (servers[i] < 0)
+			ret = -errno;
+	}
+	if (!ret)
+		ret = ctxmgr_serve(bp, pairs, pairs, handles);
+
+	for (i = 0; !ret && i < pairs; i++) {
+		clients[i] = fork();
+		if (clients[i] == 0) {
+			close(start_pipe[1]);
+			close(result_pipe[0]);
+			client_main(i, start_pipe[0], result_pipe[1]);
+		}
+		if (clients[i] < 0)
+			ret = -errno;
+	}
+	if (!ret)
+		ret = ctxmgr_serve(bp, pairs, pairs, handles);
+	close(start_pipe[0]);
+	close(result_pipe[1]);
+
+	if (!ret) {
+		/* Release all clients at once */
+		char go[pairs];
+
+		memset(go, 'g', pairs);
+		if (write(start_pipe[1], go, pairs) != pairs)
+			ret = -EIO;
+		for (i = 0; !ret && i < pairs; i++) {
+			if (read(result_pipe[0], &count, sizeof(count)) !=
+			    sizeof(count)) {
+				ret = -EIO;
+				break;
+			}
+			total += count;
+		}
+	}
+	close(start_pipe[1]);
+	close(result_pipe[0]);
+
+	if (ret) {
+		for (i = 0; i < pairs; i++) {
+			if (servers[i] > 0)
+				kill(servers[i], SIGKILL);
+			if (clients[i] > 0)
+				kill(clients[i], SIGKILL);
+		}
+	}
+	if (wait_children(clients, pairs) | wait_children(servers, pairs))
+		ret = ret ? ret : -ECHILD;
+
+	for (i = 0; i < pairs; i++)
+		if (handles[i])
+			binder_handle_cmd(bp, BC_RELEASE, handles[i]);
+
+	if (!ret)
+		printf("%3d pair(s): %10lu transactions, %10.0f transactions/s\n",
+		       pairs, total, (double)total / duration);
+
+	free(servers);
+	free(clients);
+	free(handles);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int max_pairs = ncpus > 0 ? ncpus : 1;
+	struct bproc bp;
+	uint32_t cmd;
+	int pairs, opt, ret;
+
+	while ((opt = getopt(argc, argv, "t:p:")) != -1) {
+		switch (opt) {
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'p':
+			max_pairs = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t seconds] [-p max_pairs]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (duration < 1 || max_pairs < 1) {
+		fprintf(stderr, "invalid arguments\n");
+		return 1;
+	}
+
+	ret = binder_open(&bp);
+	if (ret) {
+		printf("binder_stress: %s not available: %s [SKIP]\n",
+		       BINDER_DEV, strerror(-ret));
+		return 0;
+	}
+	if (ioctl(bp.fd, BINDER_SET_CONTEXT_MGR, 0) < 0) {
+		printf("binder_stress: can't become context manager: %s [SKIP]\n",
+		       strerror(errno));
+		return 0;
+	}
+	cmd = BC_ENTER_LOOPER;
+	if (binder_write(&bp, &cmd, sizeof(cmd)))
+		return 1;
+
+	printf("binder_stress: %d second(s) per round, up to %d pair(s)\n",
+	       duration, max_pairs);
+	for (pairs = 1; ; pairs *= 2) {
+		if (pairs > max_pairs)
+			pairs = max_pairs;
+		ret = run_round(&bp, pairs);
+		if (ret) {
+			printf("binder_stress: %d pair(s) failed: %s [FAIL]\n",
+			       pairs, strerror(-ret));
+			return 1;
+		}
+		if (pairs == max_pairs)
+			break;
+	}
+	printf("binder_stress: [PASS]\n");
+	return 0;
+}
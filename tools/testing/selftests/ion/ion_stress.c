@@ -0,0 +1,223 @@
+/*
+ * ion_stress - ion handle ioctl throughput with many threads per client
+ *
+ * All threads share one /dev/ion client.  Each allocates a buffer of
+ * its own and then loops for a fixed time over ION_IOC_SHARE,
+ * ION_IOC_IMPORT and ION_IOC_FREE on it, which are the ioctls that look
+ * handles up by id or by buffer.  Rounds run with 1, 2, 4, ... up to
+ * one thread per CPU and the aggregated number of ioctls per second is
+ * printed for every round, so a client lock that serializes the lookups
+ * shows up as a flat line rather than one that scales with the threads.
+ *
+ * Usage: ion_stress [-t seconds] [-n max_threads] [-m heap_id_mask]
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "ion.h"
+
+#define ION_DEV			"/dev/ion"
+#define ION_STRESS_LEN		4096
+
+struct stress_thread {
+	pthread_t tid;
+	ion_user_handle_t handle;
+	unsigned long count;
+	int err;
+};
+
+static int ion_fd;
+static int duration = 2;
+static unsigned int heap_mask = ~0U;
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+static int started, aborted;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int ion_alloc_handle(ion_user_handle_t *handle)
+{
+	struct ion_allocation_data alloc;
+
+	memset(&alloc, 0, sizeof(alloc));
+	alloc.len = ION_STRESS_LEN;
+	alloc.align = ION_STRESS_LEN;
+	alloc.heap_id_mask = heap_mask;
+	if (ioctl(ion_fd, ION_IOC_ALLOC, &alloc) < 0)
+		return -errno;
+	*handle = alloc.handle;
+	return 0;
+}
+
+static int ion_free_handle(ion_user_handle_t handle)
+{
+	struct ion_handle_data data = { .handle = handle };
+
+	if (ioctl(ion_fd, ION_IOC_FREE, &data) < 0)
+		return -errno;
+	return 0;
+}
+
+/*
+ * Share the buffer and import it back: the import finds the existing
+ * handle and takes another reference, which the free drops again.
+ */
+static int share_import_free(ion_user_handle_t handle)
+{
+	struct ion_fd_data data = { .handle = handle };
+	int ret = 0;
+
+	if (ioctl(ion_fd, ION_IOC_SHARE, &data) < 0)
+		return -errno;
+	if (ioctl(ion_fd, ION_IOC_IMPORT, &data) < 0)
+		ret = -errno;
+	else if (data.handle != handle)
+		ret = -EPROTO;
+	else
+		ret = ion_free_handle(data.handle);
+	close(data.fd);
+	return ret;
+}
+
+static void *stress_main(void *arg)
+{
+	struct stress_thread *st = arg;
+	double end;
+
+	pthread_mutex_lock(&start_lock);
+	while (!started)
+		pthread_cond_wait(&start_cond, &start_lock);
+	pthread_mutex_unlock(&start_lock);
+	if (aborted)
+		return NULL;
+
+	end = now() + duration;
+	while (!st->err && now() < end) {
+		st->err = share_import_free(st->handle);
+		if (!st->err)
+			st->count += 3;
+	}
+	return NULL;
+}
+
+static int run_round(int nr)
+{
+	struct stress_thread *threads;
+	unsigned long total = 0;
+	int i, created, ret = 0;
+
+	threads = calloc(nr, sizeof(*threads));
+	if (!threads)
+		return -ENOMEM;
+	for (i = 0; i < nr; i++) {
+		ret = ion_alloc_handle(&threads[i].handle);
+		if (ret) {
+			while (i--)
+				ion_free_handle(threads[i].handle);
+			free(threads);
+			return ret;
+		}
+	}
+
+	started = aborted = 0;
+	for (created = 0; created < nr; created++) {
+		ret = -pthread_create(&threads[created].tid, NULL,
+				      stress_main, &threads[created]);
+		if (ret)
+			break;
+	}
+
+	/* Release all threads at once, or just let them exit */
+	pthread_mutex_lock(&start_lock);
+	started = 1;
+	aborted = !!ret;
+	pthread_cond_broadcast(&start_cond);
+	pthread_mutex_unlock(&start_lock);
+
+	for (i = 0; i < created; i++) {
+		pthread_join(threads[i].tid, NULL);
+		if (threads[i].err && !ret)
+			ret = threads[i].err;
+		total += threads[i].count;
+	}
+
+	for (i = 0; i < nr; i++)
+		ion_free_handle(threads[i].handle);
+
+	if (!ret)
+		printf("%3d thread(s): %10lu ioctls, %10.0f ioctls/s\n",
+		       nr, total, (double)total / duration);
+
+	free(threads);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int max_threads = ncpus > 0 ? ncpus : 1;
+	int nr, opt, ret;
+
+	while ((opt = getopt(argc, argv, "t:n:m:")) != -1) {
+		switch (opt) {
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'n':
+			max_threads = atoi(optarg);
+			break;
+		case 'm':
+			heap_mask = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t seconds] [-n max_threads] [-m heap_id_mask]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (duration < 1 || max_threads < 1 || !heap_mask) {
+		fprintf(stderr, "invalid arguments\n");
+		return 1;
+	}
+
+	ion_fd = open(ION_DEV, O_RDONLY | O_CLOEXEC);
+	if (ion_fd < 0) {
+		printf("ion_stress: %s not available: %s [SKIP]\n",
+		       ION_DEV, strerror(errno));
+		return 0;
+	}
+
+	printf("ion_stress: %d second(s) per round, up to %d thread(s)\n",
+	       duration, max_threads);
+	for (nr = 1; ; nr *= 2) {
+		if (nr > max_threads)
+			nr = max_threads;
+		ret = run_round(nr);
+		if (ret) {
+			printf("ion_stress: %d thread(s) failed: %s [FAIL]\n",
+			       nr, strerror(-ret));
+			return 1;
+		}
+		if (nr == max_threads)
+			break;
+	}
+	printf("ion_stress: [PASS]\n");
+	return 0;
+}
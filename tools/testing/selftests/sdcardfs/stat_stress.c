@@ -0,0 +1,249 @@
+/*
+ * stat_stress - parallel stat() throughput on an sdcardfs tree
+ *
+ * Builds a tree of directories and files below the given sdcardfs
+ * directory, the way a media scanner sees it, and then runs rounds of
+ * 1, 2, 4, ... up to one thread per CPU that stat() every file of the
+ * tree over and over for a fixed time.  The aggregated number of stat()
+ * calls per second is printed for every round, so lookups serializing
+ * on a global lock show up as a flat line rather than one that scales
+ * with the number of threads.  The tree is removed afterwards.
+ *
+ * Usage: stat_stress [-t seconds] [-n max_threads] [-d dirs] [-f files]
+ *                    [directory]
+ *
+ * The directory defaults to /sdcard and must be on sdcardfs.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+#define SDCARDFS_SUPER_MAGIC	0xb550ca10
+#define TREE_NAME		"stat_stress.tmp"
+
+struct stress_thread {
+	pthread_t tid;
+	int index;
+	unsigned long count;
+	int err;
+};
+
+static int duration = 2;
+static int nr_dirs = 64;
+static int nr_files = 64;
+static char root[PATH_MAX / 2];
+
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+static int started, aborted;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void tree_path(char *buf, int dir, int file)
+{
+	if (file < 0)
+		snprintf(buf, PATH_MAX, "%s/d%03d", root, dir);
+	else
+		snprintf(buf, PATH_MAX, "%s/d%03d/f%03d", root, dir, file);
+}
+
+static void tree_remove(void)
+{
+	char path[PATH_MAX];
+	int d, f;
+
+	for (d = 0; d < nr_dirs; d++) {
+		for (f = 0; f < nr_files; f++) {
+			tree_path(path, d, f);
+			unlink(path);
+		}
+		tree_path(path, d, -1);
+		rmdir(path);
+	}
+	rmdir(root);
+}
+
+static int tree_create(void)
+{
+	char path[PATH_MAX];
+	int d, f, fd;
+
+	if (mkdir(root, 0775) && errno != EEXIST)
+		return -errno;
+	for (d = 0; d < nr_dirs; d++) {
+		tree_path(path, d, -1);
+		if (mkdir(path, 0775) && errno != EEXIST)
+			return -errno;
+		for (f = 0; f < nr_files; f++) {
+			tree_path(path, d, f);
+			fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0664);
+			if (fd < 0)
+				return -errno;
+			close(fd);
+		}
+	}
+	return 0;
+}
+
+static void *stress_main(void *arg)
+{
+	struct stress_thread *st = arg;
+	char path[PATH_MAX];
+	struct stat sb;
+	double end;
+	int d, f;
+
+	pthread_mutex_lock(&start_lock);
+	while (!started)
+		pthread_cond_wait(&start_cond, &start_lock);
+	pthread_mutex_unlock(&start_lock);
+	if (aborted)
+		return NULL;
+
+	/* start every thread in a different directory */
+	d = st->index % nr_dirs;
+	end = now() + duration;
+	while (now() < end) {
+		for (f = 0; f < nr_files; f++) {
+			tree_path(path, d, f);
+			if (stat(path, &sb)) {
+				st->err = -errno;
+				return NULL;
+			}
+		}
+		st->count += nr_files;
+		d = (d + 1) % nr_dirs;
+	}
+	return NULL;
+}
+
+static int run_round(int nr)
+{
+	struct stress_thread *threads;
+	unsigned long total = 0;
+	int i, created, ret = 0;
+
+	threads = calloc(nr, sizeof(*threads));
+	if (!threads)
+		return -ENOMEM;
+
+	started = aborted = 0;
+	for (created = 0; created < nr; created++) {
+		threads[created].index = created;
+		ret = -pthread_create(&threads[created].tid, NULL,
+				      stress_main, &threads[created]);
+		if (ret)
+			break;
+	}
+
+	/* Release all threads at once, or just let them exit */
+	pthread_mutex_lock(&start_lock);
+	started = 1;
+	aborted = !!ret;
+	pthread_cond_broadcast(&start_cond);
+	pthread_mutex_unlock(&start_lock);
+
+	for (i = 0; i < created; i++) {
+		pthread_join(threads[i].tid, NULL);
+		if (threads[i].err && !ret)
+			ret = threads[i].err;
+		total += threads[i].count;
+	}
+
+	if (!ret)
+		printf("%3d thread(s): %10lu stats, %10.0f stats/s\n",
+		       nr, total, (double)total / duration);
+
+	free(threads);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int max_threads = ncpus > 0 ? ncpus : 1;
+	const char *dir = "/sdcard";
+	struct statfs sfs;
+	int nr, opt, ret;
+
+	while ((opt = getopt(argc, argv, "t:n:d:f:")) != -1) {
+		switch (opt) {
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'n':
+			max_threads = atoi(optarg);
+			break;
+		case 'd':
+			nr_dirs = atoi(optarg);
+			break;
+		case 'f':
+			nr_files = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t seconds] [-n max_threads] [-d dirs] [-f files] [directory]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc)
+		dir = argv[optind];
+	if (duration < 1 || max_threads < 1 || nr_dirs < 1 || nr_dirs > 1000 ||
+	    nr_files < 1 || nr_files > 1000) {
+		fprintf(stderr, "invalid arguments\n");
+		return 1;
+	}
+
+	if (statfs(dir, &sfs) || sfs.f_type != SDCARDFS_SUPER_MAGIC) {
+		printf("stat_stress: %s is not on sdcardfs [SKIP]\n", dir);
+		return 0;
+	}
+	snprintf(root, sizeof(root), "%s/" TREE_NAME, dir);
+
+	ret = tree_create();
+	if (ret) {
+		printf("stat_stress: can't create tree in %s: %s [FAIL]\n",
+		       dir, strerror(-ret));
+		tree_remove();
+		return 1;
+	}
+
+	printf("stat_stress: %d second(s) per round, %d files, up to %d thread(s)\n",
+	       duration, nr_dirs * nr_files, max_threads);
+	for (nr = 1; ; nr *= 2) {
+		if (nr > max_threads)
+			nr = max_threads;
+		ret = run_round(nr);
+		if (ret) {
+			printf("stat_stress: %d thread(s) failed: %s [FAIL]\n",
+			       nr, strerror(-ret));
+			break;
+		}
+		if (nr == max_threads)
+			break;
+	}
+	tree_remove();
+	if (ret)
+		return 1;
+	printf("stat_stress: [PASS]\n");
+	return 0;
+}
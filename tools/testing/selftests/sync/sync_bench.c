@@ -0,0 +1,230 @@
+/*
+ * sync_bench - sync fence merge and poll throughput on sw_sync timelines
+ *
+ * The merge test keeps one accumulated fence and for a fixed time
+ * repeatedly merges it with a new fence on one of a few sw_sync
+ * timelines, the way a compositor folds release fences together.  The
+ * accumulated fence must never hold more than one point per timeline.
+ * The poll tests then call poll() with a zero timeout on a signaled and
+ * on an active fence.  Every test prints its calls per second.
+ *
+ * Needs /dev/sw_sync (CONFIG_SW_SYNC_USER).
+ *
+ * Usage: sync_bench [-t seconds] [-n timelines]
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "sw_sync.h"
+#include "sync.h"
+
+#define SW_SYNC_DEV		"/dev/sw_sync"
+#define MAX_TIMELINES		64
+
+static int duration = 2;
+static int nr_timelines = 4;
+static int timelines[MAX_TIMELINES];
+static __u32 values[MAX_TIMELINES];
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Create a fence on timeline @t that signals once it is incremented */
+static int fence_create(int t)
+{
+	struct sw_sync_create_fence_data data;
+
+	memset(&data, 0, sizeof(data));
+	data.value = ++values[t];
+	strcpy(data.name, "sync_bench");
+	if (ioctl(timelines[t], SW_SYNC_IOC_CREATE_FENCE, &data) < 0)
+		return -errno;
+	return data.fence;
+}
+
+static int fence_merge(int fd1, int fd2)
+{
+	struct sync_merge_data data;
+
+	memset(&data, 0, sizeof(data));
+	data.fd2 = fd2;
+	strcpy(data.name, "sync_bench_merged");
+	if (ioctl(fd1, SYNC_IOC_MERGE, &data) < 0)
+		return -errno;
+	return data.fence;
+}
+
+static int fence_nr_pts(int fd)
+{
+	struct sync_fence_info_data *info;
+	struct sync_pt_info *pt;
+	__u32 size = 4096, pos;
+	int nr = 0;
+
+	info = calloc(1, size);
+	if (!info)
+		return -ENOMEM;
+	info->len = size;
+	if (ioctl(fd, SYNC_IOC_FENCE_INFO, info) < 0) {
+		nr = -errno;
+		goto out;
+	}
+	for (pos = sizeof(*info); pos < info->len; pos += pt->len) {
+		pt = (struct sync_pt_info *)((char *)info + pos);
+		if (!pt->len)
+			break;
+		nr++;
+	}
+out:
+	free(info);
+	return nr;
+}
+
+static int timeline_inc(int t, __u32 count)
+{
+	if (ioctl(timelines[t], SW_SYNC_IOC_INC, &count) < 0)
+		return -errno;
+	return 0;
+}
+
+static int bench_merge(void)
+{
+	unsigned long count = 0;
+	int acc, fd, merged, t, nr;
+	double end;
+
+	acc = fence_create(0);
+	if (acc < 0)
+		return acc;
+
+	end = now() + duration;
+	for (t = 1; now() < end; t = (t + 1) % nr_timelines) {
+		fd = fence_create(t);
+		if (fd < 0) {
+			close(acc);
+			return fd;
+		}
+		merged = fence_merge(acc, fd);
+		close(fd);
+		close(acc);
+		if (merged < 0)
+			return merged;
+		acc = merged;
+		count++;
+	}
+
+	nr = fence_nr_pts(acc);
+	close(acc);
+	if (nr < 0)
+		return nr;
+	printf("merge:          %10lu merges, %10.0f merges/s, %d pt(s) left\n",
+	       count, (double)count / duration, nr);
+	return nr > nr_timelines ? -E2BIG : 0;
+}
+
+static int bench_poll(const char *name, int fd, short expect)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	unsigned long count = 0;
+	double end;
+
+	end = now() + duration;
+	while (now() < end) {
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) < 0)
+			return -errno;
+		if (pfd.revents != expect)
+			return -EPROTO;
+		count++;
+	}
+	printf("poll %-9s %10lu polls,  %10.0f polls/s\n",
+	       name, count, (double)count / duration);
+	return 0;
+}
+
+static int bench_polls(void)
+{
+	int active, signaled, ret;
+
+	signaled = fence_create(0);
+	if (signaled < 0)
+		return signaled;
+	ret = timeline_inc(0, 1);
+	if (!ret)
+		ret = bench_poll("signaled:", signaled, POLLIN);
+	close(signaled);
+	if (ret)
+		return ret;
+
+	active = fence_create(0);
+	if (active < 0)
+		return active;
+	ret = bench_poll("active:", active, 0);
+	close(active);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int i, opt, ret;
+
+	while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+		switch (opt) {
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'n':
+			nr_timelines = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t seconds] [-n timelines]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (duration < 1 || nr_timelines < 1 || nr_timelines > MAX_TIMELINES) {
+		fprintf(stderr, "invalid arguments\n");
+		return 1;
+	}
+
+	/* every open of the device is a new timeline */
+	for (i = 0; i < nr_timelines; i++) {
+		timelines[i] = open(SW_SYNC_DEV, O_RDWR | O_CLOEXEC);
+		if (timelines[i] < 0) {
+			printf("sync_bench: %s not available: %s [SKIP]\n",
+			       SW_SYNC_DEV, strerror(errno));
+			return 0;
+		}
+	}
+
+	printf("sync_bench: %d second(s) per test, %d timeline(s)\n",
+	       duration, nr_timelines);
+	ret = bench_merge();
+	if (!ret)
+		ret = bench_polls();
+	for (i = 0; i < nr_timelines; i++)
+		close(timelines[i]);
+	if (ret) {
+		printf("sync_bench: %s [FAIL]\n", strerror(-ret));
+		return 1;
+	}
+	printf("sync_bench: [PASS]\n");
+	return 0;
+}